@@ -0,0 +1,153 @@
+#include "apngbatch.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
+
+#include "apngcontext.h"
+
+// Header and the first displayed frame of `device`, nothing after it, on
+// the calling thread
+static QImage decodeFirstFrame(QIODevice *device,
+                               const APNGHandler::DecodeLimits &limits,
+                               APNGHandler::DecodeError *error,
+                               qint64 *bytesRead)
+{
+    *error = APNGHandler::InvalidData;
+    if (!APNGHandler::canRead(device)) {
+        qWarning() << "no read";
+        return QImage();
+    }
+    if (!device->isSequential()) {
+        device->seek(0);
+    }
+    // No scan: it would visit every chunk header of the file
+    ApngContext ctx;
+    ctx.device        = device;
+    ctx.limits        = limits;
+    ctx.decodeThreads = 1;
+    mapFile(&ctx, device);
+    decodeFrames(&ctx, 1);
+    const QImage image
+        = ctx.decodedFrames() > 0 ? ctx.store.value(0) : QImage();
+    finishDecode(&ctx);
+    unmapFile(&ctx);
+
+    *bytesRead = ctx.readStats.bytesFed;
+    if (!image.isNull()) {
+        *error = APNGHandler::NoError;
+    }
+    else if (ctx.error != APNGHandler::NoError) {
+        *error = ctx.error;
+    }
+    return image;
+}
+
+// One file of a firstFrames() batch
+struct FirstFrameJob : public QRunnable {
+    QIODevice *device = nullptr;  // or `path`, opened here
+    QString path;
+    APNGHandler::DecodeLimits limits;
+
+    APNGHandler::FirstFrame result;
+    qint64 bytesRead = 0;
+
+    void run() override
+    {
+        QFile file;
+        QIODevice *input = device;
+        if (!input) {
+            file.setFileName(path);
+            if (!file.open(QIODevice::ReadOnly)) {
+                qWarning() << "firstFrames: can't open" << path;
+                result.error = APNGHandler::InvalidData;
+                return;
+            }
+            input = &file;
+        }
+        result.image = decodeFirstFrame(input, limits, &result.error,
+                                        &bytesRead);
+    }
+};
+
+// Runs `jobs` on a pool of its own, so a batch neither waits for nor
+// crowds out QThreadPool::globalInstance()
+static QVector<APNGHandler::FirstFrame>
+runFirstFrames(const QVector<FirstFrameJob *> &jobs,
+               int threads,
+               APNGHandler::BatchStats *stats)
+{
+    QElapsedTimer timer;
+    timer.start();
+    if (threads <= 0) {
+        threads = QThread::idealThreadCount();
+    }
+    threads = qMax(1, qMin(threads, int(jobs.size())));
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads);
+    for (FirstFrameJob *job : jobs) {
+        pool.start(job);
+    }
+    pool.waitForDone();
+
+    QVector<APNGHandler::FirstFrame> results;
+    results.reserve(jobs.size());
+    APNGHandler::BatchStats batch;
+    batch.files   = jobs.size();
+    batch.threads = threads;
+    for (FirstFrameJob *job : jobs) {
+        if (job->result.image.isNull()) {
+            batch.failures++;
+        }
+        batch.bytesRead += job->bytesRead;
+        results.push_back(job->result);
+        delete job;
+    }
+
+    batch.elapsedNs = qMax<qint64>(1, timer.nsecsElapsed());
+    const double seconds  = batch.elapsedNs / 1e9;
+    batch.filesPerSecond  = batch.files / seconds;
+    batch.megabytesPerSec = batch.bytesRead / (1024.0 * 1024.0) / seconds;
+    if (stats) {
+        *stats = batch;
+    }
+    return results;
+}
+
+QVector<APNGHandler::FirstFrame>
+apngFirstFrames(const QVector<QIODevice *> &devices,
+                const APNGHandler::DecodeLimits &limits,
+                int threads,
+                APNGHandler::BatchStats *stats)
+{
+    QVector<FirstFrameJob *> jobs;
+    for (QIODevice *device : devices) {
+        auto job = new FirstFrameJob;
+        job->setAutoDelete(false);
+        job->device = device;
+        job->limits = limits;
+        jobs.push_back(job);
+    }
+    return runFirstFrames(jobs, threads, stats);
+}
+
+QVector<APNGHandler::FirstFrame>
+apngFirstFrames(const QStringList &paths,
+                const APNGHandler::DecodeLimits &limits,
+                int threads,
+                APNGHandler::BatchStats *stats)
+{
+    QVector<FirstFrameJob *> jobs;
+    for (const QString &path : paths) {
+        auto job = new FirstFrameJob;
+        job->setAutoDelete(false);
+        job->path   = path;
+        job->limits = limits;
+        jobs.push_back(job);
+    }
+    return runFirstFrames(jobs, threads, stats);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <QStringList>
+#include <QVector>
+
+#include "apnghandler.h"
+
+class QIODevice;
+
+// APNGHandler::firstFrames() under `limits`: the first displayed frame of
+// every device or path, each decoded on one worker of a pool of its own
+QVector<APNGHandler::FirstFrame>
+apngFirstFrames(const QVector<QIODevice *> &devices,
+                const APNGHandler::DecodeLimits &limits,
+                int threads,
+                APNGHandler::BatchStats *stats);
+QVector<APNGHandler::FirstFrame>
+apngFirstFrames(const QStringList &paths,
+                const APNGHandler::DecodeLimits &limits,
+                int threads,
+                APNGHandler::BatchStats *stats);
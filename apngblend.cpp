@@ -0,0 +1,467 @@
+#include "apngblend.h"
+
+#include <cstring>
+
+#ifdef Q_PROCESSOR_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(Q_PROCESSOR_X86) && (defined(__GNUC__) || defined(__clang__))
+#define APNG_TARGET_SSE2 __attribute__((target("sse2")))
+#define APNG_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define APNG_TARGET_SSE2
+#define APNG_TARGET_AVX2
+#endif
+
+void apngCopyRow(quint32 *dst, const quint32 *src, int count)
+{
+    memcpy(dst, src, size_t(count) * sizeof(quint32));
+}
+
+void apngClearRow(quint32 *dst, int count)
+{
+    memset(dst, 0, size_t(count) * sizeof(quint32));
+}
+
+void apngBlendIndexedRow(uchar *dst, const uchar *src, int count,
+                         const uchar *alpha)
+{
+    for (int i = 0; i < count; i++) {
+        if (alpha[src[i]]) {
+            dst[i] = src[i];
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// OVER
+// Straight alpha, with a = alpha / 255:
+//   outA = sa + da * (1 - sa)
+//   outC = (sc * sa + dc * da * (1 - sa)) / outA
+// Scaled by 255 * 255 everything is an integer, and every kernel rounds
+// the exact quotient to nearest (ties up):
+//   den  = sa * 255 + da * (255 - sa)           (outA * 255)
+//   outA = (2 * den + 255) / 510
+//   outC = (2 * (sc * sa * 255 + dc * da * (255 - sa)) + den) / (2 * den)
+// Callers handle sa == 0 and sa == 255, so den is never 0.
+
+static inline quint32 blendPixel(quint32 s, quint32 d)
+{
+    const quint32 sa  = s >> 24;
+    const quint32 da  = d >> 24;
+    const quint32 ws  = sa * 255;
+    const quint32 wd  = da * (255 - sa);
+    const quint32 den = ws + wd;
+
+    quint32 out = ((2 * den + 255) / 510) << 24;
+    for (int shift = 0; shift < 24; shift += 8) {
+        const quint32 sc  = (s >> shift) & 0xff;
+        const quint32 dc  = (d >> shift) & 0xff;
+        const quint32 num = sc * ws + dc * wd;
+        out |= ((2 * num + den) / (2 * den)) << shift;
+    }
+    return out;
+}
+
+static void blendRowScalar(quint32 *dst, const quint32 *src, int count)
+{
+    for (int i = 0; i < count; i++) {
+        const quint32 s  = src[i];
+        const quint32 sa = s >> 24;
+        if (sa == 0xff) {
+            dst[i] = s;
+        }
+        else if (sa != 0) {
+            dst[i] = blendPixel(s, dst[i]);
+        }
+    }
+}
+
+/// premultiplied
+// x * a / 255 on the four channels of x, rounded to nearest; two channels
+// per multiply. The rounding bias goes in before the (t >> 8) correction,
+// otherwise some products come out one too low.
+static inline quint32 byteMul(quint32 x, quint32 a)
+{
+    quint32 t = (x & 0xff00ff) * a + 0x800080;
+    t         = ((t + ((t >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+    x         = ((x >> 8) & 0xff00ff) * a + 0x800080;
+    x         = (x + ((x >> 8) & 0xff00ff)) & 0xff00ff00;
+    return x | t;
+}
+
+void apngPremultiplyRow(quint32 *row, int count)
+{
+    for (int i = 0; i < count; i++) {
+        const quint32 a = row[i] >> 24;
+        if (a == 0) {
+            row[i] = 0;
+        }
+        else if (a != 0xff) {
+            row[i] = (byteMul(row[i], a) & 0x00ffffff) | (a << 24);
+        }
+    }
+}
+
+// Valid premultiplied input can't overflow a channel:
+// sc + dc * (255 - sa) / 255 <= sa + 255 - sa
+static void blendRowPremultipliedScalar(quint32 *dst, const quint32 *src,
+                                        int count)
+{
+    for (int i = 0; i < count; i++) {
+        const quint32 s  = src[i];
+        const quint32 sa = s >> 24;
+        if (sa == 0xff) {
+            dst[i] = s;
+        }
+        else if (sa != 0) {
+            dst[i] = s + byteMul(dst[i], 255 - sa);
+        }
+    }
+}
+
+#ifdef Q_PROCESSOR_X86
+// The SIMD kernels hold one channel of 4 (SSE2) or 8 (AVX2) pixels per
+// register, as floats. sc * sa * 255 + dc * da * (255 - sa) <= 255 * den
+// stays below 2^24, so every product and sum is exact; only the quotient
+// is estimated, from 1 / den, and the exact remainder then moves it by
+// one where needed. That gives blendPixel()'s result bit for bit.
+
+// num / den rounded to nearest (ties up) for integers num < 2^24 and
+// 0 < den <= 65025, given rcp ~ 1 / den. The estimate is well within one
+// of the result, which has -den <= 2 * (num - q * den) < den.
+APNG_TARGET_SSE2 static inline __m128 roundDivSse2(__m128 num, __m128 den,
+                                                   __m128 rcp)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 q         = _mm_add_ps(_mm_mul_ps(num, rcp), _mm_set1_ps(0.5f));
+    q                = _mm_cvtepi32_ps(_mm_cvttps_epi32(q));
+    __m128 r         = _mm_sub_ps(num, _mm_mul_ps(q, den));
+    r                = _mm_add_ps(r, r);
+    const __m128 low = _mm_cmplt_ps(r, _mm_sub_ps(_mm_setzero_ps(), den));
+    q                = _mm_sub_ps(q, _mm_and_ps(low, one));
+    return _mm_add_ps(q, _mm_and_ps(_mm_cmpge_ps(r, den), one));
+}
+
+// blendPixel() on 4 pixels at once, whatever their alpha
+APNG_TARGET_SSE2 static inline __m128i blendPixelsSse2(__m128i s, __m128i d)
+{
+    const __m128i byteMask = _mm_set1_epi32(0xff);
+    const __m128 c255      = _mm_set1_ps(255.0f);
+
+    const __m128 sa = _mm_cvtepi32_ps(_mm_srli_epi32(s, 24));
+    const __m128 da = _mm_cvtepi32_ps(_mm_srli_epi32(d, 24));
+    const __m128 ws = _mm_mul_ps(sa, c255);
+    const __m128 wd = _mm_mul_ps(da, _mm_sub_ps(c255, sa));
+    // Lanes with den == 0 (both transparent) are thrown away by the caller
+    const __m128 den = _mm_max_ps(_mm_add_ps(ws, wd), _mm_set1_ps(1.0f));
+    const __m128 rcp = _mm_div_ps(_mm_set1_ps(1.0f), den);
+
+    const __m128 alpha
+        = roundDivSse2(den, c255, _mm_set1_ps(1.0f / 255.0f));
+    __m128i out = _mm_slli_epi32(_mm_cvttps_epi32(alpha), 24);
+    for (int shift = 0; shift < 24; shift += 8) {
+        const __m128i count = _mm_cvtsi32_si128(shift);
+        const __m128 sc     = _mm_cvtepi32_ps(
+            _mm_and_si128(_mm_srl_epi32(s, count), byteMask));
+        const __m128 dc = _mm_cvtepi32_ps(
+            _mm_and_si128(_mm_srl_epi32(d, count), byteMask));
+        const __m128 num = _mm_add_ps(_mm_mul_ps(sc, ws), _mm_mul_ps(dc, wd));
+        const __m128i q  = _mm_cvttps_epi32(roundDivSse2(num, den, rcp));
+        out              = _mm_or_si128(out, _mm_sll_epi32(q, count));
+    }
+    return out;
+}
+
+APNG_TARGET_SSE2 static inline __m128i selectSse2(__m128i mask, __m128i a,
+                                                  __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+APNG_TARGET_SSE2 static void blendRowSse2(quint32 *dst, const quint32 *src,
+                                          int count)
+{
+    const __m128i alphaMask = _mm_set1_epi32(int(0xff000000));
+    const __m128i zero      = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+            src + i));
+        const __m128i a      = _mm_and_si128(s, alphaMask);
+        const __m128i opaque = _mm_cmpeq_epi32(a, alphaMask);
+        if (_mm_movemask_epi8(opaque) == 0xffff) {
+            // opaque run
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), s);
+            continue;
+        }
+        const __m128i transparent = _mm_cmpeq_epi32(a, zero);
+        if (_mm_movemask_epi8(transparent) == 0xffff) {
+            // transparent run
+            continue;
+        }
+        const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+            dst + i));
+        __m128i out = blendPixelsSse2(s, d);
+        out         = selectSse2(opaque, s, out);
+        out         = selectSse2(transparent, d, out);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), out);
+    }
+    blendRowScalar(dst + i, src + i, count - i);
+}
+
+// byteMul() on eight 16-bit channels
+APNG_TARGET_SSE2 static inline __m128i byteMulSse2(__m128i x, __m128i a)
+{
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, a), _mm_set1_epi16(0x80));
+    t         = _mm_add_epi16(t, _mm_srli_epi16(t, 8));
+    return _mm_srli_epi16(t, 8);
+}
+
+APNG_TARGET_SSE2 static void blendRowPremultipliedSse2(quint32 *dst,
+                                                       const quint32 *src,
+                                                       int count)
+{
+    const __m128i alphaMask = _mm_set1_epi32(int(0xff000000));
+    const __m128i zero      = _mm_setzero_si128();
+    const __m128i full      = _mm_set1_epi16(0xff);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+            src + i));
+        const __m128i a = _mm_and_si128(s, alphaMask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, alphaMask)) == 0xffff) {
+            // opaque run
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), s);
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, zero)) == 0xffff) {
+            // transparent run
+            continue;
+        }
+        const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+            dst + i));
+
+        // 255 - sa, spread over the four channels of each pixel
+        const __m128i sLo = _mm_unpacklo_epi8(s, zero);
+        const __m128i sHi = _mm_unpackhi_epi8(s, zero);
+        __m128i invLo     = _mm_shufflelo_epi16(sLo, _MM_SHUFFLE(3, 3, 3, 3));
+        invLo = _mm_shufflehi_epi16(invLo, _MM_SHUFFLE(3, 3, 3, 3));
+        __m128i invHi = _mm_shufflelo_epi16(sHi, _MM_SHUFFLE(3, 3, 3, 3));
+        invHi         = _mm_shufflehi_epi16(invHi, _MM_SHUFFLE(3, 3, 3, 3));
+        invLo         = _mm_sub_epi16(full, invLo);
+        invHi         = _mm_sub_epi16(full, invHi);
+
+        const __m128i dLo = byteMulSse2(_mm_unpacklo_epi8(d, zero), invLo);
+        const __m128i dHi = byteMulSse2(_mm_unpackhi_epi8(d, zero), invHi);
+        const __m128i out = _mm_add_epi8(s, _mm_packus_epi16(dLo, dHi));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), out);
+    }
+    blendRowPremultipliedScalar(dst + i, src + i, count - i);
+}
+
+// roundDivSse2() on 8 lanes
+APNG_TARGET_AVX2 static inline __m256 roundDivAvx2(__m256 num, __m256 den,
+                                                   __m256 rcp)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 q = _mm256_add_ps(_mm256_mul_ps(num, rcp), _mm256_set1_ps(0.5f));
+    q        = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(q));
+    __m256 r = _mm256_sub_ps(num, _mm256_mul_ps(q, den));
+    r        = _mm256_add_ps(r, r);
+    const __m256 low
+        = _mm256_cmp_ps(r, _mm256_sub_ps(_mm256_setzero_ps(), den), _CMP_LT_OQ);
+    q = _mm256_sub_ps(q, _mm256_and_ps(low, one));
+    return _mm256_add_ps(
+        q, _mm256_and_ps(_mm256_cmp_ps(r, den, _CMP_GE_OQ), one));
+}
+
+// blendPixelsSse2() on 8 pixels
+APNG_TARGET_AVX2 static inline __m256i blendPixelsAvx2(__m256i s, __m256i d)
+{
+    const __m256i byteMask = _mm256_set1_epi32(0xff);
+    const __m256 c255      = _mm256_set1_ps(255.0f);
+
+    const __m256 sa  = _mm256_cvtepi32_ps(_mm256_srli_epi32(s, 24));
+    const __m256 da  = _mm256_cvtepi32_ps(_mm256_srli_epi32(d, 24));
+    const __m256 ws  = _mm256_mul_ps(sa, c255);
+    const __m256 wd  = _mm256_mul_ps(da, _mm256_sub_ps(c255, sa));
+    const __m256 den = _mm256_max_ps(_mm256_add_ps(ws, wd),
+                                     _mm256_set1_ps(1.0f));
+    const __m256 rcp = _mm256_div_ps(_mm256_set1_ps(1.0f), den);
+
+    const __m256 alpha
+        = roundDivAvx2(den, c255, _mm256_set1_ps(1.0f / 255.0f));
+    __m256i out = _mm256_slli_epi32(_mm256_cvttps_epi32(alpha), 24);
+    for (int shift = 0; shift < 24; shift += 8) {
+        const __m128i count = _mm_cvtsi32_si128(shift);
+        const __m256 sc     = _mm256_cvtepi32_ps(
+            _mm256_and_si256(_mm256_srl_epi32(s, count), byteMask));
+        const __m256 dc = _mm256_cvtepi32_ps(
+            _mm256_and_si256(_mm256_srl_epi32(d, count), byteMask));
+        const __m256 num
+            = _mm256_add_ps(_mm256_mul_ps(sc, ws), _mm256_mul_ps(dc, wd));
+        const __m256i q = _mm256_cvttps_epi32(roundDivAvx2(num, den, rcp));
+        out             = _mm256_or_si256(out, _mm256_sll_epi32(q, count));
+    }
+    return out;
+}
+
+APNG_TARGET_AVX2 static void blendRowAvx2(quint32 *dst, const quint32 *src,
+                                          int count)
+{
+    const __m256i alphaMask = _mm256_set1_epi32(int(0xff000000));
+    const __m256i zero      = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i s = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(src + i));
+        const __m256i a      = _mm256_and_si256(s, alphaMask);
+        const __m256i opaque = _mm256_cmpeq_epi32(a, alphaMask);
+        if (_mm256_movemask_epi8(opaque) == -1) {
+            // opaque run
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), s);
+            continue;
+        }
+        const __m256i transparent = _mm256_cmpeq_epi32(a, zero);
+        if (_mm256_movemask_epi8(transparent) == -1) {
+            // transparent run
+            continue;
+        }
+        const __m256i d = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(dst + i));
+        __m256i out = blendPixelsAvx2(s, d);
+        out         = _mm256_blendv_epi8(out, s, opaque);
+        out         = _mm256_blendv_epi8(out, d, transparent);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), out);
+    }
+    blendRowScalar(dst + i, src + i, count - i);
+}
+
+/// CPU detection
+static void cpuid(unsigned int leaf, unsigned int sub, unsigned int out[4])
+{
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuidex(regs, int(leaf), int(sub));
+    for (int i = 0; i < 4; i++) {
+        out[i] = unsigned(regs[i]);
+    }
+#else
+    __cpuid_count(leaf, sub, out[0], out[1], out[2], out[3]);
+#endif
+}
+
+static quint64 xgetbv0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    quint32 lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return (quint64(hi) << 32) | lo;
+#endif
+}
+
+static ApngKernel detectKernel()
+{
+    unsigned int r[4];
+    cpuid(0, 0, r);
+    const unsigned int maxLeaf = r[0];
+    if (maxLeaf < 1) {
+        return ApngKernelScalar;
+    }
+
+    cpuid(1, 0, r);
+    const bool sse2    = (r[3] & (1u << 26)) != 0;
+    const bool osxsave = (r[2] & (1u << 27)) != 0;
+    const bool avx     = (r[2] & (1u << 28)) != 0;
+    if (!sse2) {
+        return ApngKernelScalar;
+    }
+    // AVX state must be enabled by the OS, not just present
+    if (maxLeaf >= 7 && osxsave && avx && (xgetbv0() & 0x6) == 0x6) {
+        cpuid(7, 0, r);
+        if (r[1] & (1u << 5)) {
+            return ApngKernelAvx2;
+        }
+    }
+    return ApngKernelSse2;
+}
+#else
+static ApngKernel detectKernel()
+{
+    return ApngKernelScalar;
+}
+#endif
+
+ApngKernel apngBestKernel()
+{
+    static const ApngKernel kernel = detectKernel();
+    return kernel;
+}
+
+void apngBlendRowWith(ApngKernel kernel, quint32 *dst, const quint32 *src,
+                      int count)
+{
+    switch (kernel) {
+#ifdef Q_PROCESSOR_X86
+    case ApngKernelAvx2:
+        blendRowAvx2(dst, src, count);
+        return;
+    case ApngKernelSse2:
+        blendRowSse2(dst, src, count);
+        return;
+#endif
+    default:
+        blendRowScalar(dst, src, count);
+        return;
+    }
+}
+
+void apngBlendRow(quint32 *dst, const quint32 *src, int count)
+{
+    typedef void (*BlendRowFn)(quint32 *, const quint32 *, int);
+    static const BlendRowFn fn = []() -> BlendRowFn {
+        switch (apngBestKernel()) {
+#ifdef Q_PROCESSOR_X86
+        case ApngKernelAvx2:
+            return blendRowAvx2;
+        case ApngKernelSse2:
+            return blendRowSse2;
+#endif
+        default:
+            return blendRowScalar;
+        }
+    }();
+    fn(dst, src, count);
+}
+
+void apngBlendRowPremultipliedWith(ApngKernel kernel, quint32 *dst,
+                                   const quint32 *src, int count)
+{
+#ifdef Q_PROCESSOR_X86
+    if (kernel != ApngKernelScalar) {
+        blendRowPremultipliedSse2(dst, src, count);
+        return;
+    }
+#else
+    Q_UNUSED(kernel);
+#endif
+    blendRowPremultipliedScalar(dst, src, count);
+}
+
+void apngBlendRowPremultiplied(quint32 *dst, const quint32 *src, int count)
+{
+    static const ApngKernel kernel = apngBestKernel();
+    apngBlendRowPremultipliedWith(kernel, dst, src, count);
+}
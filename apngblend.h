@@ -0,0 +1,47 @@
+#pragma once
+
+#include <QtGlobal>
+
+// Row kernels over QImage::Format_ARGB32 pixels. Frame rows from libpng
+// are set up to have the same layout, see setupTransforms().
+
+// PNG_BLEND_OP_SOURCE: overwrite
+void apngCopyRow(quint32 *dst, const quint32 *src, int count);
+// PNG_BLEND_OP_OVER: straight alpha blend of `src` onto `dst`, rounded to
+// nearest. Uses the best kernel the CPU supports.
+void apngBlendRow(quint32 *dst, const quint32 *src, int count);
+// PNG_DISPOSE_OP_BACKGROUND: fully transparent black
+void apngClearRow(quint32 *dst, int count);
+
+// QImage::Format_ARGB32_Premultiplied canvases. Copy and clear are the
+// same as above.
+// Straight to premultiplied in place, rounded to nearest
+void apngPremultiplyRow(quint32 *row, int count);
+// OVER on premultiplied pixels: dst = src + dst * (1 - src alpha)
+void apngBlendRowPremultiplied(quint32 *dst, const quint32 *src, int count);
+
+// QImage::Format_Indexed8 canvases whose palette entries are either opaque
+// or fully transparent, so OVER picks one of the two pixels: `src`
+// replaces `dst` wherever `alpha[src]` is not 0
+void apngBlendIndexedRow(uchar *dst, const uchar *src, int count,
+                         const uchar *alpha);
+
+// Kernel selection, for tests and benchmarks. All kernels produce the
+// same output.
+enum ApngKernel {
+    ApngKernelScalar,
+    ApngKernelSse2,
+    ApngKernelAvx2,
+};
+
+// Picked once from CPUID
+ApngKernel apngBestKernel();
+void apngBlendRowWith(ApngKernel kernel,
+                      quint32 *dst,
+                      const quint32 *src,
+                      int count);
+// AVX2 falls back to SSE2 here, 4 pixels per step are plenty for this one
+void apngBlendRowPremultipliedWith(ApngKernel kernel,
+                                   quint32 *dst,
+                                   const quint32 *src,
+                                   int count);
@@ -0,0 +1,499 @@
+#include "apngcache.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QThreadPool>
+
+#include <cstring>
+
+#include "zlib.h"
+
+// Disk cache file, native byte order, written by save():
+//   DiskHeader
+//   key bytes, padded to 8
+//   DiskFrame per frame
+//   frame pixels, each bytesPerLine * height, starting at 64 byte offsets;
+//   a frame with an empty dirty rectangle points at the previous pixels
+// The header `crc` covers everything up to the pixels (with crc itself
+// zeroed) and is checked when the file is opened. Each frame has a CRC of
+// its pixels too, checked when the frame is first handed out: doing that
+// on open would read the whole mapping. Bump kDiskVersion when any of
+// this changes.
+static const char kDiskMagic[8]  = {'A', 'P', 'N', 'G', 'C', 'A', 'C', 'H'};
+static const quint32 kDiskVersion = 3;
+static const quint32 kByteOrder   = 0x01020304;
+
+struct DiskHeader {
+    char magic[8];
+    quint32 version;
+    quint32 byteOrder;  // kByteOrder as the writer saw it
+    quint32 keyBytes;
+    quint32 format;     // QImage::Format
+    qint32 width;
+    qint32 height;
+    qint32 bytesPerLine;
+    qint32 loopCount;
+    qint32 frameCount;
+    quint32 crc;
+};
+
+struct DiskFrame {
+    quint64 offset;  // of the pixels
+    qint32 delay;    // ms
+    qint32 x, y, width, height;  // dirty rectangle
+    quint32 crc;                 // of the pixels
+};
+
+static_assert(sizeof(DiskHeader) == 48, "DiskHeader layout");
+static_assert(sizeof(DiskFrame) == 32, "DiskFrame layout");
+
+static qint64 alignUp(qint64 value, qint64 alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static quint32 crc(quint32 crc, const void *data, qint64 size)
+{
+    auto p = static_cast<const Bytef *>(data);
+    while (size > 0) {
+        const uInt n = uInt(qMin<qint64>(size, 1 << 30));
+        crc          = quint32(crc32(crc, p, n));
+        p += n;
+        size -= n;
+    }
+    return crc;
+}
+
+bool ApngAnimation::isIntact(int index) const
+{
+    if (index < 0 || index >= crcs.size()) {
+        return true;
+    }
+    // Racing threads both compute the same answer, no lock needed
+    QAtomicInt &state = checked[index];
+    if (state.loadAcquire() == 0) {
+        const QImage &frame = frames.at(index);
+        const quint32 sum   = crc(0, frame.constBits(),
+                                  qint64(frame.bytesPerLine()) * frame.height());
+        state.storeRelease(sum == crcs.at(index) ? 1 : -1);
+    }
+    return state.loadAcquire() > 0;
+}
+
+// Keeps a mapping alive for as long as any frame uses it
+struct DiskMapping {
+    QFile file;
+};
+
+static void releaseMapping(void *info)
+{
+    delete static_cast<QSharedPointer<DiskMapping> *>(info);
+}
+
+// Saves an animation off the thread that decoded it
+struct ApngAnimationCache::DiskWrite : public QRunnable {
+    ApngAnimationCache *cache = nullptr;
+    QString directory;
+    QByteArray key;
+    QSharedPointer<const ApngAnimation> animation;
+
+    void run() override
+    {
+        QDir().mkpath(directory);
+        const bool saved = save(diskPath(directory, key), key, *animation);
+        QMutexLocker lock(&cache->m_mutex);
+        if (saved) {
+            ++cache->m_stats.diskWrites;
+        }
+        cache->m_writing.remove(key);
+        cache->m_written.wakeAll();
+    }
+};
+
+ApngAnimationCache *ApngAnimationCache::instance()
+{
+    static ApngAnimationCache cache;
+    return &cache;
+}
+
+ApngAnimationCache::~ApngAnimationCache()
+{
+    waitForDiskWrites();
+}
+
+QByteArray ApngAnimationCache::key(QIODevice *device,
+                                   QImage::Format format,
+                                   const QRect &clipRect,
+                                   const QSize &scaledSize)
+{
+    if (!device || device->isSequential() || !device->isReadable()) {
+        return QByteArray();
+    }
+
+    QByteArray key;
+    auto file = qobject_cast<QFileDevice *>(device);
+    if (file && !file->fileName().isEmpty()) {
+        // Cheap, and good enough for files that are replaced, not edited
+        // in place within the mtime resolution
+        const QFileInfo info(file->fileName());
+        key = "file:" + info.absoluteFilePath().toUtf8() + ":"
+              + QByteArray::number(info.size()) + ":"
+              + QByteArray::number(info.lastModified().toMSecsSinceEpoch());
+    }
+    else {
+        // Hashing reads the data once, still a lot cheaper than inflating
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        const qint64 pos = device->pos();
+        if (!device->seek(0)) {
+            return QByteArray();
+        }
+        QByteArray block(64 * 1024, Qt::Uninitialized);
+        for (;;) {
+            const qint64 n = device->read(block.data(), block.size());
+            if (n <= 0) {
+                break;
+            }
+            hash.addData(block.constData(), int(n));
+        }
+        device->seek(pos);
+        key = "sha1:" + hash.result().toHex();
+    }
+
+    key += ":" + QByteArray::number(int(format)) + ":"
+           + QByteArray::number(clipRect.x()) + ","
+           + QByteArray::number(clipRect.y()) + ","
+           + QByteArray::number(clipRect.width()) + ","
+           + QByteArray::number(clipRect.height()) + ":"
+           + QByteArray::number(scaledSize.width()) + "x"
+           + QByteArray::number(scaledSize.height());
+    return key;
+}
+
+void ApngAnimationCache::setBudget(qint64 bytes)
+{
+    QMutexLocker lock(&m_mutex);
+    m_budget = bytes;
+    evict();
+}
+
+qint64 ApngAnimationCache::budget() const
+{
+    QMutexLocker lock(&m_mutex);
+    return m_budget;
+}
+
+void ApngAnimationCache::setDirectory(const QString &path)
+{
+    QMutexLocker lock(&m_mutex);
+    m_directory = path;
+}
+
+QString ApngAnimationCache::directory() const
+{
+    QMutexLocker lock(&m_mutex);
+    return m_directory;
+}
+
+bool ApngAnimationCache::isEnabled() const
+{
+    QMutexLocker lock(&m_mutex);
+    return m_budget > 0 || !m_directory.isEmpty();
+}
+
+QSharedPointer<const ApngAnimation> ApngAnimationCache::find(
+    const QByteArray &key)
+{
+    QMutexLocker lock(&m_mutex);
+    auto it = m_entries.find(key);
+    if (it != m_entries.end()) {
+        ++m_stats.hits;
+        it->lastUse = ++m_clock;
+        return it->animation;
+    }
+    const QString directory = m_directory;
+    lock.unlock();
+
+    // Files are read without the lock, other handlers go on meanwhile
+    QSharedPointer<const ApngAnimation> animation;
+    if (!directory.isEmpty()) {
+        animation = load(diskPath(directory, key), key);
+    }
+
+    lock.relock();
+    if (!animation) {
+        ++m_stats.misses;
+        return animation;
+    }
+    ++m_stats.diskHits;
+    insertMemory(key, animation);
+    return animation;
+}
+
+void ApngAnimationCache::insert(
+    const QByteArray &key, const QSharedPointer<const ApngAnimation> &animation)
+{
+    QMutexLocker lock(&m_mutex);
+    insertMemory(key, animation);
+    // Writing width * height * 4 bytes per frame must not hold up the
+    // read() that finished the decode. The animation stays alive, and
+    // immutable, until it is written.
+    if (m_directory.isEmpty() || m_writing.contains(key)) {
+        return;
+    }
+    m_writing.insert(key);
+    auto write       = new DiskWrite;
+    write->cache     = this;
+    write->directory = m_directory;
+    write->key       = key;
+    write->animation = animation;
+    QThreadPool::globalInstance()->start(write);
+}
+
+void ApngAnimationCache::insertMemory(
+    const QByteArray &key, const QSharedPointer<const ApngAnimation> &animation)
+{
+    Entry e;
+    e.animation = animation;
+    e.bytes     = animationBytes(*animation);
+    e.lastUse   = ++m_clock;
+    // Bigger than the whole budget, it would only push everything out
+    if (m_budget <= 0 || e.bytes > m_budget) {
+        return;
+    }
+
+    auto it = m_entries.find(key);
+    if (it != m_entries.end()) {
+        m_stats.bytes -= it->bytes;
+        m_entries.erase(it);
+    }
+    m_entries.insert(key, e);
+    m_stats.bytes += e.bytes;
+    ++m_stats.insertions;
+    evict();
+}
+
+void ApngAnimationCache::clear()
+{
+    QMutexLocker lock(&m_mutex);
+    m_entries.clear();
+    m_stats.bytes = 0;
+}
+
+void ApngAnimationCache::waitForDiskWrites()
+{
+    QMutexLocker lock(&m_mutex);
+    while (!m_writing.isEmpty()) {
+        m_written.wait(&m_mutex);
+    }
+}
+
+APNGHandler::SharedCacheStats ApngAnimationCache::stats() const
+{
+    QMutexLocker lock(&m_mutex);
+    APNGHandler::SharedCacheStats s = m_stats;
+    s.entries                       = m_entries.size();
+    s.budget                        = m_budget;
+    return s;
+}
+
+qint64 ApngAnimationCache::animationBytes(const ApngAnimation &animation)
+{
+    qint64 bytes = 0;
+    qint64 last  = 0;
+    for (const QImage &frame : animation.frames) {
+        // Unchanged frames share the previous one
+        if (frame.cacheKey() != last) {
+            bytes += qint64(frame.bytesPerLine()) * frame.height();
+        }
+        last = frame.cacheKey();
+    }
+    return bytes;
+}
+
+void ApngAnimationCache::evict()
+{
+    while (!m_entries.isEmpty()
+           && (m_budget <= 0 || m_stats.bytes > m_budget)) {
+        auto victim = m_entries.begin();
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+            if (it->lastUse < victim->lastUse) {
+                victim = it;
+            }
+        }
+        m_stats.bytes -= victim->bytes;
+        m_entries.erase(victim);
+        ++m_stats.evictions;
+    }
+}
+
+QString ApngAnimationCache::diskPath(const QString &directory,
+                                     const QByteArray &key)
+{
+    const QByteArray name
+        = QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex();
+    return QDir(directory).filePath(QString::fromLatin1(name) + ".apngcache");
+}
+
+QSharedPointer<const ApngAnimation> ApngAnimationCache::load(
+    const QString &path, const QByteArray &key)
+{
+    QSharedPointer<DiskMapping> mapping(new DiskMapping);
+    mapping->file.setFileName(path);
+    if (!mapping->file.open(QIODevice::ReadOnly)) {
+        return QSharedPointer<const ApngAnimation>();
+    }
+    const qint64 size = mapping->file.size();
+    const uchar *map  = size >= qint64(sizeof(DiskHeader))
+                            ? mapping->file.map(0, size)
+                            : nullptr;
+    if (!map) {
+        return QSharedPointer<const ApngAnimation>();
+    }
+
+    DiskHeader h;
+    memcpy(&h, map, sizeof(h));
+    if (memcmp(h.magic, kDiskMagic, sizeof(kDiskMagic)) != 0
+        || h.version != kDiskVersion || h.byteOrder != kByteOrder
+        || h.width <= 0 || h.height <= 0 || h.frameCount <= 0
+        || h.bytesPerLine < qint64(h.width) * 4
+        || (h.format != QImage::Format_ARGB32
+            && h.format != QImage::Format_ARGB32_Premultiplied)) {
+        qWarning() << "apng disk cache: stale or foreign file" << path;
+        return QSharedPointer<const ApngAnimation>();
+    }
+    const qint64 tableOffset = alignUp(sizeof(DiskHeader) + h.keyBytes, 8);
+    const qint64 dataOffset
+        = alignUp(tableOffset + qint64(h.frameCount) * sizeof(DiskFrame), 64);
+    const qint64 frameBytes = qint64(h.bytesPerLine) * h.height;
+    if (dataOffset > size || h.keyBytes != quint32(key.size())
+        || memcmp(map + sizeof(DiskHeader), key.constData(), key.size())
+               != 0) {
+        return QSharedPointer<const ApngAnimation>();
+    }
+
+    DiskHeader zeroed = h;
+    zeroed.crc        = 0;
+    quint32 sum       = crc(0, &zeroed, sizeof(zeroed));
+    sum = crc(sum, map + sizeof(DiskHeader), dataOffset - sizeof(DiskHeader));
+    if (sum != h.crc) {
+        qWarning() << "apng disk cache: damaged header" << path;
+        return QSharedPointer<const ApngAnimation>();
+    }
+
+    QSharedPointer<ApngAnimation> animation(new ApngAnimation);
+    animation->canvasSize = QSize(h.width, h.height);
+    animation->loopCount  = h.loopCount;
+    quint64 lastOffset = 0;
+    for (int i = 0; i < h.frameCount; i++) {
+        DiskFrame f;
+        memcpy(&f, map + tableOffset + i * sizeof(DiskFrame), sizeof(f));
+        if (i > 0 && f.offset == lastOffset) {
+            // Unchanged frame, shares the image like a decoded one does
+            animation->frames.push_back(animation->frames.last());
+            animation->delays.push_back(f.delay);
+            animation->dirty.push_back(QRect(f.x, f.y, f.width, f.height));
+            animation->crcs.push_back(f.crc);
+            continue;
+        }
+        lastOffset = f.offset;
+        if (f.offset % 64 != 0 || qint64(f.offset) < dataOffset
+            || qint64(f.offset) + frameBytes > size) {
+            qWarning() << "apng disk cache: damaged frame" << i << path;
+            return QSharedPointer<const ApngAnimation>();
+        }
+        // Zero copy: the frames point into the mapping, writing to one
+        // detaches it
+        animation->frames.push_back(
+            QImage(map + f.offset, h.width, h.height, h.bytesPerLine,
+                   QImage::Format(h.format), releaseMapping,
+                   new QSharedPointer<DiskMapping>(mapping)));
+        animation->delays.push_back(f.delay);
+        animation->dirty.push_back(QRect(f.x, f.y, f.width, f.height));
+        animation->crcs.push_back(f.crc);
+    }
+    animation->checked.fill(0, h.frameCount);
+    return animation;
+}
+
+bool ApngAnimationCache::save(const QString &path,
+                              const QByteArray &key,
+                              const ApngAnimation &animation)
+{
+    const QImage &first = animation.frames.first();
+    // Indexed8 frames would need their color table stored too
+    if (first.format() != QImage::Format_ARGB32
+        && first.format() != QImage::Format_ARGB32_Premultiplied) {
+        return false;
+    }
+    DiskHeader h;
+    memcpy(h.magic, kDiskMagic, sizeof(kDiskMagic));
+    h.version      = kDiskVersion;
+    h.byteOrder    = kByteOrder;
+    h.keyBytes     = quint32(key.size());
+    h.format       = quint32(first.format());
+    h.width        = first.width();
+    h.height       = first.height();
+    h.bytesPerLine = first.bytesPerLine();
+    h.loopCount    = animation.loopCount;
+    h.frameCount   = animation.frames.size();
+    h.crc          = 0;
+
+    const qint64 tableOffset = alignUp(sizeof(DiskHeader) + key.size(), 8);
+    const qint64 dataOffset
+        = alignUp(tableOffset + qint64(h.frameCount) * sizeof(DiskFrame), 64);
+    const qint64 frameBytes = qint64(h.bytesPerLine) * h.height;
+    const qint64 frameStep  = alignUp(frameBytes, 64);
+
+    // Everything in front of the pixels
+    QByteArray head(int(dataOffset), '\0');
+    memcpy(head.data() + sizeof(DiskHeader), key.constData(), key.size());
+    QVector<int> written;  // frames with pixels of their own
+    quint32 pixelCrc = 0;
+    for (int i = 0; i < h.frameCount; i++) {
+        const QImage &image = animation.frames.at(i);
+        if (image.size() != first.size() || image.format() != first.format()
+            || image.bytesPerLine() != h.bytesPerLine) {
+            return false;
+        }
+        const QRect &dirty = animation.dirty.at(i);
+        if (i == 0 || !dirty.isEmpty()) {
+            written.push_back(i);
+            pixelCrc = crc(0, image.constBits(), frameBytes);
+        }
+        DiskFrame f;
+        f.offset   = quint64(dataOffset + (written.size() - 1) * frameStep);
+        f.delay    = animation.delays.at(i);
+        f.x        = dirty.x();
+        f.y        = dirty.y();
+        f.width    = dirty.width();
+        f.height   = dirty.height();
+        f.crc      = pixelCrc;
+        memcpy(head.data() + tableOffset + i * sizeof(DiskFrame), &f,
+               sizeof(f));
+    }
+    h.crc = crc(crc(0, &h, sizeof(h)), head.constData() + sizeof(DiskHeader),
+                dataOffset - sizeof(DiskHeader));
+    memcpy(head.data(), &h, sizeof(h));
+
+    // Readers never see a half written file
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    file.write(head);
+    const QByteArray padding(int(frameStep - frameBytes), '\0');
+    for (int i : written) {
+        file.write(reinterpret_cast<const char *>(
+                       animation.frames.at(i).constBits()),
+                   frameBytes);
+        file.write(padding);
+    }
+    return file.commit();
+}
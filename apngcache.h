@@ -0,0 +1,105 @@
+#pragma once
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QSet>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+#include <QWaitCondition>
+
+#include "apnghandler.h"
+
+class QIODevice;
+
+// A completely decoded animation. Never changes once it is in the cache,
+// so handlers on any thread share it, and its frames, without copies.
+struct ApngAnimation {
+    QSize canvasSize;
+    int loopCount = 0;
+    QVector<QImage> frames;  // as read() returns them
+    QVector<int> delays;     // ms
+    QVector<QRect> dirty;    // canvas coordinates, see frameDirtyRect()
+    // Mapped from the disk cache: CRC-32 of the pixels of each frame,
+    // checked the first time the frame is handed out. Empty otherwise.
+    QVector<quint32> crcs;
+    mutable QVector<QAtomicInt> checked;  // 0 not yet, 1 intact, -1 not
+
+    // Whether frame `index` still has the pixels it was saved with
+    bool isIntact(int index) const;
+};
+
+// Process-wide cache of decoded animations, so readers of the same file
+// decode it once. Keyed by file identity (path, size and modification
+// time) or, for other seekable devices, a hash of the content, plus the
+// output settings the frames were made with. Least recently used entries
+// go when the frames exceed the budget.
+//
+// With a directory set, animations are also written there, on
+// QThreadPool::globalInstance(), and mapped back by later processes; see
+// apngcache.cpp for the file format.
+class ApngAnimationCache {
+public:
+    static ApngAnimationCache *instance();
+    ~ApngAnimationCache();
+
+    // Cache key of `device` for frames in `format`, clipped and scaled;
+    // empty if the device can't be identified without consuming it.
+    // The device position is restored.
+    static QByteArray key(QIODevice *device,
+                          QImage::Format format,
+                          const QRect &clipRect,
+                          const QSize &scaledSize);
+
+    // <= 0 disables the cache
+    void setBudget(qint64 bytes);
+    qint64 budget() const;
+    // Empty disables the disk cache
+    void setDirectory(const QString &path);
+    QString directory() const;
+    // Whether find() can succeed at all
+    bool isEnabled() const;
+
+    QSharedPointer<const ApngAnimation> find(const QByteArray &key);
+    void insert(const QByteArray &key,
+                const QSharedPointer<const ApngAnimation> &animation);
+    void clear();
+    // Until the animations inserted so far are on disk
+    void waitForDiskWrites();
+    APNGHandler::SharedCacheStats stats() const;
+
+private:
+    struct DiskWrite;
+
+    struct Entry {
+        QSharedPointer<const ApngAnimation> animation;
+        qint64 bytes    = 0;
+        quint64 lastUse = 0;
+    };
+
+    static qint64 animationBytes(const ApngAnimation &animation);
+    void insertMemory(const QByteArray &key,
+                      const QSharedPointer<const ApngAnimation> &animation);
+    void evict();
+
+    static QString diskPath(const QString &directory, const QByteArray &key);
+    // Null if missing, stale or damaged
+    static QSharedPointer<const ApngAnimation> load(const QString &path,
+                                                    const QByteArray &key);
+    static bool save(const QString &path,
+                     const QByteArray &key,
+                     const ApngAnimation &animation);
+
+private:
+    mutable QMutex m_mutex;  // guards everything below
+    QHash<QByteArray, Entry> m_entries;
+    qint64 m_budget = 32 * 1024 * 1024;
+    QString m_directory;
+    QSet<QByteArray> m_writing;  // keys of the DiskWrites in flight
+    QWaitCondition m_written;
+    quint64 m_clock = 0;
+    APNGHandler::SharedCacheStats m_stats;
+};
@@ -0,0 +1,363 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QFileDevice>
+#include <QImage>
+#include <QMutex>
+#include <QPointer>
+#include <QSharedPointer>
+#include <QVector>
+
+#include <atomic>
+#include <memory>
+
+#include "apngcache.h"
+#include "apngframestore.h"
+#include "apnghandler.h"
+#include "apngscanner.h"
+#include "png.h"
+
+// Decoder state behind an APNGHandler, shared by the modules that decode
+// with it: apnghandler.cpp (progressive decoding and replays),
+// apngparallel.cpp, apngprefetch.cpp and apngbatch.cpp.
+
+// Adds the time spent in its scope to `*ns`; does nothing, not even read
+// the clock, when `on` is false
+class StageTimer {
+public:
+    StageTimer(bool on, qint64 *ns) : m_ns(on ? ns : nullptr)
+    {
+        if (m_ns) {
+            m_timer.start();
+        }
+    }
+    ~StageTimer()
+    {
+        if (m_ns) {
+            *m_ns += m_timer.nsecsElapsed();
+        }
+    }
+
+private:
+    qint64 *m_ns;
+    QElapsedTimer m_timer;
+};
+
+struct FrameBuf {
+    quint32 x      = 0;
+    quint32 y      = 0;
+    quint32 width  = 0;
+    quint32 height = 0;
+
+    quint16 delay_num = 0;
+    quint16 delay_den = 100;  // default to avoid div-by-zero
+
+    png_byte dispose_op = PNG_DISPOSE_OP_NONE;
+    png_byte blend_op   = PNG_BLEND_OP_SOURCE;
+
+    png_uint_32 rowbytes = 0;
+    int channels         = 4;        // Typically RGBA
+    png_bytep *rows      = nullptr;  // array of row pointers
+    png_byte *p          = nullptr;  // raw pixel buffer
+};
+
+// What it takes to decode a displayed frame again after eviction
+struct FrameRecord {
+    quint32 x      = 0;
+    quint32 y      = 0;
+    quint32 width  = 0;
+    quint32 height = 0;
+
+    png_byte dispose_op = PNG_DISPOSE_OP_NONE;  // after first-frame fixups
+    png_byte blend_op   = PNG_BLEND_OP_SOURCE;
+
+    QVector<ApngChunkSpan> spans;
+};
+
+// fcTL region of a FrameRecord or an ApngFrameInfo
+template <typename Frame>
+inline QRect frameRect(const Frame &f)
+{
+    return QRect(int(f.x), int(f.y), int(f.width), int(f.height));
+}
+
+struct ApngContext {
+    // Held by whoever decodes while a prefetch worker is running
+    QMutex mutex;
+
+    // Basic
+    QIODevice *device  = nullptr;
+    png_structp pngPtr = nullptr;
+    png_infop infoPtr  = nullptr;
+    bool hasError      = false;
+
+    // See APNGHandler::DecodeLimits. `cancelled` is set by cancel()
+    // without the mutex; `callTimer` runs from the start of the current
+    // decoding call when there is a time limit.
+    APNGHandler::DecodeLimits limits;
+    APNGHandler::DecodeError error = APNGHandler::NoError;  // with hasError
+    std::atomic<bool> cancelled{false};
+    QElapsedTimer callTimer;
+
+    // Progressive state. The libpng structs live across decodeFrames()
+    // calls, so every call resumes where the previous one stopped.
+    bool started   = false;  // signature fed
+    bool hasHeader = false;  // infoCallback ran
+    bool finished  = false;  // no more frames will be produced
+
+    // Animation info
+    bool isAnimated    = false;
+    bool skipFirst     = false;
+    quint32 frameCount = 1;
+
+    // Current "composited" image & buffer for reading
+    QImage::Format format = QImage::Format_ARGB32;  // of every canvas
+    // Format_Indexed8 was asked for; `format` only follows where every
+    // frame composites exactly on palette indices, see resolveFormat()
+    bool wantIndexed = false;
+    QVector<QRgb> colorTable;  // of Indexed8 canvases
+    QImage lastImage;
+    FrameBuf curFrame;
+
+    // Results
+    ApngFrameStore store;
+    QVector<FrameRecord> records;  // per displayed frame
+    QVector<int> delays;
+    int loopCount = 0;  // 0 means infinite in APNG spec
+
+    // Output transform (ClipRect, then ScaledSize); the store holds the
+    // transformed frames, canvases and checkpoints stay full size
+    QRect clipRect;
+    QSize scaledSize;
+    QImage lastOutput;  // rescaled only where the next frame changed
+    int lastOutputIndex = -1;
+
+    // Decoded by another handler, see ApngAnimationCache; nothing is
+    // decoded here then
+    QSharedPointer<const ApngAnimation> shared;
+    QByteArray sharedKey;  // publish under this key once finished
+    bool sharedTried = false;
+
+    // Running out of input means "not yet" rather than the end; the
+    // stream ends with IEND, an error, or the device closing
+    bool incremental = false;
+    bool starved     = false;  // waiting for more input
+
+    // Instrumentation, see APNGHandler::DecodeStats
+    bool timing = false;
+    APNGHandler::DecodeStats decodeStats;
+    bool statsReported = false;
+
+    // Cache settings
+    qint64 cacheBudget                   = 0;
+    int checkpointInterval               = 16;
+    APNGHandler::StorageMode storageMode = APNGHandler::FullFrames;
+
+    // Chunk bookkeeping, so evicted frames can be decoded again
+    QByteArray ihdr;                        // IHDR payload
+    QByteArray paletteChunks;               // raw PLTE/tRNS chunks
+    QVector<QVector<ApngChunkSpan>> spans;  // payloads per stream frame
+    int fctlCount    = 0;
+    bool seenIdat    = false;
+    bool idatHasFctl = false;  // the IDAT image is the first frame
+
+    // Input buffer, reused for every block fed to libpng. Positions are
+    // device offsets; the buffer holds [bufStart, bufStart + buf.size()).
+    QByteArray buf;
+    qint64 bufStart       = 0;
+    qint64 feedPos        = 0;  // next byte for libpng
+    qint64 scanPos        = 0;  // next chunk header for noteChunk()
+    int blockSize         = 16 * 1024;
+    png_size_t unconsumed = 0;  // left over when a callback paused libpng
+    int targetFrames      = 0;  // pause once this many frames are decoded
+    APNGHandler::ReadStats readStats;
+    QByteArray patchBuf;  // standalone PNG of a replayed frame
+
+    // QFile devices are mapped instead; blocks are then windows of the
+    // mapping, and replays copy from it
+    QPointer<QFileDevice> mappedFile;
+    const char *map = nullptr;
+    qint64 mapSize  = 0;
+    qint64 mapEnd   = 0;  // end of the window handed out so far
+    bool mapTried   = false;
+
+    // Parallel decoding, decided when decoding starts
+    int decodeThreads = 1;
+    bool parallel     = false;
+
+    // Replay cursor: background for frame `replayNext`
+    int replayNext = -1;
+    QImage replayCanvas;
+
+    // Metadata from scanApng(), answers queries before anything is decoded
+    ApngInfo info;
+    bool scanned = false;
+
+    // Displayed frames identical to the one before them: they share its
+    // pixels and have an empty dirtyRect(). Set by whoever decodes and
+    // read without the mutex, so the flags are only reallocated before
+    // decoding starts, or without scanned metadata (and so without a
+    // prefetch worker).
+    std::unique_ptr<std::atomic<bool>[]> unchanged;
+    int unchangedSize = 0;
+    QImage lastFrame;  // as stored for decodedFrames() - 1
+
+    void resizeUnchanged(int size)
+    {
+        std::unique_ptr<std::atomic<bool>[]> flags(
+            new std::atomic<bool>[size]);
+        for (int i = 0; i < size; i++) {
+            flags[i].store(i < unchangedSize && unchanged[i].load());
+        }
+        unchanged.swap(flags);
+        unchangedSize = size;
+    }
+
+    void markUnchanged(int index)
+    {
+        if (index >= unchangedSize) {
+            resizeUnchanged(qMax(index + 1, imageCount()));
+        }
+        unchanged[index].store(true, std::memory_order_relaxed);
+    }
+
+    bool isUnchanged(int index) const
+    {
+        if (index <= 0) {
+            return false;
+        }
+        if (shared) {
+            return index < shared->dirty.size()
+                   && shared->dirty.at(index).isEmpty();
+        }
+        return index < unchangedSize
+               && unchanged[index].load(std::memory_order_relaxed);
+    }
+
+    int decodedFrames() const
+    {
+        return shared ? shared->frames.size() : records.size();
+    }
+
+    // Number of displayed frames announced by the header
+    int expectedFrames() const
+    {
+        if (!isAnimated) {
+            return 1;
+        }
+        return int(frameCount) - (skipFirst ? 1 : 0);
+    }
+    // Announced count while decoding, real count once the stream is done
+    int imageCount() const
+    {
+        if (finished || shared) {
+            return decodedFrames();
+        }
+        return scanned ? info.frames.size() : expectedFrames();
+    }
+
+    QSize canvasSize() const
+    {
+        if (shared) {
+            return shared->canvasSize;
+        }
+        return scanned ? info.size : lastImage.size();
+    }
+
+    // Region of displayed frame `index` that differs from frame
+    // `index - 1`: its own fcTL rectangle plus whatever the dispose op of
+    // the previous frame touched, or nothing for an unchanged frame. The
+    // first frame changes everything.
+    QRect dirtyRect(int index) const
+    {
+        const QRect canvas(QPoint(0, 0), canvasSize());
+        if (index <= 0) {
+            return canvas;
+        }
+        if (shared) {
+            return index < shared->dirty.size() ? shared->dirty.at(index)
+                                                : canvas;
+        }
+        if (isUnchanged(index)) {
+            return QRect();
+        }
+
+        // Scanned metadata first, it never changes once it is there
+        QRect rect, prevRect;
+        int prevDispose = PNG_DISPOSE_OP_NONE;
+        if (scanned && index < info.frames.size()) {
+            const ApngFrameInfo &r = info.frames.at(index);
+            const ApngFrameInfo &p = info.frames.at(index - 1);
+
+            rect        = frameRect(r);
+            prevRect    = frameRect(p);
+            prevDispose = p.disposeOp;
+        }
+        else if (index < records.size()) {
+            const FrameRecord &r = records.at(index);
+            const FrameRecord &p = records.at(index - 1);
+
+            rect        = frameRect(r);
+            prevRect    = frameRect(p);
+            prevDispose = p.dispose_op;
+        }
+        else {
+            return QRect();
+        }
+
+        if (prevDispose != PNG_DISPOSE_OP_NONE) {
+            rect |= prevRect;
+        }
+        return rect & canvas;
+    }
+
+    int delayMs(int index) const
+    {
+        if (shared) {
+            return shared->delays.value(index);
+        }
+        if (scanned && index >= 0 && index < info.frames.size()) {
+            return int(info.frames.at(index).delayUs / 1000);
+        }
+        if (index >= 0 && index < delays.size()) {
+            return delays.at(index);
+        }
+        return 0;
+    }
+};
+
+// Implemented in apnghandler.cpp
+
+// Give the pooled rows of `f` back
+void freeFrameBuf(FrameBuf &f);
+// Transparent canvas on a pooled buffer
+QImage newCanvas(const ApngContext *ctx, const QSize &size);
+// Map `device` if it is a file, once per context
+void mapFile(ApngContext *ctx, QIODevice *device);
+void unmapFile(ApngContext *ctx);
+
+// Everything that stops decoding before displayed frame `index`
+APNGHandler::DecodeError checkFrame(const ApngContext *ctx, int index);
+// Outside of libpng; the decoder keeps failing from here on
+void stopDecode(ApngContext *ctx, APNGHandler::DecodeError error);
+
+// Composite `f` as the next displayed frame and keep the result; `spans`
+// is where its data lives in the file
+void addFrame(ApngContext *ctx, const FrameBuf &f,
+              const QVector<ApngChunkSpan> &spans);
+// Feed `ctx->device` to libpng until the header is known and at least
+// `frameCount` frames are composited, or the stream is over. Returns
+// false on errors.
+bool decodeFrames(ApngContext *ctx, int frameCount);
+// Release libpng state; the frames decoded so far stay in `ctx`
+void finishDecode(ApngContext *ctx);
+
+// The data chunks of a frame as a standalone PNG of the frame's size
+bool buildPatch(ApngContext *ctx, const FrameRecord &r, QByteArray &png);
+void frameFromRecord(FrameBuf &f, const FrameRecord &r);
+// Decode a buildPatch() PNG into `f`; touches nothing but its arguments,
+// so it can run on any thread
+bool decodePng(const QByteArray &png, FrameBuf &f, bool indexed);
+
+// Displayed frame `index`, from the store, decoded on, or replayed
+QImage frameAt(ApngContext *ctx, int index);
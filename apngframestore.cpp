@@ -0,0 +1,231 @@
+#include "apngframestore.h"
+
+#include <cstring>
+
+#include "apngpool.h"
+
+void ApngFrameStore::setBudget(qint64 bytes)
+{
+    m_budget = bytes;
+    evict();
+}
+
+qint64 ApngFrameStore::budget() const
+{
+    return m_budget;
+}
+
+void ApngFrameStore::insert(int index, const QImage &frame)
+{
+    auto it = m_frames.find(index);
+    if (it != m_frames.end()) {
+        removeFrame(it);
+    }
+
+    Entry e;
+    e.image = frame;
+    e.use   = m_frameUse.insert(m_frameUse.end(), index);
+    if (!sharesPixels(index - 1, frame) && !sharesPixels(index + 1, frame)) {
+        e.bytes = imageBytes(frame);
+    }
+    m_frames.insert(index, e);
+    m_lastInsert = index;
+    account(e.bytes);
+    evict();
+}
+
+void ApngFrameStore::insertPatch(int index, const QImage &frame,
+                                 const QRect &dirty)
+{
+    Patch p;
+    p.pos = dirty.topLeft();
+    if (!dirty.isEmpty()) {
+        p.image = ApngBufferPool::instance()->copy(frame, dirty);
+    }
+    m_patches.insert(index, p);
+    account(imageBytes(p.image));
+    // The caller still holds the whole frame, play on from it
+    m_cursor      = index;
+    m_cursorImage = frame;
+}
+
+bool ApngFrameStore::find(int index, QImage *frame)
+{
+    auto it = m_frames.find(index);
+    if (it == m_frames.end()) {
+        if (m_patches.contains(index)) {
+            *frame = rebuild(index);
+            if (!frame->isNull()) {
+                ++m_stats.hits;
+                return true;
+            }
+        }
+        ++m_stats.misses;
+        return false;
+    }
+    ++m_stats.hits;
+    m_frameUse.splice(m_frameUse.end(), m_frameUse, it->use);
+    *frame = it->image;
+    return true;
+}
+
+QImage ApngFrameStore::value(int index)
+{
+    if (m_patches.contains(index)) {
+        return rebuild(index);
+    }
+    return m_frames.value(index).image;
+}
+
+void ApngFrameStore::addCheckpoint(int index, const QImage &background)
+{
+    if (m_checkpoints.contains(index)) {
+        return;
+    }
+    Entry e;
+    e.image = background;
+    e.use   = m_checkpointUse.insert(m_checkpointUse.end(), index);
+    m_checkpoints.insert(index, e);
+    account(imageBytes(background));
+    evict();
+}
+
+int ApngFrameStore::checkpointBefore(int index, QImage *background)
+{
+    auto it = m_checkpoints.upperBound(index);
+    if (it == m_checkpoints.begin()) {
+        return -1;
+    }
+    --it;
+    m_checkpointUse.splice(m_checkpointUse.end(), m_checkpointUse, it->use);
+    *background = it->image;
+    return it.key();
+}
+
+void ApngFrameStore::addReplayed(int frames)
+{
+    m_stats.replayedFrames += frames;
+}
+
+APNGHandler::CacheStats ApngFrameStore::stats() const
+{
+    APNGHandler::CacheStats s = m_stats;
+    s.cachedFrames            = m_frames.size() + m_patches.size();
+    s.patches                 = m_patches.size();
+    s.checkpoints             = m_checkpoints.size();
+    for (const Entry &e : m_frames) {
+        if (e.bytes == 0 && !e.image.isNull()) {
+            s.sharedFrames++;
+        }
+    }
+    return s;
+}
+
+qint64 ApngFrameStore::imageBytes(const QImage &image)
+{
+    return qint64(image.bytesPerLine()) * image.height();
+}
+
+void ApngFrameStore::account(qint64 bytes)
+{
+    m_stats.bytes += bytes;
+    m_stats.peakBytes = qMax(m_stats.peakBytes, m_stats.bytes);
+}
+
+bool ApngFrameStore::sharesPixels(int index, const QImage &image) const
+{
+    auto it = m_frames.constFind(index);
+    return it != m_frames.constEnd() && !image.isNull()
+           && it->image.cacheKey() == image.cacheKey();
+}
+
+bool ApngFrameStore::isKeyframe(int index) const
+{
+    return m_patches.contains(index + 1);
+}
+
+void ApngFrameStore::removeFrame(QHash<int, Entry>::iterator it)
+{
+    // A neighbour sharing the pixels keeps them alive, it pays from now on
+    const int index = it.key();
+    qint64 bytes    = it->bytes;
+    for (int next : {index - 1, index + 1}) {
+        if (bytes > 0 && sharesPixels(next, it->image)) {
+            m_frames[next].bytes = bytes;
+            bytes                = 0;
+        }
+    }
+    account(-bytes);
+    m_frameUse.erase(it->use);
+    m_frames.erase(it);
+}
+
+void ApngFrameStore::evict()
+{
+    if (m_budget <= 0) {
+        return;
+    }
+    while (m_stats.bytes > m_budget) {
+        // Frames go first. The one inserted last is what the caller is
+        // about to hand out, and full frames that patches are rebuilt from
+        // can't go either; only delta mode has those, and few of them.
+        auto victim = m_frameUse.begin();
+        while (victim != m_frameUse.end()
+               && (*victim == m_lastInsert || isKeyframe(*victim))) {
+            ++victim;
+        }
+        if (victim != m_frameUse.end()) {
+            removeFrame(m_frames.find(*victim));
+            ++m_stats.evictions;
+            continue;
+        }
+
+        // Then checkpoints; a replay falls back to an earlier one
+        if (m_checkpointUse.empty()) {
+            break;
+        }
+        auto cp = m_checkpoints.find(m_checkpointUse.front());
+        account(-imageBytes(cp->image));
+        m_checkpointUse.pop_front();
+        m_checkpoints.erase(cp);
+        ++m_stats.evictions;
+    }
+}
+
+// Apply the patches after the nearest full frame (or the cursor) up to
+// `index`
+QImage ApngFrameStore::rebuild(int index)
+{
+    if (index == m_cursor) {
+        return m_cursorImage;
+    }
+
+    int start = index - 1;
+    while (start >= 0 && start != m_cursor && !m_frames.contains(start)) {
+        if (!m_patches.contains(start)) {
+            return QImage();
+        }
+        start--;
+    }
+    if (start < 0) {
+        return QImage();
+    }
+    QImage canvas = start == m_cursor ? m_cursorImage
+                                      : m_frames.value(start).image;
+    if (!canvas.isDetached()) {
+        canvas = ApngBufferPool::instance()->copy(canvas);
+    }
+
+    for (int j = start + 1; j <= index; j++) {
+        const Patch &p    = m_patches[j];
+        const int depth   = p.image.depth() / 8;  // ARGB32 or Indexed8
+        const size_t line = size_t(p.image.width()) * depth;
+        for (int y = 0; y < p.image.height(); y++) {
+            memcpy(canvas.scanLine(p.pos.y() + y) + p.pos.x() * depth,
+                   p.image.constScanLine(y), line);
+        }
+    }
+    m_cursor      = index;
+    m_cursorImage = canvas;
+    return canvas;
+}
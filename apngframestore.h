@@ -0,0 +1,79 @@
+#pragma once
+
+#include <QHash>
+#include <QImage>
+#include <QMap>
+
+#include <list>
+
+#include "apnghandler.h"
+
+// Composited canvases of one animation, kept under a memory budget.
+// Frames are evicted least recently used first. Checkpoints hold the
+// background a frame was composited onto, so an evicted frame can be
+// rebuilt by replaying the frames after the nearest checkpoint.
+// In delta mode frames can instead be kept as patches: only the part of
+// the canvas that changed since the previous frame. Those are rebuilt from
+// the nearest full frame before them; neither is ever evicted, patches
+// count towards the budget nonetheless.
+// Consecutive frames with the same pixels (see frameDirtyRect()) share
+// them and are accounted once.
+class ApngFrameStore {
+public:
+    // <= 0 means unlimited
+    void setBudget(qint64 bytes);
+    qint64 budget() const;
+
+    void insert(int index, const QImage &frame);
+    // Keep only `dirty` of `frame`; frame `index - 1` must be in the store
+    void insertPatch(int index, const QImage &frame, const QRect &dirty);
+    // Counts a hit or a miss
+    bool find(int index, QImage *frame);
+    // Does not touch the counters
+    QImage value(int index);
+
+    void addCheckpoint(int index, const QImage &background);
+    // Nearest checkpoint at or before `index`, -1 if there is none
+    int checkpointBefore(int index, QImage *background);
+
+    void addReplayed(int frames);
+    APNGHandler::CacheStats stats() const;
+
+private:
+    struct Entry {
+        QImage image;
+        std::list<int>::iterator use;  // in m_frameUse or m_checkpointUse
+        // Accounted for this entry; 0 while a neighbouring frame holds the
+        // same pixels and pays for them
+        qint64 bytes = 0;
+    };
+    struct Patch {
+        QPoint pos;
+        QImage image;  // null if nothing changed
+    };
+
+    static qint64 imageBytes(const QImage &image);
+    void account(qint64 bytes);
+    // Whether frame `index` uses the same pixels as `image`
+    bool sharesPixels(int index, const QImage &image) const;
+    // Whether the patches after full frame `index` are rebuilt from it
+    bool isKeyframe(int index) const;
+    void removeFrame(QHash<int, Entry>::iterator it);
+    void evict();
+    QImage rebuild(int index);
+
+private:
+    QHash<int, Entry> m_frames;
+    QMap<int, Entry> m_checkpoints;
+    QHash<int, Patch> m_patches;
+    // Indices in order of use, least recently used first, so eviction
+    // takes the front instead of searching
+    std::list<int> m_frameUse;
+    std::list<int> m_checkpointUse;
+    // Last frame rebuilt from patches, playback continues from there
+    int m_cursor = -1;
+    QImage m_cursorImage;
+    qint64 m_budget  = 0;
+    int m_lastInsert = -1;
+    APNGHandler::CacheStats m_stats;
+};
@@ -1,417 +1,944 @@
 #include "apnghandler.h"
 
 #include <QDebug>
-
+#include <QElapsedTimer>
+#include <QFileDevice>
+#include <QMutex>
+#include <QThread>
+#include <QtEndian>
+
+#include <atomic>
+#include <climits>
+#include <cstring>
+
+#include "apngbatch.h"
+#include "apngblend.h"
+#include "apngcache.h"
+#include "apngcontext.h"
+#include "apngframestore.h"
+#include "apngparallel.h"
+#include "apngpool.h"
+#include "apngprefetch.h"
+#include "apngscale.h"
+#include "apngscanner.h"
+#include "apngwriter.h"
 #include "png.h"
+#include "zlib.h"
 
 #define eprint qDebug() << __LINE__ << Q_FUNC_INFO
 
-APNGHandler::APNGHandler() : m_parsed(false), m_loopCount(0), m_currentFrame(0)
-{
-}
+static std::atomic<qint64> s_defaultCacheBudget{0};
+static std::atomic<int> s_defaultStorageMode{APNGHandler::FullFrames};
+static std::atomic<int> s_defaultDecodeThreads{0};  // 0: idealThreadCount()
+static std::atomic<int> s_defaultWriteThreads{0};   // 0: idealThreadCount()
+static std::atomic<int> s_defaultPrefetchFrames{0};
+static std::atomic<qint64> s_defaultPrefetchBytes{0};
+static std::atomic<bool> s_defaultDecodeStats{false};
+static QMutex s_decodeStatsMutex;  // guards s_decodeStatsCallback
+static APNGHandler::DecodeStatsCallback s_decodeStatsCallback;
+static QMutex s_defaultLimitsMutex;  // guards s_defaultLimits
+static APNGHandler::DecodeLimits s_defaultLimits;
 
-bool APNGHandler::canRead() const
+/// helpers
+// False, with nothing held, if the pool could not allocate
+static bool allocFrameBuf(FrameBuf &f, png_uint_32 rowbytes)
 {
-    return canRead(device());
+    ApngBufferPool *pool = ApngBufferPool::instance();
+    f.rowbytes = rowbytes;
+    f.p        = pool->acquire(qint64(f.height) * f.rowbytes);
+    f.rows     = reinterpret_cast<png_bytep *>(
+        pool->acquire(qint64(f.height) * sizeof(png_bytep)));
+    if (!f.p || !f.rows) {
+        freeFrameBuf(f);
+        return false;
+    }
+    for (quint32 j = 0; j < f.height; j++) {
+        f.rows[j] = f.p + j * f.rowbytes;
+    }
+    return true;
 }
 
-bool APNGHandler::canRead(QIODevice *device)
+void freeFrameBuf(FrameBuf &f)
 {
-    if (!device || !device->isReadable()) {
-        eprint;
-        return false;
+    ApngBufferPool *pool = ApngBufferPool::instance();
+    if (f.rows) {
+        pool->release(reinterpret_cast<uchar *>(f.rows));
+        f.rows = nullptr;
     }
-
-    device->seek(0);
-
-    constexpr int PNG_SIG_SIZE = 8;
-    QByteArray sig             = device->peek(PNG_SIG_SIZE);
-    if (sig.size() < PNG_SIG_SIZE
-        || png_sig_cmp(reinterpret_cast<png_const_bytep>(sig.constData()), 0,
-                       PNG_SIG_SIZE)
-               != 0) {
-        return false;
+    if (f.p) {
+        pool->release(f.p);
+        f.p = nullptr;
     }
-    return true;
 }
 
-bool APNGHandler::read(QImage *image)
+// Entry Indexed8 canvases are cleared to
+static uint transparentIndex(const QVector<QRgb> &table)
 {
-    if (!ensureParsed()) {
-        eprint;
-        return false;
+    for (int i = 0; i < table.size(); i++) {
+        if (qAlpha(table.at(i)) == 0) {
+            return uint(i);
+        }
     }
+    return 0;
+}
 
-    if (m_frames.isEmpty()) {
-        eprint;
-        return false;
+// Transparent canvas on a pooled buffer
+QImage newCanvas(const ApngContext *ctx, const QSize &size)
+{
+    QImage img = ApngBufferPool::instance()->image(size, ctx->format);
+    if (ctx->format == QImage::Format_Indexed8) {
+        img.setColorTable(ctx->colorTable);
+        img.fill(transparentIndex(ctx->colorTable));
     }
-    if (m_currentFrame < 0 || m_currentFrame >= m_frames.size()) {
-        m_currentFrame = 0;
+    else {
+        img.fill(Qt::transparent);
     }
-    *image = m_frames.at(m_currentFrame++);
-    return true;
+    return img;
 }
 
-bool APNGHandler::ensureParsed() const
+// Canvases are written in place; one that is shared with a stored frame or
+// checkpoint is copied into a pooled buffer first, rather than detached
+// onto the heap by the write
+static void detachCanvas(QImage &img)
 {
-    // 1) If already parsed, do nothing
-    if (m_parsed) {
-        return true;
+    if (!img.isDetached()) {
+        img = ApngBufferPool::instance()->copy(img);
     }
-    auto p      = const_cast<APNGHandler *>(this);
-    p->m_parsed = true;
-    return ensureParsed(device(), p->m_loopCount, p->m_frames, p->m_delays);
 }
 
-int APNGHandler::currentImageNumber() const
+// Visible part of `f` on `dest`; fcTL regions are validated by libpng, this
+// only guards the scanline pointers
+static int visibleWidth(const QImage &dest, const FrameBuf &f)
 {
-    if (!ensureParsed()) {
-        return 0;
-    }
-    return m_currentFrame;
+    return qBound(0, dest.width() - int(f.x), int(f.width));
 }
 
-int APNGHandler::imageCount() const
+static int visibleHeight(const QImage &dest, const FrameBuf &f)
 {
-    if (!ensureParsed()) {
-        eprint;
-        return 0;
+    return qBound(0, dest.height() - int(f.y), int(f.height));
+}
+
+static quint32 *destRow(QImage &dest, const FrameBuf &f, int y)
+{
+    return reinterpret_cast<quint32 *>(dest.scanLine(int(f.y) + y)) + f.x;
+}
+
+// Indexed8 canvases
+static uchar *destIndexRow(QImage &dest, const FrameBuf &f, int y)
+{
+    return dest.scanLine(int(f.y) + y) + f.x;
+}
+
+static void copyFrameToImage(QImage &dest, const FrameBuf &f)
+{
+    // Copy pixels from f.rows into `dest`, at offsets (f.x, f.y).
+    // Rows already have the layout of `dest`, so this is a memcpy per row.
+    const int w = visibleWidth(dest, f);
+    const int h = visibleHeight(dest, f);
+    const bool indexed = dest.format() == QImage::Format_Indexed8;
+    for (int y = 0; y < h; y++) {
+        if (indexed) {
+            memcpy(destIndexRow(dest, f, y), f.rows[y], size_t(w));
+        }
+        else {
+            apngCopyRow(destRow(dest, f, y),
+                        reinterpret_cast<const quint32 *>(f.rows[y]), w);
+        }
     }
-    return m_frames.size();
 }
 
-bool APNGHandler::jumpToNextImage()
+// OVER on palette indices; resolveFormat() made sure every entry is
+// either opaque or fully transparent
+static void blendIndexedFrame(QImage &dest, const FrameBuf &f)
 {
-    if (!ensureParsed()) {
-        return false;
+    const QVector<QRgb> table = dest.colorTable();
+    uchar alpha[256]          = {};
+    for (int i = 0; i < table.size() && i < 256; i++) {
+        alpha[i] = uchar(qAlpha(table.at(i)));
     }
-    if (++m_currentFrame < m_frames.size()) {
-        return true;
+    const int w = visibleWidth(dest, f);
+    const int h = visibleHeight(dest, f);
+    for (int y = 0; y < h; y++) {
+        apngBlendIndexedRow(destIndexRow(dest, f, y), f.rows[y], w, alpha);
     }
-    return false;
 }
 
-bool APNGHandler::jumpToImage(int imageNumber)
+static void blendFrame(QImage &dest, const FrameBuf &f)
 {
-    if (!ensureParsed() || imageNumber < 0) {
-        eprint;
-        return false;
+    // "Over" blend the current frame onto `dest`.
+    const int w = visibleWidth(dest, f);
+    const int h = visibleHeight(dest, f);
+    const bool premultiplied
+        = dest.format() == QImage::Format_ARGB32_Premultiplied;
+    for (int y = 0; y < h; y++) {
+        const auto src = reinterpret_cast<const quint32 *>(f.rows[y]);
+        if (premultiplied) {
+            apngBlendRowPremultiplied(destRow(dest, f, y), src, w);
+        }
+        else {
+            apngBlendRow(destRow(dest, f, y), src, w);
+        }
     }
-    m_currentFrame = imageNumber;
-    return imageNumber < m_frames.size();
 }
 
-int APNGHandler::nextImageDelay() const
+// libpng hands out straight alpha; premultiply the visible part of `f` in
+// place before it goes onto a premultiplied canvas
+static void premultiplyFrame(const QImage &dest, const FrameBuf &f)
 {
-    if (!ensureParsed()) {
-        eprint;
-        return 0;
+    const int w = visibleWidth(dest, f);
+    const int h = visibleHeight(dest, f);
+    for (int y = 0; y < h; y++) {
+        apngPremultiplyRow(reinterpret_cast<quint32 *>(f.rows[y]), w);
     }
-    if (m_currentFrame <= 0 || m_currentFrame >= m_frames.size()) {
-        return m_delays.at(0);
-    }
-    return m_delays.at(m_currentFrame - 1);
 }
 
-int APNGHandler::loopCount() const
+// Composite `f` onto `img` according to its blend op
+static void compositeFrame(QImage &img, const FrameBuf &f)
 {
-    if (!ensureParsed()) {
-        eprint;
-        return 0;
+    detachCanvas(img);
+    if (img.format() == QImage::Format_ARGB32_Premultiplied) {
+        premultiplyFrame(img, f);
+    }
+    if (f.blend_op == PNG_BLEND_OP_OVER) {
+        if (img.format() == QImage::Format_Indexed8) {
+            blendIndexedFrame(img, f);
+        }
+        else {
+            blendFrame(img, f);
+        }
+    }
+    else {
+        copyFrameToImage(img, f);
     }
-    return m_loopCount;
 }
 
-bool APNGHandler::supportsOption(ImageOption option) const
+// For PNG_DISPOSE_OP_PREVIOUS: the part of `img` that `f` is about to
+// cover, in a pooled buffer. Nothing else changes, so nothing else is kept.
+static QImage saveFrameRect(const QImage &img, const FrameBuf &f)
 {
-    switch (option) {
-    case Animation:
-    case Size:
-        return true;
-    default:
-        return false;
+    const int w = visibleWidth(img, f);
+    const int h = visibleHeight(img, f);
+    if (w == 0 || h == 0) {
+        return QImage();
     }
+    return ApngBufferPool::instance()->copy(img, QRect(f.x, f.y, w, h));
 }
-QVariant APNGHandler::option(ImageOption option) const
+
+// Apply the dispose op of `f`; `saved` is saveFrameRect() from before
+// compositing `f`
+static void disposeFrame(QImage &img, const FrameBuf &f, const QImage &saved)
 {
-    if (!ensureParsed()) {
-        return QVariant();
+    if (f.dispose_op != PNG_DISPOSE_OP_PREVIOUS
+        && f.dispose_op != PNG_DISPOSE_OP_BACKGROUND) {
+        return;
     }
-
-    switch (option) {
-    case Animation: {
-        return !m_frames.empty();
+    detachCanvas(img);
+    const bool indexed = img.format() == QImage::Format_Indexed8;
+    // If disposal=PREVIOUS, restore the old pixels
+    if (f.dispose_op == PNG_DISPOSE_OP_PREVIOUS) {
+        for (int y = 0; y < saved.height(); y++) {
+            if (indexed) {
+                memcpy(destIndexRow(img, f, y), saved.constScanLine(y),
+                       size_t(saved.width()));
+            }
+            else {
+                apngCopyRow(destRow(img, f, y),
+                            reinterpret_cast<const quint32 *>(
+                                saved.constScanLine(y)),
+                            saved.width());
+            }
+        }
     }
-    case Size:
-        if (!m_frames.isEmpty()) {
-            return m_frames.first().size();
+    // If disposal=BACKGROUND, clear the region to transparent
+    else {
+        const int w = visibleWidth(img, f);
+        const int h = visibleHeight(img, f);
+        const int clear
+            = indexed ? int(transparentIndex(img.colorTable())) : 0;
+        for (int y = 0; y < h; y++) {
+            if (indexed) {
+                memset(destIndexRow(img, f, y), clear, size_t(w));
+            }
+            else {
+                apngClearRow(destRow(img, f, y), w);
+            }
         }
-        return QVariant();
-    default:
-        break;
     }
-
-    return QVariant();
 }
 
-//////////////////////////////////////////////////////////////////////////
-/// structs
-struct FrameBuf {
-    quint32 x      = 0;
-    quint32 y      = 0;
-    quint32 width  = 0;
-    quint32 height = 0;
-
-    quint16 delay_num = 0;
-    quint16 delay_den = 100;  // default to avoid div-by-zero
-
-    png_byte dispose_op = PNG_DISPOSE_OP_NONE;
-    png_byte blend_op   = PNG_BLEND_OP_SOURCE;
-
-    png_uint_32 rowbytes = 0;
-    int channels         = 4;        // Typically RGBA
-    png_bytep *rows      = nullptr;  // array of row pointers
-    png_byte *p          = nullptr;  // raw pixel buffer
-};
+// Same output layout for the progressive reader and frame replays: rows
+// come out as native QImage::Format_ARGB32 pixels, or as one palette index
+// per byte for Indexed8 canvases
+static void setupTransforms(png_structp pngPtr, bool indexed)
+{
+    if (indexed) {
+        png_set_packing(pngPtr);
+        (void)png_set_interlace_handling(pngPtr);
+        return;
+    }
+    // Expand to RGBA, remove 16-bit, etc. (like the original code)
+    png_set_expand(pngPtr);
+    png_set_strip_16(pngPtr);
+    png_set_gray_to_rgb(pngPtr);
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    png_set_add_alpha(pngPtr, 0xFF, PNG_FILLER_AFTER);
+    png_set_bgr(pngPtr);  // B,G,R,A in memory
+#else
+    png_set_add_alpha(pngPtr, 0xFF, PNG_FILLER_BEFORE);
+    png_set_swap_alpha(pngPtr);  // A,R,G,B in memory
+#endif
 
-struct ApngContext {
-    // Basic
-    QIODevice *device  = nullptr;
-    png_structp pngPtr = nullptr;
-    png_infop infoPtr  = nullptr;
-    bool hasError      = false;
-
-    // Animation info
-    bool isAnimated    = false;
-    bool skipFirst     = false;
-    quint32 frameCount = 1;
-
-    // Current "composited" image & buffer for reading
-    QImage lastImage;
-    FrameBuf curFrame;
-
-    // Results
-    QVector<QImage> frames;
-    QVector<int> delays;
-    int loopCount = 0;  // 0 means infinite in APNG spec
-};
+    // Handle interlace
+    (void)png_set_interlace_handling(pngPtr);
+}
 
-/// helpers
-static void freeFrameBuf(FrameBuf &f)
+static void addSpan(ApngContext *ctx, int streamFrame, qint64 offset,
+                    quint32 length)
 {
-    if (f.rows) {
-        delete[] f.rows;
-        f.rows = nullptr;
+    if (streamFrame < 0) {
+        return;
     }
-    if (f.p) {
-        delete[] f.p;
-        f.p = nullptr;
+    if (ctx->spans.size() <= streamFrame) {
+        ctx->spans.resize(streamFrame + 1);
     }
+    ApngChunkSpan span;
+    span.offset = offset;
+    span.length = length;
+    ctx->spans[streamFrame].push_back(span);
+}
+
+// Chunks noteChunk() needs in full, not just the header
+static bool needsPayload(const char *type)
+{
+    return memcmp(type, "IHDR", 4) == 0 || memcmp(type, "PLTE", 4) == 0
+           || memcmp(type, "tRNS", 4) == 0;
 }
 
-static void copyFrameToImage(QImage &dest, const FrameBuf &f, bool source)
+// Remember where frame data lives; `chunk` is the chunk at `offset`,
+// complete if needsPayload() says so, otherwise just the header
+static void noteChunk(ApngContext *ctx, qint64 offset, const char *chunk)
 {
-    // Copy RGBA pixels from f.rows into `dest`, at offsets (f.x, f.y).
-    // If `source==true`, we overwrite.
-    // If `source==false`, we might do some other logic (but not used here).
-    for (quint32 y = 0; y < f.height; y++) {
-        const png_bytep row = f.rows[y];
-        for (quint32 x = 0; x < f.width; x++) {
-            quint32 px = x * 4;  // B,G,R,A if we used png_set_bgr
-            QColor c;
-            c.setBlue(row[px + 0]);
-            c.setGreen(row[px + 1]);
-            c.setRed(row[px + 2]);
-            c.setAlpha(row[px + 3]);
-            dest.setPixelColor(x + f.x, y + f.y, c);
+    const quint32 len = qFromBigEndian<quint32>(chunk);
+    const char *type  = chunk + 4;
+
+    if (memcmp(type, "IHDR", 4) == 0) {
+        ctx->ihdr = QByteArray(chunk + 8, int(len));
+    }
+    else if (memcmp(type, "PLTE", 4) == 0 || memcmp(type, "tRNS", 4) == 0) {
+        ctx->paletteChunks.append(chunk, int(len) + 12);
+    }
+    else if (memcmp(type, "IDAT", 4) == 0) {
+        if (!ctx->seenIdat) {
+            ctx->seenIdat    = true;
+            ctx->idatHasFctl = ctx->fctlCount > 0;
         }
+        addSpan(ctx, 0, offset + 8, len);
+    }
+    else if (memcmp(type, "fcTL", 4) == 0) {
+        ctx->fctlCount++;
+    }
+    else if (memcmp(type, "fdAT", 4) == 0 && len >= 4) {
+        // skip the sequence number
+        int streamFrame = ctx->idatHasFctl ? ctx->fctlCount - 1
+                                           : ctx->fctlCount;
+        addSpan(ctx, streamFrame, offset + 12, len - 4);
     }
 }
 
-static void blendFrame(QImage &dest, const FrameBuf &f)
+// Map `device` if it is a file, once per context. Everything else, and
+// files that can't be mapped, go through the read buffer.
+void mapFile(ApngContext *ctx, QIODevice *device)
 {
-    // "Over" blend the current frame onto `dest`.
-    for (quint32 y = 0; y < f.height; y++) {
-        const png_bytep row = f.rows[y];
-        for (quint32 x = 0; x < f.width; x++) {
-            quint32 px = x * 4;
-            QColor src;
-            src.setBlue(row[px + 0]);
-            src.setGreen(row[px + 1]);
-            src.setRed(row[px + 2]);
-            src.setAlpha(row[px + 3]);
-
-            if (src.alpha() == 0xff) {
-                // fully opaque => just overwrite
-                dest.setPixelColor(x + f.x, y + f.y, src);
-            }
-            else if (src.alpha() != 0x00) {
-                // do a simple alpha blend with existing pixel
-                QColor dst = dest.pixelColor(x + f.x, y + f.y);
-                int outA
-                    = src.alpha() + dst.alpha() * (0xff - src.alpha()) / 0xff;
-
-                if (outA != 0) {
-                    int outR = (src.red() * src.alpha()
-                                + dst.red() * dst.alpha() * (0xff - src.alpha())
-                                      / 0xff)
-                               / outA * 0xff;
-                    int outG = (src.green() * src.alpha()
-                                + dst.green() * dst.alpha()
-                                      * (0xff - src.alpha()) / 0xff)
-                               / outA * 0xff;
-                    int outB = (src.blue() * src.alpha()
-                                + dst.blue() * dst.alpha()
-                                      * (0xff - src.alpha()) / 0xff)
-                               / outA * 0xff;
-
-                    // clamp
-                    outR = qBound(0, outR, 255);
-                    outG = qBound(0, outG, 255);
-                    outB = qBound(0, outB, 255);
-                    // outA is 0..255
-                    dest.setPixelColor(x + f.x, y + f.y,
-                                       QColor(outR, outG, outB, outA));
-                }
-                else {
-                    // alpha=0 => fully transparent => do nothing
-                }
-            }
-            // else alpha=0 => fully transparent => do nothing
-        }
+    if (ctx->mapTried) {
+        return;
+    }
+    ctx->mapTried = true;
+
+    auto file = qobject_cast<QFileDevice *>(device);
+    if (!file || file->isSequential() || !file->isReadable()) {
+        return;
     }
+    const qint64 size = file->size();
+    uchar *p          = size > 0 ? file->map(0, size) : nullptr;
+    if (!p) {
+        return;
+    }
+    ctx->mappedFile = file;
+    ctx->map        = reinterpret_cast<const char *>(p);
+    ctx->mapSize    = size;
 }
 
-//  read length bytes from device, pass to libpng
-//  If length==0, read exactly one chunk (size+type+data+CRC).
-static bool readChunk(ApngContext *ctx, quint32 length = 0)
+void unmapFile(ApngContext *ctx)
 {
-    if (!ctx->device || ctx->device->atEnd()) {
-        return false;
+    if (ctx->map && ctx->mappedFile) {
+        ctx->mappedFile->unmap(
+            reinterpret_cast<uchar *>(const_cast<char *>(ctx->map)));
+    }
+    ctx->map     = nullptr;
+    ctx->mapSize = 0;
+}
+
+// Closing a file drops its mappings
+static bool mapValid(const ApngContext *ctx)
+{
+    return ctx->map && ctx->mappedFile && ctx->mappedFile->isOpen();
+}
+
+// Bytes at device offset `pos`, which must be below bufferEnd()
+static const char *bufferAt(const ApngContext *ctx, qint64 pos)
+{
+    if (ctx->map) {
+        return ctx->map + pos;
     }
+    return ctx->buf.constData() + (pos - ctx->bufStart);
+}
 
-    QByteArray data;
-    if (length == 0) {
-        // read chunk length (4 bytes)
-        QByteArray sizeBytes = ctx->device->read(4);
-        if (sizeBytes.size() < 4)
-            return false;
+static qint64 bufferEnd(const ApngContext *ctx)
+{
+    return ctx->map ? ctx->mapEnd : ctx->bufStart + ctx->buf.size();
+}
 
-        quint32 chunkLen = qFromBigEndian<quint32>(sizeBytes.constData());
-        chunkLen += 8;  // +4 for 'type', +4 for 'CRC'
-        // read chunk data
-        data = sizeBytes + ctx->device->read(chunkLen);
-        // minus the 4 we already have
-        if ((int)chunkLen > data.size() - 4) {
+// Keep what libpng or the chunk scan still needs, then append up to
+// `blockSize` bytes from the device. The allocation is kept across blocks
+// and decodes; it only grows. A mapping just moves its window on.
+static bool refill(ApngContext *ctx)
+{
+    if (ctx->map) {
+        if (!mapValid(ctx) || ctx->mapEnd >= ctx->mapSize) {
             return false;
         }
+        const qint64 end = qMin(ctx->mapSize, ctx->mapEnd + ctx->blockSize);
+        ctx->decodeStats.bytesRead += end - ctx->mapEnd;
+        ctx->mapEnd = end;
+        return true;
     }
-    else {
-        data = ctx->device->read(length);
-        if (data.size() < (int)length) {
-            return false;
+
+    const qint64 keep = qMin(ctx->feedPos, ctx->scanPos) - ctx->bufStart;
+    const int drop    = int(qBound<qint64>(0, keep, ctx->buf.size()));
+    if (drop > 0) {
+        ctx->buf.remove(0, drop);
+        ctx->bufStart += drop;
+    }
+
+    const int old = ctx->buf.size();
+    if (ctx->buf.capacity() < old + ctx->blockSize) {
+        // reserve() also stops Qt from freeing it when it runs empty
+        ctx->buf.reserve(old + ctx->blockSize);
+        ctx->readStats.allocations++;
+    }
+    ctx->buf.resize(old + ctx->blockSize);
+    qint64 got = 0;
+    {
+        StageTimer timer(ctx->timing, &ctx->decodeStats.ioNs);
+        got = ctx->device->read(ctx->buf.data() + old, ctx->blockSize);
+    }
+    ctx->readStats.reads++;
+    ctx->decodeStats.bytesRead += qMax<qint64>(got, 0);
+    ctx->buf.resize(old + int(qMax<qint64>(got, 0)));
+    ctx->readStats.bufferSize = ctx->buf.capacity();
+    return got > 0;
+}
+
+// Note every chunk whose header is buffered. Blocks grow with the chunks,
+// up to 1 MiB, so files with big IDAT/fdAT chunks take fewer reads.
+static void scanBuffered(ApngContext *ctx)
+{
+    const qint64 end = bufferEnd(ctx);
+    while (ctx->scanPos + 8 <= end) {
+        const char *chunk = bufferAt(ctx, ctx->scanPos);
+        const quint32 len = qFromBigEndian<quint32>(chunk);
+        const qint64 next = ctx->scanPos + 12 + len;
+        if (needsPayload(chunk + 4) && next > end) {
+            // the rest comes with the next block
+            break;
+        }
+        noteChunk(ctx, ctx->scanPos, chunk);
+        while (ctx->blockSize < 1024 * 1024
+               && qint64(ctx->blockSize) < 2 * qint64(len)) {
+            ctx->blockSize *= 2;
         }
+        ctx->scanPos = next;
     }
+}
 
+// Hand the buffered bytes to libpng, reading a new block first if they
+// were all used. Callbacks may pause libpng, the bytes it did not take
+// are fed first next time.
+// Returns false once the device has nothing more.
+static bool feedBlock(ApngContext *ctx)
+{
+    if (ctx->feedPos >= bufferEnd(ctx)) {
+        if (!ctx->device || !refill(ctx)) {
+            return false;
+        }
+    }
+    scanBuffered(ctx);
+
+    const qint64 end    = bufferEnd(ctx);
+    const qint64 length = end - ctx->feedPos;
+    ctx->unconsumed     = 0;
+
+    // Inflating happens inside png_process_data(), around the callbacks.
+    // No StageTimer here: libpng errors longjmp() over this frame.
+    APNGHandler::DecodeStats &stats = ctx->decodeStats;
+    const qint64 callbacks
+        = stats.rowNs + stats.compositeNs + stats.disposeNs + stats.copyNs;
+    QElapsedTimer timer;
+    if (ctx->timing) {
+        timer.start();
+    }
+    // libpng does not write to its input
     png_process_data(ctx->pngPtr, ctx->infoPtr,
-                     reinterpret_cast<png_bytep>(data.data()),
-                     static_cast<png_size_t>(data.size()));
-    return !ctx->device->atEnd();
+                     reinterpret_cast<png_bytep>(
+                         const_cast<char *>(bufferAt(ctx, ctx->feedPos))),
+                     png_size_t(length));
+    if (ctx->timing) {
+        stats.inflateNs += timer.nsecsElapsed()
+                           - (stats.rowNs + stats.compositeNs
+                              + stats.disposeNs + stats.copyNs - callbacks);
+    }
+    ctx->feedPos = end - qint64(ctx->unconsumed);
+    ctx->readStats.bytesFed += length - qint64(ctx->unconsumed);
+    return true;
 }
 
-/// callbacks
-// APNG: Called at the start of each animation frame
-static void frameInfoCallback(png_structp pngPtr, png_uint_32 /*frame_num*/)
+/// output transform
+static bool hasTransform(const ApngContext *ctx)
 {
-    auto ctx     = reinterpret_cast<ApngContext *>(png_get_io_ptr(pngPtr));
-    auto infoPtr = ctx->infoPtr;
-
-    // Collect next frame offsets etc.
-    FrameBuf &f  = ctx->curFrame;
-    f.x          = png_get_next_frame_x_offset(pngPtr, infoPtr);
-    f.y          = png_get_next_frame_y_offset(pngPtr, infoPtr);
-    f.width      = png_get_next_frame_width(pngPtr, infoPtr);
-    f.height     = png_get_next_frame_height(pngPtr, infoPtr);
-    f.delay_num  = png_get_next_frame_delay_num(pngPtr, infoPtr);
-    f.delay_den  = png_get_next_frame_delay_den(pngPtr, infoPtr);
-    f.dispose_op = png_get_next_frame_dispose_op(pngPtr, infoPtr);
-    f.blend_op   = png_get_next_frame_blend_op(pngPtr, infoPtr);
+    return !ctx->clipRect.isNull() || ctx->scaledSize.isValid();
 }
 
-// APNG: Called when a frame is complete
-static void frameEndCallback(png_structp pngPtr, png_uint_32 frame_num)
+// Canvas area that ends up in the output
+static QRect outputSource(const ApngContext *ctx)
 {
-    auto ctx    = reinterpret_cast<ApngContext *>(png_get_io_ptr(pngPtr));
-    FrameBuf &f = ctx->curFrame;
-    QImage &img = ctx->lastImage;
+    const QRect canvas(QPoint(0, 0), ctx->canvasSize());
+    return ctx->clipRect.isNull() ? canvas : ctx->clipRect & canvas;
+}
 
-    // If the APNG's "first frame is hidden" bit is set, skip that first frame
-    if (frame_num == 0 && ctx->skipFirst) {
-        return;
+static QSize outputSize(const ApngContext *ctx)
+{
+    if (ctx->scaledSize.isValid()) {
+        return ctx->scaledSize;
     }
+    return ctx->clipRect.isNull() ? ctx->canvasSize() : ctx->clipRect.size();
+}
 
-    // If this is effectively the "first displayed frame", we ensure correct
-    // blend/dispose for some edge cases:
-    if ((frame_num == 0 && !ctx->skipFirst)
-        || (frame_num == 1 && ctx->skipFirst)) {
-        // Force SOURCE blend on first visible frame
-        f.blend_op = PNG_BLEND_OP_SOURCE;
-        // If dispose_op was PREVIOUS, use BACKGROUND instead
-        if (f.dispose_op == PNG_DISPOSE_OP_PREVIOUS) {
-            f.dispose_op = PNG_DISPOSE_OP_BACKGROUND;
-        }
+// Canvas rectangle in output coordinates
+static QRect outputRect(const ApngContext *ctx, const QRect &rect)
+{
+    if (!hasTransform(ctx)) {
+        return rect;
     }
+    return apngScaledRect(outputSource(ctx), outputSize(ctx), rect);
+}
 
-    // Possibly store the "before" image if disposal=PREVIOUS
-    QImage temp;
-    if (f.dispose_op == PNG_DISPOSE_OP_PREVIOUS) {
-        temp = img;
+// Displayed frame `index` as read() returns it. Following the previous
+// output, only the pixels under the dirty rectangle are filtered again.
+static QImage outputFrame(ApngContext *ctx, const QImage &canvas, int index)
+{
+    if (!hasTransform(ctx)) {
+        return canvas;
     }
-
-    // Composite this frame into `img`
-    if (f.blend_op == PNG_BLEND_OP_OVER) {
-        blendFrame(img, f);
+    const QSize size = outputSize(ctx);
+    QImage out;
+    QRect part(QPoint(0, 0), size);
+    if (index > 0 && index == ctx->lastOutputIndex + 1) {
+        out  = ctx->lastOutput;
+        part = outputRect(ctx, ctx->dirtyRect(index));
+        detachCanvas(out);
     }
     else {
-        copyFrameToImage(img, f, true);
-    }
-    // Add resulting frame to the list
-    int delayMs = 0;
-    if (f.delay_den > 0) {
-        delayMs = static_cast<int>((1000.0 * f.delay_num) / f.delay_den);
+        out = ApngBufferPool::instance()->image(size, canvas.format());
     }
-    ctx->frames.push_back(img);
-    ctx->delays.push_back(delayMs);
+    apngScale(canvas, outputSource(ctx), &out, part);
 
-    // If disposal=PREVIOUS, restore the old image
-    if (f.dispose_op == PNG_DISPOSE_OP_PREVIOUS) {
-        img = temp;
+    ctx->lastOutput      = out;
+    ctx->lastOutputIndex = index;
+    return out;
+}
+
+// Whether `a` and `b` match within `rect`; outside it they are known to
+static bool samePixels(const QImage &a, const QImage &b, const QRect &rect)
+{
+    if (a.size() != b.size() || a.format() != b.format()) {
+        return false;
     }
-    // If disposal=BACKGROUND, clear the region to transparent
-    else if (f.dispose_op == PNG_DISPOSE_OP_BACKGROUND) {
-        for (quint32 yy = 0; yy < f.height; yy++) {
-            for (quint32 xx = 0; xx < f.width; xx++) {
-                img.setPixelColor(xx + f.x, yy + f.y, Qt::transparent);
-            }
+    const QRect r    = rect & a.rect();
+    const int offset = r.x() * a.depth() / 8;
+    const int bytes  = r.width() * a.depth() / 8;
+    for (int y = r.top(); y < r.top() + r.height(); y++) {
+        if (memcmp(a.constScanLine(y) + offset, b.constScanLine(y) + offset,
+                   size_t(bytes))
+            != 0) {
+            return false;
         }
     }
+    return true;
 }
 
-// Called once the PNG header is read:
-static void infoCallback(png_structp pngPtr, png_infop infoPtr)
+// Palette for compositing on indices, exactly as the ARGB path would: a
+// scanned palette image without output transform, whose OVER frames only
+// meet opaque or fully transparent entries, with an entry to clear to.
+// Empty otherwise.
+static QVector<QRgb> indexedColorTable(const ApngContext *ctx)
 {
-    auto ctx = reinterpret_cast<ApngContext *>(png_get_io_ptr(pngPtr));
-
-    // Expand to RGBA, remove 16-bit, etc. (like the original code)
-    png_set_expand(pngPtr);
-    png_set_strip_16(pngPtr);
-    png_set_gray_to_rgb(pngPtr);
-    png_set_add_alpha(pngPtr, 0xFF, PNG_FILLER_AFTER);
-    png_set_bgr(pngPtr);  // optional: make channels BGR(A)
+    if (!ctx->scanned || ctx->info.colorType != PNG_COLOR_TYPE_PALETTE
+        || hasTransform(ctx)) {
+        return QVector<QRgb>();
+    }
+    QVector<QRgb> table;
+    QByteArray alpha;
+    const QByteArray &chunks = ctx->info.paletteChunks;
+    const auto bytes = reinterpret_cast<const uchar *>(chunks.constData());
+    for (qint64 offset = 0; offset + 12 <= chunks.size();) {
+        const qint64 len  = qFromBigEndian<quint32>(bytes + offset);
+        const uchar *data = bytes + offset + 8;
+        if (offset + 12 + len > chunks.size()) {
+            break;
+        }
+        if (memcmp(bytes + offset + 4, "PLTE", 4) == 0) {
+            for (int i = 0; i < len / 3 && i < 256; i++) {
+                table.push_back(
+                    qRgb(data[3 * i], data[3 * i + 1], data[3 * i + 2]));
+            }
+        }
+        else if (memcmp(bytes + offset + 4, "tRNS", 4) == 0) {
+            alpha = QByteArray(reinterpret_cast<const char *>(data), int(len));
+        }
+        offset += 12 + len;
+    }
+    if (table.isEmpty()) {
+        return QVector<QRgb>();
+    }
 
-    // Handle interlace
-    (void)png_set_interlace_handling(pngPtr);
+    bool partial = false;
+    bool clear   = false;
+    for (int i = 0; i < table.size(); i++) {
+        const int a = i < alpha.size() ? uchar(alpha.at(i)) : 255;
+        table[i]    = qRgba(qRed(table[i]), qGreen(table[i]),
+                            qBlue(table[i]), a);
+        partial |= a != 0 && a != 255;
+        clear |= a == 0;
+    }
+    // The first frame always replaces the canvas
+    for (int i = 1; partial && i < ctx->info.frames.size(); i++) {
+        if (ctx->info.frames.at(i).blendOp == PNG_BLEND_OP_OVER) {
+            return QVector<QRgb>();
+        }
+    }
+    if (!clear) {
+        if (table.size() == 256) {
+            return QVector<QRgb>();
+        }
+        table.push_back(qRgba(0, 0, 0, 0));
+    }
+    // Out of range indices come out opaque black, as libpng expands them
+    while (table.size() < 256) {
+        table.push_back(qRgb(0, 0, 0));
+    }
+    return table;
+}
+
+// Settle the canvas format while Format_Indexed8 is wanted: it is used
+// where indexedColorTable() allows, Format_ARGB32 otherwise. libpng gets
+// set up for one row layout when decoding starts, so from then on this
+// fails for settings that would need the other one.
+static bool resolveFormat(ApngContext *ctx)
+{
+    if (!ctx->wantIndexed) {
+        return true;
+    }
+    const QVector<QRgb> table   = indexedColorTable(ctx);
+    const QImage::Format format = table.isEmpty()
+                                      ? QImage::Format_ARGB32
+                                      : QImage::Format_Indexed8;
+    if (format == ctx->format && table == ctx->colorTable) {
+        return true;
+    }
+    if (ctx->started || ctx->decodedFrames() > 0) {
+        return false;
+    }
+    ctx->format     = format;
+    ctx->colorTable = table;
+    return true;
+}
+
+// Only until the first frame is composited
+static bool setOutputTransform(ApngContext *ctx, const QRect &clip,
+                               const QSize &scaled)
+{
+    if (clip == ctx->clipRect && scaled == ctx->scaledSize) {
+        return true;
+    }
+    if (ctx->decodedFrames() > 0 || (!clip.isNull() && clip.isEmpty())
+        || (scaled.isValid() && scaled.isEmpty())) {
+        return false;
+    }
+    const QRect oldClip   = ctx->clipRect;
+    const QSize oldScaled = ctx->scaledSize;
+    ctx->clipRect         = clip;
+    ctx->scaledSize       = scaled;
+    if (!resolveFormat(ctx)) {
+        ctx->clipRect   = oldClip;
+        ctx->scaledSize = oldScaled;
+        return false;
+    }
+    return true;
+}
+
+// Composite `f` as the next displayed frame and keep the result; `spans`
+// is where its data lives in the file
+void addFrame(ApngContext *ctx, const FrameBuf &f,
+              const QVector<ApngChunkSpan> &spans)
+{
+    QImage &img     = ctx->lastImage;
+    const int index = ctx->decodedFrames();
+    APNGHandler::DecodeStats &stats = ctx->decodeStats;
+    // Keep the background every few frames, replays start from there
+    if (ctx->store.budget() > 0 && index > 0
+        && index % ctx->checkpointInterval == 0) {
+        StageTimer timer(ctx->timing, &stats.copyNs);
+        ctx->store.addCheckpoint(index, img);
+    }
+
+    // Keep what disposal=PREVIOUS restores
+    QImage saved;
+    if (f.dispose_op == PNG_DISPOSE_OP_PREVIOUS) {
+        StageTimer timer(ctx->timing, &stats.disposeNs);
+        saved = saveFrameRect(img, f);
+    }
+
+    // Composite this frame into `img`
+    {
+        StageTimer timer(ctx->timing, &stats.compositeNs);
+        compositeFrame(img, f);
+    }
+    stats.frames++;
+    // Add resulting frame to the list
+    const int delayMs = int(apngDelayUs(f.delay_num, f.delay_den) / 1000);
+    FrameRecord r;
+    r.x          = f.x;
+    r.y          = f.y;
+    r.width      = f.width;
+    r.height     = f.height;
+    r.dispose_op = f.dispose_op;
+    r.blend_op   = f.blend_op;
+    r.spans      = spans;
+    ctx->records.push_back(r);
+    ctx->delays.push_back(delayMs);
+    {
+        StageTimer timer(ctx->timing, &stats.copyNs);
+        QRect dirty = outputRect(ctx, ctx->dirtyRect(index));
+        QImage out  = outputFrame(ctx, img, index);
+        if (index > 0 && samePixels(out, ctx->lastFrame, dirty)) {
+            // Share the previous frame, also as the base of the next
+            // rescale
+            out   = ctx->lastFrame;
+            dirty = QRect();
+            ctx->markUnchanged(index);
+            if (hasTransform(ctx)) {
+                ctx->lastOutput = out;
+            }
+        }
+        if (ctx->storageMode == APNGHandler::DeltaFrames && index > 0
+            && index % ctx->checkpointInterval != 0) {
+            ctx->store.insertPatch(index, out, dirty);
+        }
+        else {
+            ctx->store.insert(index, out);
+        }
+        ctx->lastFrame = out;
+        // The stored frame may share `img`; copy now rather than in the
+        // next write to it
+        detachCanvas(img);
+    }
+
+    StageTimer timer(ctx->timing, &stats.disposeNs);
+    disposeFrame(img, f, saved);
+}
+
+/// limits
+static APNGHandler::DecodeLimits defaultDecodeLimits()
+{
+    QMutexLocker lock(&s_defaultLimitsMutex);
+    return s_defaultLimits;
+}
+
+static const char *decodeErrorText(APNGHandler::DecodeError error)
+{
+    switch (error) {
+    case APNGHandler::NoError:
+        return "no error";
+    case APNGHandler::InvalidData:
+        return "invalid data";
+    case APNGHandler::PixelLimit:
+        return "canvas over the pixel limit";
+    case APNGHandler::FrameLimit:
+        return "more frames than the limit";
+    case APNGHandler::ByteLimit:
+        return "frames over the byte limit";
+    case APNGHandler::Timeout:
+        return "decoding timed out";
+    case APNGHandler::Cancelled:
+        return "decoding cancelled";
+    case APNGHandler::OutOfMemory:
+        return "out of memory";
+    }
+    return "unknown error";
+}
+
+// A limit or cancellation, as opposed to data libpng gave up on
+static bool isStop(APNGHandler::DecodeError error)
+{
+    return error != APNGHandler::NoError
+           && error != APNGHandler::InvalidData;
+}
+
+// Canvas size and announced frame count, before anything is allocated;
+// `frames` < 0 when not known yet
+static APNGHandler::DecodeError checkHeader(const ApngContext *ctx,
+                                            const QSize &size,
+                                            int frames)
+{
+    const APNGHandler::DecodeLimits &limits = ctx->limits;
+    if (limits.maxPixels > 0 && size.isValid()
+        && qint64(size.width()) * size.height() > limits.maxPixels) {
+        return APNGHandler::PixelLimit;
+    }
+    if (limits.maxFrames > 0 && frames > limits.maxFrames) {
+        return APNGHandler::FrameLimit;
+    }
+    return APNGHandler::NoError;
+}
+
+// Cancellation and the time limit of the current call
+static APNGHandler::DecodeError checkStop(const ApngContext *ctx)
+{
+    const APNGHandler::DecodeLimits &limits = ctx->limits;
+    if (ctx->cancelled.load(std::memory_order_relaxed)
+        || (limits.cancel && limits.cancel->load(std::memory_order_relaxed))) {
+        return APNGHandler::Cancelled;
+    }
+    if (limits.timeoutMs > 0 && ctx->callTimer.isValid()
+        && ctx->callTimer.hasExpired(limits.timeoutMs)) {
+        return APNGHandler::Timeout;
+    }
+    return APNGHandler::NoError;
+}
+
+// Everything that stops decoding before displayed frame `index`. Bytes
+// count every frame at output size, shared or not, as ensureParsed()
+// would hand them out.
+APNGHandler::DecodeError checkFrame(const ApngContext *ctx, int index)
+{
+    const APNGHandler::DecodeError stop = checkStop(ctx);
+    if (stop != APNGHandler::NoError) {
+        return stop;
+    }
+    const APNGHandler::DecodeLimits &limits = ctx->limits;
+    if (limits.maxFrames > 0 && index >= limits.maxFrames) {
+        return APNGHandler::FrameLimit;
+    }
+    if (limits.maxBytes > 0) {
+        const QSize size = outputSize(ctx);
+        const int bpp    = ctx->format == QImage::Format_Indexed8 ? 1 : 4;
+        if (qint64(index + 1) * size.width() * size.height() * bpp
+            > limits.maxBytes) {
+            return APNGHandler::ByteLimit;
+        }
+    }
+    return APNGHandler::NoError;
+}
+
+// Outside of libpng; the decoder keeps failing from here on
+void stopDecode(ApngContext *ctx, APNGHandler::DecodeError error)
+{
+    qWarning() << "decode stopped:" << decodeErrorText(error);
+    ctx->error    = error;
+    ctx->hasError = true;
+}
+
+// Inside a libpng callback: leave through the setjmp() in decodeFrames(),
+// which frees the libpng state and the frame in progress. Nothing with a
+// destructor may live in the callback's frame at this point.
+static void abortDecode(png_structp pngPtr, ApngContext *ctx,
+                        APNGHandler::DecodeError error)
+{
+    ctx->error = error;
+    png_error(pngPtr, decodeErrorText(error));
+}
+
+/// callbacks
+// APNG: Called at the start of each animation frame
+static void frameInfoCallback(png_structp pngPtr, png_uint_32 /*frame_num*/)
+{
+    auto ctx     = reinterpret_cast<ApngContext *>(png_get_io_ptr(pngPtr));
+    auto infoPtr = ctx->infoPtr;
+
+    const APNGHandler::DecodeError error
+        = checkFrame(ctx, ctx->decodedFrames());
+    if (error != APNGHandler::NoError) {
+        abortDecode(pngPtr, ctx, error);
+    }
+
+    // Collect next frame offsets etc.
+    FrameBuf &f  = ctx->curFrame;
+    f.x          = png_get_next_frame_x_offset(pngPtr, infoPtr);
+    f.y          = png_get_next_frame_y_offset(pngPtr, infoPtr);
+    f.width      = png_get_next_frame_width(pngPtr, infoPtr);
+    f.height     = png_get_next_frame_height(pngPtr, infoPtr);
+    f.delay_num  = png_get_next_frame_delay_num(pngPtr, infoPtr);
+    f.delay_den  = png_get_next_frame_delay_den(pngPtr, infoPtr);
+    f.dispose_op = png_get_next_frame_dispose_op(pngPtr, infoPtr);
+    f.blend_op   = png_get_next_frame_blend_op(pngPtr, infoPtr);
+}
+
+// APNG: Called when a frame is complete
+static void frameEndCallback(png_structp pngPtr, png_uint_32 frame_num)
+{
+    auto ctx    = reinterpret_cast<ApngContext *>(png_get_io_ptr(pngPtr));
+    FrameBuf &f = ctx->curFrame;
+
+    // If the APNG's "first frame is hidden" bit is set, skip that first frame
+    if (frame_num == 0 && ctx->skipFirst) {
+        return;
+    }
+
+    // If this is effectively the "first displayed frame", we ensure correct
+    // blend/dispose for some edge cases:
+    if ((frame_num == 0 && !ctx->skipFirst)
+        || (frame_num == 1 && ctx->skipFirst)) {
+        // Force SOURCE blend on first visible frame
+        f.blend_op = PNG_BLEND_OP_SOURCE;
+        // If dispose_op was PREVIOUS, use BACKGROUND instead
+        if (f.dispose_op == PNG_DISPOSE_OP_PREVIOUS) {
+            f.dispose_op = PNG_DISPOSE_OP_BACKGROUND;
+        }
+    }
+
+    QVector<ApngChunkSpan> spans;
+    if ((int)frame_num < ctx->spans.size()) {
+        spans = ctx->spans.at(frame_num);
+        ctx->spans[frame_num].clear();
+    }
+    addFrame(ctx, f, spans);
+
+    // All announced frames are in, no need to wait for IEND
+    if (ctx->decodedFrames() >= ctx->expectedFrames()) {
+        ctx->finished = true;
+    }
+    // Got what decodeFrames() asked for, keep the rest of the block
+    if (ctx->decodedFrames() >= ctx->targetFrames) {
+        ctx->unconsumed = png_process_data_pause(pngPtr, 0);
+    }
+}
+
+// Called once the PNG header is read:
+static void infoCallback(png_structp pngPtr, png_infop infoPtr)
+{
+    auto ctx = reinterpret_cast<ApngContext *>(png_get_io_ptr(pngPtr));
+
+    setupTransforms(pngPtr, ctx->format == QImage::Format_Indexed8);
 
     // Update info for reading
     png_read_update_info(pngPtr, infoPtr);
@@ -420,8 +947,15 @@ static void infoCallback(png_structp pngPtr, png_infop infoPtr)
     quint32 width  = png_get_image_width(pngPtr, infoPtr);
     quint32 height = png_get_image_height(pngPtr, infoPtr);
 
-    ctx->lastImage = QImage(width, height, QImage::Format_ARGB32);
-    ctx->lastImage.fill(Qt::transparent);
+    const APNGHandler::DecodeError error
+        = checkHeader(ctx, QSize(int(width), int(height)), -1);
+    if (error != APNGHandler::NoError) {
+        abortDecode(pngPtr, ctx, error);
+    }
+    ctx->lastImage = newCanvas(ctx, QSize(width, height));
+    if (ctx->lastImage.isNull()) {
+        abortDecode(pngPtr, ctx, APNGHandler::OutOfMemory);
+    }
 
     // Prepare current frame buffer
     FrameBuf &f  = ctx->curFrame;
@@ -434,12 +968,8 @@ static void infoCallback(png_structp pngPtr, png_infop infoPtr)
     f.delay_den  = 10;  // default or fallback
     f.dispose_op = PNG_DISPOSE_OP_NONE;
     f.blend_op   = PNG_BLEND_OP_SOURCE;
-    f.rowbytes   = png_get_rowbytes(pngPtr, infoPtr);
-
-    f.p    = new png_byte[f.height * f.rowbytes];
-    f.rows = new png_bytep[f.height];
-    for (quint32 j = 0; j < f.height; j++) {
-        f.rows[j] = f.p + j * f.rowbytes;
+    if (!allocFrameBuf(f, png_get_rowbytes(pngPtr, infoPtr))) {
+        abortDecode(pngPtr, ctx, APNGHandler::OutOfMemory);
     }
 
     // Check if file is APNG
@@ -458,6 +988,11 @@ static void infoCallback(png_structp pngPtr, png_infop infoPtr)
         }
         // Check if first frame is hidden
         ctx->skipFirst = (png_get_first_frame_is_hidden(pngPtr, infoPtr) != 0);
+        const APNGHandler::DecodeError frames
+            = checkHeader(ctx, QSize(), ctx->expectedFrames());
+        if (frames != APNGHandler::NoError) {
+            abortDecode(pngPtr, ctx, frames);
+        }
 
         // Use frame callbacks
         png_set_progressive_frame_fn(
@@ -476,6 +1011,12 @@ static void infoCallback(png_structp pngPtr, png_infop infoPtr)
         // Not animated => single image
         ctx->isAnimated = false;
     }
+
+    ctx->hasHeader = true;
+    if (ctx->targetFrames <= 0) {
+        // header only
+        ctx->unconsumed = png_process_data_pause(pngPtr, 0);
+    }
 }
 
 // Called whenever a row’s worth of data is available
@@ -487,14 +1028,24 @@ static void rowCallback(png_structp pngPtr,
     auto ctx    = reinterpret_cast<ApngContext *>(png_get_io_ptr(pngPtr));
     FrameBuf &f = ctx->curFrame;
 
+    // Before the timer exists, libpng errors longjmp() over this frame
+    if (rowNum % 64 == 63) {
+        const APNGHandler::DecodeError error = checkStop(ctx);
+        if (error != APNGHandler::NoError) {
+            abortDecode(pngPtr, ctx, error);
+        }
+    }
+
     // Combine row into our row buffer
+    StageTimer timer(ctx->timing, &ctx->decodeStats.rowNs);
     png_progressive_combine_row(pngPtr, f.rows[rowNum], newRow);
 }
 
 // Called when the entire (single-frame) image is done
 static void endCallback(png_structp pngPtr, png_infop)
 {
-    auto ctx = reinterpret_cast<ApngContext *>(png_get_io_ptr(pngPtr));
+    auto ctx      = reinterpret_cast<ApngContext *>(png_get_io_ptr(pngPtr));
+    ctx->finished = true;
     if (ctx->isAnimated) {
         // We'll handle adding frames in frameEndCallback for APNG.
         // But if it's APNG with only 1 frame, frameEndCallback also occurs.
@@ -502,89 +1053,1302 @@ static void endCallback(png_structp pngPtr, png_infop)
     }
 
     // Single-frame PNG => copy entire buffer to QImage
-    copyFrameToImage(ctx->lastImage, ctx->curFrame, true /*source*/);
-    ctx->frames.push_back(ctx->lastImage);
+    const FrameBuf &f = ctx->curFrame;
+    {
+        StageTimer timer(ctx->timing, &ctx->decodeStats.compositeNs);
+        compositeFrame(ctx->lastImage, f);
+    }
+    ctx->decodeStats.frames++;
+    FrameRecord r;
+    r.width  = f.width;
+    r.height = f.height;
+    if (!ctx->spans.isEmpty()) {
+        r.spans = ctx->spans.first();
+    }
+    ctx->records.push_back(r);
     ctx->delays.push_back(0);  // single-frame => no delay
+    StageTimer timer(ctx->timing, &ctx->decodeStats.copyNs);
+    ctx->store.insert(0, outputFrame(ctx, ctx->lastImage, 0));
 
     freeFrameBuf(ctx->curFrame);
 }
 
-bool APNGHandler::ensureParsed(QIODevice *device,
-                               int &loopCount,
-                               QVector<QImage> &frames,
-                               QVector<int> &delays)
+/// progressive decoding
+// Release libpng state; the frames decoded so far stay in `ctx`.
+void finishDecode(ApngContext *ctx)
 {
-    // 2) Check PNG signature
-    if (!canRead(device)) {
-        qWarning() << "no read";
+    if (ctx->pngPtr) {
+        png_destroy_read_struct(&ctx->pngPtr, &ctx->infoPtr, nullptr);
+    }
+    freeFrameBuf(ctx->curFrame);
+    ctx->lastFrame = QImage();
+    ctx->finished  = true;
+}
+
+// Feed `ctx->device` to libpng until the header is known and at least
+// `frameCount` frames are composited, or the stream is over.
+// Returns false on libpng errors.
+bool decodeFrames(ApngContext *ctx, int frameCount)
+{
+    if (ctx->limits.timeoutMs > 0) {
+        ctx->callTimer.start();
+    }
+    if (ctx->parallel) {
+        return decodeFramesParallel(ctx, frameCount);
+    }
+
+    auto isDone = [ctx, frameCount]() {
+        return ctx->hasHeader && ctx->decodedFrames() >= frameCount;
+    };
+    if (ctx->finished || isDone()) {
+        return !ctx->hasError;
+    }
+
+    // 1) Create libpng read structs on first use
+    if (!ctx->pngPtr) {
+        ctx->pngPtr = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr,
+                                             nullptr, nullptr);
+        if (!ctx->pngPtr) {
+            qWarning() << "decodeFrames: png_create_read_struct failed";
+            ctx->error    = APNGHandler::InvalidData;
+            ctx->hasError = true;
+            ctx->finished = true;
+            return false;
+        }
+        ctx->infoPtr = png_create_info_struct(ctx->pngPtr);
+        if (!ctx->infoPtr) {
+            qWarning() << "decodeFrames: png_create_info_struct failed";
+            ctx->error    = APNGHandler::InvalidData;
+            ctx->hasError = true;
+            finishDecode(ctx);
+            return false;
+        }
+
+        // 2) Register progressive callbacks
+        png_set_progressive_read_fn(
+            ctx->pngPtr,   // png struct
+            ctx,           // your custom pointer
+            infoCallback,  // called after reading initial header
+            rowCallback,   // called whenever a row is finished
+            endCallback    // called after the single image is finished
+                           // (for APNG, multiple frames => use frame callbacks)
+        );
+    }
+
+    // setjmp for libpng error handling; every call feeding data needs its
+    // own, the jump buffer of a previous call is gone with its stack frame
+    if (setjmp(png_jmpbuf(ctx->pngPtr))) {
+        if (ctx->error == APNGHandler::NoError) {
+            qWarning() << "decodeFrames: libpng error during parse";
+            ctx->error = APNGHandler::InvalidData;
+        }
+        else {
+            qWarning() << "decode stopped:" << decodeErrorText(ctx->error);
+        }
+        ctx->hasError = true;
+        finishDecode(ctx);
         return false;
     }
-    // Create a local context
-    ApngContext ctx;
-    ctx.device = device;
-    // 3) Create libpng read structs
-    ctx.pngPtr = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr,
-                                        nullptr);
-    if (!ctx.pngPtr) {
-        qWarning() << "ensureParsed: png_create_read_struct failed";
+
+    // 3) The stream starts here; chunks follow the 8 byte signature
+    if (!ctx->started) {
+        ctx->started  = true;
+        ctx->bufStart = ctx->device->pos();
+        ctx->feedPos  = ctx->bufStart;
+        ctx->scanPos  = ctx->bufStart + 8;
+        ctx->mapEnd   = ctx->bufStart;
+    }
+
+    // 4) keep feeding blocks until we have the frames we were asked for,
+    // the file ends, or we encounter an error.
+    ctx->targetFrames = frameCount;
+    ctx->starved      = false;
+    while (!ctx->finished && !isDone()) {
+        // Chunks libpng skips don't reach the callbacks
+        const APNGHandler::DecodeError error = checkStop(ctx);
+        if (error != APNGHandler::NoError) {
+            stopDecode(ctx, error);
+            finishDecode(ctx);
+            return false;
+        }
+        if (!feedBlock(ctx)) {
+            // Resumed from here by the next call once more data is in
+            if (ctx->incremental && ctx->device->isOpen()) {
+                ctx->starved = true;
+                return true;
+            }
+            ctx->finished = true;
+        }
+    }
+
+    // 5) Nothing more to come. Clean up
+    if (ctx->finished) {
+        finishDecode(ctx);
+    }
+    return true;
+}
+
+/// replays
+struct MemoryReader {
+    const char *data = nullptr;
+    size_t size      = 0;
+    size_t pos       = 0;
+};
+
+static void memoryReadFn(png_structp pngPtr, png_bytep out, png_size_t length)
+{
+    auto r = reinterpret_cast<MemoryReader *>(png_get_io_ptr(pngPtr));
+    if (length > r->size - r->pos) {
+        png_error(pngPtr, "read past end of frame");
+    }
+    memcpy(out, r->data + r->pos, length);
+    r->pos += length;
+}
+
+static void appendChunk(QByteArray &png, const char *type,
+                        const QByteArray &data)
+{
+    char buf[4];
+    qToBigEndian<quint32>(data.size(), buf);
+    png.append(buf, 4);
+
+    const int start = png.size();
+    png.append(type, 4);
+    png.append(data);
+    const uLong crc = crc32(
+        crc32(0L, Z_NULL, 0),
+        reinterpret_cast<const Bytef *>(png.constData() + start),
+        uInt(png.size() - start));
+    qToBigEndian<quint32>(quint32(crc), buf);
+    png.append(buf, 4);
+}
+
+// IDAT chunk with `span` of the file as payload, read in place
+static bool appendDataChunk(QByteArray &png, ApngContext *ctx,
+                            const ApngChunkSpan &span)
+{
+    const int start = png.size();
+    png.resize(start + 12 + int(span.length));
+    char *chunk = png.data() + start;
+    qToBigEndian<quint32>(span.length, chunk);
+    memcpy(chunk + 4, "IDAT", 4);
+    if (ctx->map) {
+        if (!mapValid(ctx) || span.offset + span.length > ctx->mapSize) {
+            return false;
+        }
+        memcpy(chunk + 8, ctx->map + span.offset, span.length);
+    }
+    else if (!ctx->device->seek(span.offset)
+             || ctx->device->read(chunk + 8, span.length)
+                    != qint64(span.length)) {
         return false;
     }
-    ctx.infoPtr = png_create_info_struct(ctx.pngPtr);
-    if (!ctx.infoPtr) {
-        qWarning() << "ensureParsed: png_create_info_struct failed";
-        png_destroy_read_struct(&ctx.pngPtr, nullptr, nullptr);
+    ctx->decodeStats.bytesRead += span.length;
+    const uLong crc = crc32(crc32(0L, Z_NULL, 0),
+                            reinterpret_cast<const Bytef *>(chunk + 4),
+                            uInt(span.length + 4));
+    qToBigEndian<quint32>(quint32(crc), chunk + 8 + span.length);
+    return true;
+}
+
+// Wrap the data chunks of a frame into a standalone PNG of the frame's
+// size, which needs no APNG sequence bookkeeping to decode
+bool buildPatch(ApngContext *ctx, const FrameRecord &r, QByteArray &png)
+{
+    // IHDR with the frame size, palette, data as IDAT
+    QByteArray ihdr = ctx->ihdr;
+    if (ihdr.size() < 13 || r.spans.isEmpty()) {
         return false;
     }
+    qToBigEndian<quint32>(r.width, ihdr.data());
+    qToBigEndian<quint32>(r.height, ihdr.data() + 4);
+
+    int size = 8 + 25 + ctx->paletteChunks.size() + 12;
+    for (const ApngChunkSpan &span : r.spans) {
+        size += 12 + int(span.length);
+    }
+    png.reserve(size);
+    png.resize(0);
+    png.append("\x89PNG\r\n\x1a\n", 8);
+    appendChunk(png, "IHDR", ihdr);
+    png += ctx->paletteChunks;
+    for (const ApngChunkSpan &span : r.spans) {
+        if (!appendDataChunk(png, ctx, span)) {
+            return false;
+        }
+    }
+    appendChunk(png, "IEND", QByteArray());
+    return true;
+}
+
+void frameFromRecord(FrameBuf &f, const FrameRecord &r)
+{
+    f.x          = r.x;
+    f.y          = r.y;
+    f.width      = r.width;
+    f.height     = r.height;
+    f.dispose_op = r.dispose_op;
+    f.blend_op   = r.blend_op;
+}
 
-    // setjmp for libpng error handling
-    if (setjmp(png_jmpbuf(ctx.pngPtr))) {
-        qWarning() << "ensureParsed: libpng error during parse";
-        png_destroy_read_struct(&ctx.pngPtr, &ctx.infoPtr, nullptr);
-        freeFrameBuf(ctx.curFrame);
+// Decode a buildPatch() PNG into `f`, with the transforms of the
+// progressive reader. Touches nothing but its arguments, so it can run on
+// any thread.
+bool decodePng(const QByteArray &png, FrameBuf &f, bool indexed)
+{
+    png_structp pngPtr
+        = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr,
+                                 nullptr);
+    if (!pngPtr) {
+        return false;
+    }
+    png_infop infoPtr = png_create_info_struct(pngPtr);
+    if (!infoPtr) {
+        png_destroy_read_struct(&pngPtr, nullptr, nullptr);
         return false;
     }
+    MemoryReader reader;
+    reader.data = png.constData();
+    reader.size = size_t(png.size());
+
+    if (setjmp(png_jmpbuf(pngPtr))) {
+        qWarning() << "decodePng: libpng error in frame data";
+        png_destroy_read_struct(&pngPtr, &infoPtr, nullptr);
+        freeFrameBuf(f);
+        return false;
+    }
+    png_set_read_fn(pngPtr, &reader, memoryReadFn);
+    png_read_info(pngPtr, infoPtr);
+    setupTransforms(pngPtr, indexed);
+    png_read_update_info(pngPtr, infoPtr);
+
+    f.channels = png_get_channels(pngPtr, infoPtr);
+    if (!allocFrameBuf(f, png_get_rowbytes(pngPtr, infoPtr))) {
+        png_error(pngPtr, "out of memory");
+    }
+    png_read_image(pngPtr, f.rows);
 
-    // 4) Register progressive callbacks
-    png_set_progressive_read_fn(
-        ctx.pngPtr,    // png struct
-        &ctx,          // your custom pointer
-        infoCallback,  // called after reading initial header
-        rowCallback,   // called whenever a row is finished
-        endCallback    // called after the single image is finished
-                       // (for APNG, multiple frames => use frame callbacks)
-    );
+    png_destroy_read_struct(&pngPtr, &infoPtr, nullptr);
+    return true;
+}
 
-    // 5) Feed the signature first
-    bool done = false;
+// Decode one frame again, in a buffer that is kept for the next replay
+static bool decodePatch(ApngContext *ctx, const FrameRecord &r, FrameBuf &f)
+{
     {
-        // read the first 8 bytes (signature)
-        readChunk(&ctx, 8);
-
-        // keep reading chunk by chunk until we have read all frames
-        // or the file ends, or we encounter an error.
-        while (!device->atEnd()) {
-            // Attempt to read exactly 1 chunk
-            if (!readChunk(&ctx, 0))
-                break;
-
-            // If it's APNG and we already have the official number of frames,
-            // we can check if we got them all:
-            if (ctx.isAnimated && (uint)ctx.frames.size() == ctx.frameCount) {
-                done = true;
-                break;
-            }
+        StageTimer timer(ctx->timing, &ctx->decodeStats.ioNs);
+        if (!buildPatch(ctx, r, ctx->patchBuf)) {
+            return false;
         }
     }
+    frameFromRecord(f, r);
+    StageTimer timer(ctx->timing, &ctx->decodeStats.inflateNs);
+    return decodePng(ctx->patchBuf, f,
+                     ctx->format == QImage::Format_Indexed8);
+}
 
-    // 6) Done. Clean up
-    png_destroy_read_struct(&ctx.pngPtr, &ctx.infoPtr, nullptr);
-    freeFrameBuf(ctx.curFrame);
-    // If we got at least one frame, parse was successful
-    if (!ctx.frames.isEmpty()) {
-        loopCount = ctx.loopCount;
-        frames    = ctx.frames;
-        delays    = ctx.delays;
-        return true;
+// Rebuild displayed frame `index` after it was evicted, starting from the
+// nearest checkpoint (or the replay cursor, when playing on after a replay)
+static QImage replayFrame(ApngContext *ctx, int index)
+{
+    if (!ctx->device || ctx->device->isSequential()
+        || index >= ctx->decodedFrames()) {
+        return QImage();
+    }
+
+    QImage canvas;
+    int start = ctx->store.checkpointBefore(index, &canvas);
+    if (ctx->replayNext > start && ctx->replayNext <= index) {
+        start  = ctx->replayNext;
+        canvas = ctx->replayCanvas;
+    }
+    if (start < 0) {
+        start  = 0;
+        canvas = newCanvas(ctx, ctx->canvasSize());
+    }
+
+    // The progressive reader continues from here later on
+    const qint64 pos = ctx->device->pos();
+    QImage frame;
+    FrameBuf f;
+    if (ctx->limits.timeoutMs > 0) {
+        ctx->callTimer.start();
+    }
+    for (int j = start; j <= index; j++) {
+        const APNGHandler::DecodeError error = checkStop(ctx);
+        if (error != APNGHandler::NoError) {
+            stopDecode(ctx, error);
+            break;
+        }
+        if (!decodePatch(ctx, ctx->records.at(j), f)) {
+            break;
+        }
+        QImage saved;
+        if (f.dispose_op == PNG_DISPOSE_OP_PREVIOUS) {
+            StageTimer timer(ctx->timing, &ctx->decodeStats.disposeNs);
+            saved = saveFrameRect(canvas, f);
+        }
+        {
+            StageTimer timer(ctx->timing, &ctx->decodeStats.compositeNs);
+            compositeFrame(canvas, f);
+        }
+        ctx->decodeStats.frames++;
+        if (j == index) {
+            StageTimer timer(ctx->timing, &ctx->decodeStats.copyNs);
+            frame = canvas;
+            detachCanvas(canvas);
+        }
+        {
+            StageTimer timer(ctx->timing, &ctx->decodeStats.disposeNs);
+            disposeFrame(canvas, f, saved);
+        }
+        freeFrameBuf(f);
+    }
+    ctx->device->seek(pos);
+
+    if (frame.isNull()) {
+        ctx->replayNext   = -1;
+        ctx->replayCanvas = QImage();
+        return frame;
+    }
+    ctx->store.addReplayed(index - start + 1);
+    ctx->replayNext   = index + 1;
+    ctx->replayCanvas = canvas;
+    StageTimer timer(ctx->timing, &ctx->decodeStats.copyNs);
+    frame = outputFrame(ctx, frame, index);
+    ctx->store.insert(index, frame);
+    return frame;
+}
+
+// Hand a completely decoded animation to ApngAnimationCache, once
+static void publishShared(ApngContext *ctx)
+{
+    if (ctx->sharedKey.isEmpty() || !ctx->finished) {
+        return;
+    }
+    const QByteArray key = ctx->sharedKey;
+    ctx->sharedKey.clear();
+    // Delta mode asked for less memory than full frames take
+    if (ctx->hasError || ctx->storageMode != APNGHandler::FullFrames) {
+        return;
+    }
+
+    QSharedPointer<ApngAnimation> animation(new ApngAnimation);
+    animation->canvasSize = ctx->canvasSize();
+    animation->loopCount  = ctx->loopCount;
+    for (int i = 0; i < ctx->decodedFrames(); i++) {
+        const QImage frame = ctx->store.value(i);
+        if (frame.isNull()) {
+            // evicted
+            return;
+        }
+        animation->frames.push_back(frame);
+        animation->delays.push_back(ctx->delayMs(i));
+        animation->dirty.push_back(ctx->dirtyRect(i));
+    }
+    ApngAnimationCache::instance()->insert(key, animation);
+}
+
+// Pass the stats of a finished decode to the callback, once
+static void reportDecodeStats(ApngContext *ctx)
+{
+    if (!ctx->timing || !ctx->finished || ctx->statsReported) {
+        return;
+    }
+    ctx->statsReported = true;
+
+    s_decodeStatsMutex.lock();
+    const APNGHandler::DecodeStatsCallback callback = s_decodeStatsCallback;
+    s_decodeStatsMutex.unlock();
+    if (callback) {
+        APNGHandler::DecodeStats stats = ctx->decodeStats;
+        stats.peakFrameBytes           = ctx->store.stats().peakBytes;
+        callback(ctx->device, stats);
+    }
+}
+
+// A frame mapped from the disk cache lost its pixels: decode the file
+// after all, and publish the result over the damaged animation. Nothing
+// was read from the device for the shared one.
+static void dropShared(ApngContext *ctx)
+{
+    qWarning() << "apng disk cache: damaged frame, decoding instead";
+    ctx->shared.reset();
+    ctx->finished  = false;
+    ctx->sharedKey = ApngAnimationCache::key(ctx->device, ctx->format,
+                                             ctx->clipRect, ctx->scaledSize);
+}
+
+// Displayed frame `index`, from the store, decoded on, or replayed
+QImage frameAt(ApngContext *ctx, int index)
+{
+    if (ctx->shared) {
+        if (ctx->shared->isIntact(index)) {
+            return ctx->shared->frames.value(index);
+        }
+        dropShared(ctx);
+    }
+    // Also finishes when metadata queries decode ahead
+    publishShared(ctx);
+    QImage frame;
+    if (ctx->store.find(index, &frame)) {
+        return frame;
+    }
+    if (index >= ctx->decodedFrames()) {
+        decodeFrames(ctx, index + 1);
+        frame = ctx->store.value(index);
+    }
+    if (frame.isNull()) {
+        frame = replayFrame(ctx, index);
+    }
+    publishShared(ctx);
+    reportDecodeStats(ctx);
+    return frame;
+}
+
+// Canvas format; only until the first frame is composited
+static bool setImageFormat(ApngContext *ctx, QImage::Format format)
+{
+    if (format != QImage::Format_ARGB32
+        && format != QImage::Format_ARGB32_Premultiplied
+        && format != QImage::Format_Indexed8) {
+        return false;
+    }
+    const bool indexed = format == QImage::Format_Indexed8;
+    if (indexed ? ctx->wantIndexed
+                : !ctx->wantIndexed && format == ctx->format) {
+        return true;
+    }
+    // The row layout libpng was set up for stays
+    if (ctx->decodedFrames() > 0
+        || (ctx->started
+            && (indexed || ctx->format == QImage::Format_Indexed8))) {
+        return false;
+    }
+    ctx->wantIndexed = indexed;
+    ctx->format      = indexed ? QImage::Format_ARGB32 : format;
+    ctx->colorTable.clear();
+    if (!ctx->lastImage.isNull()) {
+        // still the fully transparent start canvas
+        ctx->lastImage = newCanvas(ctx, ctx->lastImage.size());
+    }
+    return resolveFormat(ctx);
+}
+
+static void applyCacheBudget(ApngContext *ctx)
+{
+    // Sequential devices can't seek back to replay anything, and patches
+    // can't be rebuilt without the frames before them
+    const bool canReplay = ctx->device && !ctx->device->isSequential()
+                           && ctx->storageMode == APNGHandler::FullFrames;
+    ctx->store.setBudget(canReplay ? ctx->cacheBudget : 0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// APNGHandler
+APNGHandler::APNGHandler()
+    : m_ctx(new ApngContext),
+      m_currentFrame(0),
+      m_incremental(-1),
+      m_quality(-1),
+      m_mergeUnchanged(false),
+      m_readFrame(-1),
+      m_mergedDelay(0),
+      m_peekedIndex(-1)
+{
+    m_ctx->cacheBudget = s_defaultCacheBudget;
+    m_ctx->storageMode = StorageMode(s_defaultStorageMode.load());
+    setDecodeThreads(s_defaultDecodeThreads);
+    m_prefetchFrames = s_defaultPrefetchFrames;
+    m_prefetchBytes  = s_defaultPrefetchBytes;
+
+    m_ctx->limits    = defaultDecodeLimits();
+
+    QMutexLocker lock(&s_decodeStatsMutex);
+    m_ctx->timing = s_defaultDecodeStats || bool(s_decodeStatsCallback);
+}
+
+APNGHandler::~APNGHandler()
+{
+    // The worker uses the context
+    m_prefetch.reset();
+    finishDecode(m_ctx.data());
+    unmapFile(m_ctx.data());
+}
+
+bool APNGHandler::canRead() const
+{
+    // Decode errors come out of read() then
+    if (m_prefetch) {
+        return true;
+    }
+    // Once decoding started the device position belongs to the decoder
+    if (m_ctx->started) {
+        if (m_ctx->hasError) {
+            return false;
+        }
+        // A stream that ran dry can go on once something arrived
+        if (m_ctx->starved && m_currentFrame >= m_ctx->decodedFrames()) {
+            return device() && device()->bytesAvailable() > 0;
+        }
+        return true;
+    }
+    return canRead(device());
+}
+
+bool APNGHandler::canRead(QIODevice *device)
+{
+    if (!device || !device->isReadable()) {
+        eprint;
+        return false;
+    }
+    // Plain PNGs decode as single frames
+    return sniffApng(device) != ApngSniff::NotPng;
+}
+
+bool APNGHandler::isApng(QIODevice *device)
+{
+    return device && device->isReadable()
+           && sniffApng(device) == ApngSniff::Apng;
+}
+
+bool APNGHandler::read(QImage *image)
+{
+    if (!ensureParsed()) {
+        if (!m_ctx->starved) {
+            eprint;
+        }
+        return false;
+    }
+    // A premultiplied target picks the premultiplied canvas, as long as
+    // nothing was composited yet
+    if (image && image->format() == QImage::Format_ARGB32_Premultiplied
+        && !m_prefetch) {
+        setImageFormat(m_ctx.data(), QImage::Format_ARGB32_Premultiplied);
+    }
+
+    if (!m_ctx->sharedTried) {
+        attachShared();
+    }
+    if (m_currentFrame < 0 || m_currentFrame >= imageCount()) {
+        m_currentFrame = 0;
+    }
+    startPrefetch();
+    QImage frame;
+    if (m_peekedIndex == m_currentFrame) {
+        frame = m_peeked;
+    }
+    m_peeked      = QImage();
+    m_peekedIndex = -1;
+    if (frame.isNull()) {
+        frame = takeFrame(m_currentFrame);
+    }
+    if (frame.isNull()) {
+        QMutexLocker lock(&m_ctx->mutex);
+        if (m_currentFrame >= m_ctx->imageCount() && !isStop(m_ctx->error)) {
+            // The header announced more frames than the stream has
+            m_currentFrame = 0;
+            frame          = frameAt(m_ctx.data(), m_currentFrame);
+        }
+    }
+    if (frame.isNull()) {
+        // Not an error while the rest of a stream is on its way
+        if (!m_ctx->starved) {
+            eprint;
+        }
+        return false;
+    }
+    *image = frame;
+    m_currentFrame++;
+    if (m_mergeUnchanged) {
+        skipUnchanged();
+    }
+    return true;
+}
+
+QImage APNGHandler::takeFrame(int index)
+{
+    QImage frame;
+    if (m_prefetch && m_prefetch->take(index, &frame)) {
+        return frame;
+    }
+    QMutexLocker lock(&m_ctx->mutex);
+    // Decodes only up to the frame we are about to return
+    return frameAt(m_ctx.data(), index);
+}
+
+void APNGHandler::skipUnchanged()
+{
+    m_readFrame   = m_currentFrame - 1;
+    m_mergedDelay = m_ctx->delayMs(m_readFrame);
+    // Whether a frame is unchanged is only known once it is decoded; one
+    // that isn't there yet is left for the next read()
+    while (m_currentFrame < imageCount()) {
+        const QImage next = takeFrame(m_currentFrame);
+        if (next.isNull()) {
+            break;
+        }
+        if (!m_ctx->isUnchanged(m_currentFrame)) {
+            m_peeked      = next;
+            m_peekedIndex = m_currentFrame;
+            break;
+        }
+        m_mergedDelay += m_ctx->delayMs(m_currentFrame);
+        m_currentFrame++;
+    }
+}
+
+static int writeThreads()
+{
+    const int threads = s_defaultWriteThreads;
+    return threads > 0 ? threads : QThread::idealThreadCount();
+}
+
+// zlib level for the Quality option, mapped like Qt's PNG writer
+static int compressionLevel(int quality)
+{
+    if (quality < 0) {
+        return Z_DEFAULT_COMPRESSION;
+    }
+    return (100 - qMin(quality, 100)) * 9 / 91;
+}
+
+bool APNGHandler::write(const QImage &image)
+{
+    QIODevice *dev = device();
+    if (!dev || !dev->isWritable() || image.isNull()) {
+        eprint;
+        return false;
+    }
+    // The frame count and the last fcTL are rewritten in place
+    if (dev->isSequential()) {
+        qWarning() << "write: sequential devices need writeAnimation()";
+        return false;
+    }
+    if (!m_writer || m_writer->device() != dev) {
+        m_writer.reset(new ApngWriter(dev, -1, -1, compressionLevel(m_quality),
+                                      writeThreads()));
+    }
+    bool ok         = false;
+    const int delay = image.text(QStringLiteral("Delay")).toInt(&ok);
+    return m_writer->addFrame(image, ok ? delay : 100);
+}
+
+bool APNGHandler::ensureParsed() const
+{
+    ApngContext *ctx = m_ctx.data();
+    if (ctx->scanned || ctx->hasHeader) {
+        return true;
+    }
+    // Chunk headers only, no libpng, when the device can seek. A device
+    // that is still being written to has to go through libpng.
+    const bool canScan = !ctx->started && !ctx->finished && !isIncremental();
+    if (canScan) {
+        mapFile(ctx, device());
+    }
+    const bool scanned
+        = canScan
+          && (ctx->map ? scanApng(reinterpret_cast<const uchar *>(ctx->map),
+                                  ctx->mapSize, &ctx->info)
+                       : scanApng(device(), &ctx->info));
+    if (scanned) {
+        const DecodeError error
+            = checkHeader(ctx, ctx->info.size, ctx->info.frames.size());
+        if (error != NoError) {
+            stopDecode(ctx, error);
+            ctx->finished = true;
+            return false;
+        }
+        ctx->scanned   = true;
+        ctx->loopCount = ctx->info.loopCount();
+        ctx->resizeUnchanged(ctx->info.frames.size());
+        resolveFormat(ctx);
+        return true;
+    }
+    return ensureDecoded(0);
+}
+
+bool APNGHandler::attachDevice() const
+{
+    ApngContext *ctx = m_ctx.data();
+    if (ctx->device || ctx->finished) {
+        return !ctx->hasError || ctx->decodedFrames() > 0;
+    }
+    // Check PNG signature
+    const bool incremental = isIncremental();
+    if (!canRead(device())) {
+        if (incremental && device() && device()->isOpen()
+            && device()->bytesAvailable() < 8) {
+            // not here yet
+            ctx->starved = true;
+            return false;
+        }
+        qWarning() << "no read";
+        ctx->error    = APNGHandler::InvalidData;
+        ctx->hasError = true;
+        ctx->finished = true;
+        return false;
+    }
+    // canRead() leaves the position alone; decoding starts at the top
+    if (!device()->isSequential()) {
+        device()->seek(0);
+    }
+    ctx->device      = device();
+    ctx->incremental = incremental;
+    // A mapping would only ever see what was there when it was made
+    if (!incremental) {
+        mapFile(ctx, ctx->device);
+    }
+    ctx->parallel = canDecodeParallel(ctx);
+    applyCacheBudget(ctx);
+    return true;
+}
+
+bool APNGHandler::ensureDecoded(int frameCount) const
+{
+    ApngContext *ctx = m_ctx.data();
+    if (!attachDevice()) {
+        return false;
+    }
+    decodeFrames(ctx, frameCount);
+    // A broken tail still leaves the frames before it usable
+    return ctx->hasHeader && (!ctx->hasError || ctx->decodedFrames() > 0);
+}
+
+int APNGHandler::currentImageNumber() const
+{
+    if (!ensureParsed()) {
+        return 0;
+    }
+    return m_currentFrame;
+}
+
+int APNGHandler::imageCount() const
+{
+    if (!ensureParsed()) {
+        eprint;
+        return 0;
+    }
+    if (m_prefetch) {
+        return m_ctx->info.frames.size();
+    }
+    return m_ctx->imageCount();
+}
+
+bool APNGHandler::jumpToNextImage()
+{
+    if (!ensureParsed()) {
+        return false;
+    }
+    m_readFrame = -1;
+    if (++m_currentFrame < imageCount()) {
+        return true;
+    }
+    return false;
+}
+
+bool APNGHandler::jumpToImage(int imageNumber)
+{
+    if (!ensureParsed() || imageNumber < 0) {
+        eprint;
+        return false;
+    }
+    m_currentFrame = imageNumber;
+    m_readFrame    = -1;
+    return imageNumber < imageCount();
+}
+
+int APNGHandler::nextImageDelay() const
+{
+    if (!ensureParsed()) {
+        eprint;
+        return 0;
+    }
+    if (m_readFrame >= 0) {
+        return m_mergedDelay;
+    }
+    // The frame read last; the last one too, until read() wraps around
+    int index = m_currentFrame - 1;
+    if (m_currentFrame <= 0 || m_currentFrame > imageCount()) {
+        index = 0;
+    }
+    // Without scanned metadata the delay comes with the frame itself
+    if (!m_ctx->scanned && index >= m_ctx->delays.size()) {
+        ensureDecoded(index + 1);
+    }
+    return m_ctx->delayMs(index);
+}
+
+QRect APNGHandler::currentImageRect() const
+{
+    return frameDirtyRect(m_readFrame >= 0 ? m_readFrame
+                                           : m_currentFrame - 1);
+}
+
+QRect APNGHandler::frameDirtyRect(int index) const
+{
+    if (!ensureParsed()) {
+        eprint;
+        return QRect();
+    }
+    if (index < 0 || index >= imageCount()) {
+        index = 0;
+    }
+    // Without scanned metadata the rectangles come with the frames
+    if (!m_ctx->scanned && index >= m_ctx->decodedFrames()) {
+        ensureDecoded(index + 1);
+    }
+    return outputRect(m_ctx.data(), m_ctx->dirtyRect(index));
+}
+
+int APNGHandler::loopCount() const
+{
+    if (!ensureParsed()) {
+        eprint;
+        return 0;
+    }
+    return m_ctx->loopCount;
+}
+
+void APNGHandler::setDefaultCacheBudget(qint64 bytes)
+{
+    s_defaultCacheBudget = bytes;
+}
+
+void APNGHandler::setCacheBudget(qint64 bytes)
+{
+    QMutexLocker lock(&m_ctx->mutex);
+    m_ctx->cacheBudget = bytes;
+    if (m_ctx->device) {
+        applyCacheBudget(m_ctx.data());
+    }
+}
+
+void APNGHandler::setCheckpointInterval(int frames)
+{
+    QMutexLocker lock(&m_ctx->mutex);
+    m_ctx->checkpointInterval = qMax(1, frames);
+}
+
+void APNGHandler::setDefaultStorageMode(StorageMode mode)
+{
+    s_defaultStorageMode = mode;
+}
+
+void APNGHandler::setStorageMode(StorageMode mode)
+{
+    QMutexLocker lock(&m_ctx->mutex);
+    if (m_ctx->decodedFrames() > 0) {
+        qWarning() << "setStorageMode: frames were already decoded";
+        return;
+    }
+    m_ctx->storageMode = mode;
+    if (m_ctx->device) {
+        applyCacheBudget(m_ctx.data());
+    }
+}
+
+void APNGHandler::setMergeUnchangedFrames(bool merge)
+{
+    m_mergeUnchanged = merge;
+    if (!merge) {
+        m_readFrame = -1;
+    }
+}
+
+void APNGHandler::setDefaultDecodeThreads(int threads)
+{
+    s_defaultDecodeThreads = threads;
+}
+
+void APNGHandler::setDefaultWriteThreads(int threads)
+{
+    s_defaultWriteThreads = threads;
+}
+
+void APNGHandler::setDecodeThreads(int threads)
+{
+    QMutexLocker lock(&m_ctx->mutex);
+    m_ctx->decodeThreads = threads > 0 ? threads : QThread::idealThreadCount();
+}
+
+APNGHandler::CacheStats APNGHandler::cacheStats() const
+{
+    QMutexLocker lock(&m_ctx->mutex);
+    return m_ctx->store.stats();
+}
+
+APNGHandler::ReadStats APNGHandler::readStats() const
+{
+    QMutexLocker lock(&m_ctx->mutex);
+    ReadStats stats = m_ctx->readStats;
+    stats.mapped    = m_ctx->map != nullptr;
+    return stats;
+}
+
+void APNGHandler::setDefaultPrefetch(int frames, qint64 bytes)
+{
+    s_defaultPrefetchFrames = frames;
+    s_defaultPrefetchBytes  = bytes;
+}
+
+void APNGHandler::setPrefetch(int frames, qint64 bytes)
+{
+    if (m_prefetch) {
+        qWarning() << "setPrefetch: prefetching already started";
+        return;
+    }
+    m_prefetchFrames = frames;
+    m_prefetchBytes  = bytes;
+}
+
+APNGHandler::PrefetchStats APNGHandler::prefetchStats() const
+{
+    return m_prefetch ? m_prefetch->stats() : PrefetchStats();
+}
+
+void APNGHandler::attachShared()
+{
+    ApngContext *ctx = m_ctx.data();
+    ctx->sharedTried = true;
+
+    // Partial data would not identify the animation
+    ApngAnimationCache *cache = ApngAnimationCache::instance();
+    if (!cache->isEnabled() || ctx->decodedFrames() > 0 || isIncremental()) {
+        return;
+    }
+    const QByteArray key = ApngAnimationCache::key(
+        device(), ctx->format, ctx->clipRect, ctx->scaledSize);
+    if (key.isEmpty()) {
+        return;
+    }
+    ctx->shared = cache->find(key);
+    if (ctx->shared) {
+        finishDecode(ctx);
+        ctx->loopCount = ctx->shared->loopCount;
+    }
+    else {
+        ctx->sharedKey = key;
+    }
+}
+
+void APNGHandler::setDefaultDecodeStatsEnabled(bool enabled)
+{
+    s_defaultDecodeStats = enabled;
+}
+
+void APNGHandler::setDecodeStatsEnabled(bool enabled)
+{
+    QMutexLocker lock(&m_ctx->mutex);
+    m_ctx->timing = enabled;
+}
+
+APNGHandler::DecodeStats APNGHandler::decodeStats() const
+{
+    QMutexLocker lock(&m_ctx->mutex);
+    if (!m_ctx->timing) {
+        return DecodeStats();
+    }
+    DecodeStats stats    = m_ctx->decodeStats;
+    stats.peakFrameBytes = m_ctx->store.stats().peakBytes;
+    return stats;
+}
+
+void APNGHandler::setDecodeStatsCallback(const DecodeStatsCallback &callback)
+{
+    QMutexLocker lock(&s_decodeStatsMutex);
+    s_decodeStatsCallback = callback;
+}
+
+void APNGHandler::setDefaultDecodeLimits(const DecodeLimits &limits)
+{
+    QMutexLocker lock(&s_defaultLimitsMutex);
+    s_defaultLimits = limits;
+}
+
+void APNGHandler::setDecodeLimits(const DecodeLimits &limits)
+{
+    QMutexLocker lock(&m_ctx->mutex);
+    m_ctx->limits = limits;
+}
+
+void APNGHandler::cancel()
+{
+    m_ctx->cancelled = true;
+}
+
+APNGHandler::DecodeError APNGHandler::decodeError() const
+{
+    QMutexLocker lock(&m_ctx->mutex);
+    return m_ctx->error;
+}
+
+void APNGHandler::setSharedCacheBudget(qint64 bytes)
+{
+    ApngAnimationCache::instance()->setBudget(bytes);
+}
+
+APNGHandler::SharedCacheStats APNGHandler::sharedCacheStats()
+{
+    return ApngAnimationCache::instance()->stats();
+}
+
+void APNGHandler::setDiskCacheDirectory(const QString &path)
+{
+    ApngAnimationCache::instance()->setDirectory(path);
+}
+
+void APNGHandler::waitForDiskCache()
+{
+    ApngAnimationCache::instance()->waitForDiskWrites();
+}
+
+void APNGHandler::clearSharedCache()
+{
+    ApngAnimationCache::instance()->clear();
+}
+
+void APNGHandler::setBufferPoolBudget(qint64 bytes)
+{
+    ApngBufferPool::instance()->setBudget(bytes);
+}
+
+APNGHandler::BufferPoolStats APNGHandler::bufferPoolStats()
+{
+    return ApngBufferPool::instance()->stats();
+}
+
+bool APNGHandler::isIncremental() const
+{
+    if (m_incremental >= 0) {
+        return m_incremental;
+    }
+    return device() && device()->isSequential();
+}
+
+void APNGHandler::startPrefetch()
+{
+    ApngContext *ctx = m_ctx.data();
+    // Needs the scanned metadata, see ApngPrefetcher
+    if (m_prefetch || ctx->shared || m_prefetchFrames <= 0 || !ctx->scanned
+        || ctx->info.frames.size() < 2) {
+        return;
+    }
+    if (!attachDevice()) {
+        return;
+    }
+
+    int capacity = qMin(m_prefetchFrames, int(ctx->info.frames.size()));
+    const int pixelBytes = ctx->format == QImage::Format_Indexed8 ? 1 : 4;
+    const qint64 frameBytes
+        = qint64(ctx->info.size.width()) * ctx->info.size.height()
+          * pixelBytes;
+    if (m_prefetchBytes > 0 && frameBytes > 0) {
+        capacity = int(qMin<qint64>(capacity, m_prefetchBytes / frameBytes));
+    }
+    // Not even one frame fits the cap
+    if (capacity < 1) {
+        return;
+    }
+    m_prefetch.reset(new ApngPrefetcher(ctx, capacity));
+    m_prefetch->start();
+}
+
+bool APNGHandler::supportsOption(ImageOption option) const
+{
+    switch (option) {
+    case Animation:
+    case Size:
+    case ImageFormat:
+    case ScaledSize:
+    case ClipRect:
+    case IncrementalReading:
+    case Quality:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void APNGHandler::setOption(ImageOption option, const QVariant &value)
+{
+    QMutexLocker lock(&m_ctx->mutex);
+    ApngContext *ctx = m_ctx.data();
+    switch (option) {
+    case ImageFormat:
+        if (!setImageFormat(ctx, QImage::Format(value.toInt()))) {
+            qWarning() << "setOption: unsupported or late image format"
+                       << value;
+        }
+        break;
+    case ScaledSize:
+        if (!setOutputTransform(ctx, ctx->clipRect, value.toSize())) {
+            qWarning() << "setOption: empty or late scaled size" << value;
+        }
+        break;
+    case ClipRect:
+        if (!setOutputTransform(ctx, value.toRect(), ctx->scaledSize)) {
+            qWarning() << "setOption: empty or late clip rect" << value;
+        }
+        break;
+    case IncrementalReading:
+        if (ctx->device || ctx->scanned) {
+            qWarning() << "setOption: incremental reading set too late";
+            break;
+        }
+        m_incremental = value.toBool() ? 1 : 0;
+        break;
+    case Quality:
+        m_quality = value.toInt();
+        break;
+    default:
+        break;
+    }
+}
+
+QVariant APNGHandler::option(ImageOption option) const
+{
+    // Writers have nothing to parse
+    if (option == Quality) {
+        return m_quality;
+    }
+    if (!ensureParsed()) {
+        return QVariant();
+    }
+
+    switch (option) {
+    case Animation: {
+        return imageCount() > 0;
+    }
+    case Size:
+        if (m_ctx->canvasSize().isValid()) {
+            return m_ctx->canvasSize();
+        }
+        return QVariant();
+    case ImageFormat:
+        return int(m_ctx->format);
+    case ScaledSize:
+        return m_ctx->scaledSize;
+    case ClipRect:
+        return m_ctx->clipRect;
+    case IncrementalReading:
+        return isIncremental();
+    default:
+        break;
+    }
+
+    return QVariant();
+}
+
+bool APNGHandler::ensureParsed(QIODevice *device,
+                               int &loopCount,
+                               QVector<QImage> &frames,
+                               QVector<int> &delays)
+{
+    return ensureParsed(device, loopCount, frames, delays,
+                        defaultDecodeLimits());
+}
+
+bool APNGHandler::ensureParsed(QIODevice *device,
+                               int &loopCount,
+                               QVector<QImage> &frames,
+                               QVector<int> &delays,
+                               const DecodeLimits &limits,
+                               DecodeError *error)
+{
+    if (error) {
+        *error = InvalidData;
+    }
+    // Check PNG signature
+    if (!canRead(device)) {
+        qWarning() << "no read";
+        return false;
+    }
+    if (!device->isSequential()) {
+        device->seek(0);
+    }
+    // Create a local context and decode everything in one go
+    ApngContext ctx;
+    ctx.device = device;
+    ctx.limits = limits;
+    mapFile(&ctx, device);
+    ctx.scanned = ctx.map ? scanApng(reinterpret_cast<const uchar *>(ctx.map),
+                                     ctx.mapSize, &ctx.info)
+                          : scanApng(device, &ctx.info);
+    // Nothing is decoded for files beyond the size or frame limit
+    const DecodeError header
+        = ctx.scanned
+              ? checkHeader(&ctx, ctx.info.size, ctx.info.frames.size())
+              : NoError;
+    if (header != NoError) {
+        stopDecode(&ctx, header);
+        unmapFile(&ctx);
+        if (error) {
+            *error = header;
+        }
+        return false;
+    }
+    // Parallel decoding, with the default thread count
+    ctx.decodeThreads = s_defaultDecodeThreads > 0
+                            ? s_defaultDecodeThreads.load()
+                            : QThread::idealThreadCount();
+
+    ctx.parallel = canDecodeParallel(&ctx);
+    decodeFrames(&ctx, INT_MAX);
+    finishDecode(&ctx);
+    unmapFile(&ctx);
+    if (error) {
+        *error = ctx.decodedFrames() > 0 || ctx.error != NoError ? ctx.error
+                                                                  : InvalidData;
+    }
+
+    // If we got at least one frame, parse was successful unless a limit
+    // stopped it; the budget is unlimited here, so the store holds every
+    // frame
+    if (ctx.decodedFrames() > 0 && !isStop(ctx.error)) {
+        frames.clear();
+        for (int i = 0; i < ctx.decodedFrames(); i++) {
+            frames.push_back(ctx.store.value(i));
+        }
+        loopCount = ctx.loopCount;
+        delays    = ctx.delays;
+        return true;
+    }
+    return false;
+}
+
+QVector<APNGHandler::FirstFrame>
+APNGHandler::firstFrames(const QVector<QIODevice *> &devices,
+                         int threads,
+                         BatchStats *stats)
+{
+    return apngFirstFrames(devices, defaultDecodeLimits(), threads, stats);
+}
+
+QVector<APNGHandler::FirstFrame>
+APNGHandler::firstFrames(const QStringList &paths,
+                         int threads,
+                         BatchStats *stats)
+{
+    return apngFirstFrames(paths, defaultDecodeLimits(), threads, stats);
+}
+
+bool APNGHandler::writeAnimation(QIODevice *device,
+                                 const QVector<QImage> &frames,
+                                 const QVector<int> &delays,
+                                 int loopCount,
+                                 int quality)
+{
+    if (!device || !device->isWritable() || frames.isEmpty()) {
+        eprint;
+        return false;
+    }
+    ApngWriter writer(device, frames.size(), loopCount,
+                      compressionLevel(quality), writeThreads());
+    for (int i = 0; i < frames.size(); i++) {
+        if (!writer.addFrame(frames.at(i), delays.value(i, 100))) {
+            return false;
+        }
     }
-    return done;  // or false if no frames
+    return writer.finish();
 }
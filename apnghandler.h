@@ -2,23 +2,218 @@
 
 #include <QImage>
 #include <QImageIOHandler>
+#include <QScopedPointer>
+#include <QStringList>
 #include <QVariant>
 
+#include <atomic>
+#include <functional>
+
+class ApngPrefetcher;
+class ApngWriter;
+struct ApngContext;
+
 class APNGHandler : public QImageIOHandler {
 public:
+    enum StorageMode {
+        FullFrames,   // the whole canvas of every frame
+        DeltaFrames,  // full frames at checkpoints, changed areas otherwise
+    };
+
+    struct CacheStats {
+        quint64 hits           = 0;  // frames served from the cache
+        quint64 misses         = 0;  // frames that had to be decoded
+        quint64 evictions      = 0;  // frames and checkpoints dropped
+        quint64 replayedFrames = 0;  // frames decoded again after eviction
+        int cachedFrames       = 0;
+        int patches            = 0;  // cached frames kept as deltas
+        int sharedFrames       = 0;  // cached frames sharing the pixels
+                                     // of the frame before or after
+        int checkpoints        = 0;
+        qint64 bytes           = 0;
+        qint64 peakBytes       = 0;
+    };
+
+    // Input side of the decoder
+    struct ReadStats {
+        quint64 reads       = 0;      // device reads
+        quint64 allocations = 0;      // input buffer (re)allocations
+        qint64 bytesFed     = 0;      // bytes libpng consumed
+        int bufferSize      = 0;      // input buffer capacity
+        bool mapped         = false;  // QFile read through QFile::map()
+    };
+
+    // Where the time of one decode went, see setDecodeStatsEnabled().
+    // Replays after eviction count too.
+    struct DecodeStats {
+        qint64 bytesRead      = 0;  // from the device or the mapping
+        int frames            = 0;  // composited
+        qint64 peakFrameBytes = 0;  // frame store peak
+        qint64 ioNs           = 0;  // device reads, replay chunk copies
+        qint64 inflateNs      = 0;  // libpng: inflate, unfilter, transforms;
+                                    // summed over threads when parallel
+        qint64 rowNs          = 0;  // combining rows (rowCallback)
+        qint64 compositeNs    = 0;
+        qint64 disposeNs      = 0;
+        qint64 copyNs         = 0;  // frame copies, scaling, checkpoints
+    };
+    // Called on the decoding thread once a handler has decoded the last
+    // frame, while the handler is busy; it must not call into it
+    using DecodeStatsCallback
+        = std::function<void(QIODevice *device, const DecodeStats &stats)>;
+
+    // Guards against hostile or oversized files, see setDecodeLimits().
+    // 0 means no limit.
+    struct DecodeLimits {
+        qint64 maxPixels = 0;  // canvas width * height
+        int maxFrames    = 0;  // displayed frames, announced or decoded
+        qint64 maxBytes  = 0;  // all displayed frames at output size
+        int timeoutMs    = 0;  // per decoding call, e.g. read()
+        // Stops the decode once set, from any thread; must outlive it
+        const std::atomic<bool> *cancel = nullptr;
+    };
+    // Why decoding stopped early
+    enum DecodeError {
+        NoError,
+        InvalidData,  // not a PNG, or libpng rejected the data
+        PixelLimit,   // the DecodeLimits fields
+        FrameLimit,
+        ByteLimit,
+        Timeout,
+        Cancelled,    // DecodeLimits::cancel or cancel()
+        OutOfMemory,  // a frame buffer could not be allocated
+    };
+
+    // One file of firstFrames()
+    struct FirstFrame {
+        QImage image;  // null if it failed
+        DecodeError error = NoError;
+    };
+    // Throughput of a firstFrames() batch
+    struct BatchStats {
+        int files              = 0;
+        int failures           = 0;  // files without an image
+        int threads            = 0;  // workers used
+        qint64 bytesRead       = 0;  // fed to libpng, over all files
+        qint64 elapsedNs       = 0;  // wall clock of the whole batch
+        double filesPerSecond  = 0;
+        double megabytesPerSec = 0;  // of `bytesRead`
+    };
+
+    // Process-wide, see setSharedCacheBudget()
+    struct SharedCacheStats {
+        quint64 hits       = 0;  // readers that got a decoded animation
+        quint64 misses     = 0;  // readers that decoded on their own
+        quint64 insertions = 0;
+        quint64 evictions  = 0;
+        quint64 diskHits   = 0;  // hits mapped from the disk cache
+        quint64 diskWrites = 0;
+        int entries        = 0;
+        qint64 bytes       = 0;
+        qint64 budget      = 0;
+    };
+
+    // Process-wide, see setBufferPoolBudget()
+    struct BufferPoolStats {
+        quint64 allocations = 0;  // buffers that came from the heap
+        quint64 reuses      = 0;  // buffers handed out again
+        int idleBuffers     = 0;
+        qint64 idleBytes    = 0;
+        qint64 budget       = 0;
+    };
+
+    struct PrefetchStats {
+        quint64 hits      = 0;  // read() found its frame ready
+        quint64 underruns = 0;  // read() had to wait for the worker
+        qint64 waitUs     = 0;  // total time read() spent waiting
+        int capacity      = 0;  // frames the ring holds
+    };
+
+    // PNG or APNG, judged by the signature and the chunk headers before
+    // the first IDAT, read from the start of random-access devices;
+    // nothing is consumed and the position is kept
     static bool canRead(QIODevice *device);
+    // Only APNGs, i.e. an acTL before the first IDAT. Cheap enough for
+    // format autodetection, and leaves plain PNGs to Qt's own reader.
+    static bool isApng(QIODevice *device);
     static bool ensureParsed(QIODevice *device,
                              int &loopCount,
                              QVector<QImage> &frames,
                              QVector<int> &delays);
+    // Same with `limits` instead of the default ones. Running into one, or
+    // being cancelled, fails even if some frames were decoded; `error`
+    // tells why.
+    static bool ensureParsed(QIODevice *device,
+                             int &loopCount,
+                             QVector<QImage> &frames,
+                             QVector<int> &delays,
+                             const DecodeLimits &limits,
+                             DecodeError *error = nullptr);
+    // The first displayed frame of each file (the default image is skipped
+    // if it isn't part of the animation), for thumbnails. Decoding stops
+    // right after that frame, so only the data up to it is read. Files are
+    // decoded in parallel, one per worker of a pool of `threads` threads
+    // (<= 0: QThread::idealThreadCount()), each on a single thread, under
+    // the default decode limits; the timeout applies to every file on its
+    // own. Results are in the order of the input. Devices must be open
+    // and not used elsewhere until it returns; paths are opened by the
+    // workers.
+    static QVector<FirstFrame> firstFrames(const QVector<QIODevice *> &devices,
+                                           int threads = 0,
+                                           BatchStats *stats = nullptr);
+    static QVector<FirstFrame> firstFrames(const QStringList &paths,
+                                           int threads = 0,
+                                           BatchStats *stats = nullptr);
+    // The reverse of ensureParsed(): `frames` (all the size of the first,
+    // any format) with `delays` in ms as an RGBA APNG, `loopCount` as
+    // QMovie counts. Each frame is stored as the rectangle that differs
+    // from the canvas before it, with the dispose and blend ops that make
+    // it cheapest. Frames are compressed several at a time, each in
+    // stripes, see setDefaultWriteThreads(). `quality` as the Quality
+    // option. Works on sequential devices too.
+    static bool writeAnimation(QIODevice *device,
+                               const QVector<QImage> &frames,
+                               const QVector<int> &delays,
+                               int loopCount = -1,
+                               int quality = -1);
 
     APNGHandler();
-    ~APNGHandler() override = default;
+    ~APNGHandler() override;
 
     bool canRead() const override;
     bool read(QImage *image) override;
+    // Appends `image` as the next frame, see writeAnimation(). Its delay is
+    // the "Delay" text of the image in ms, 100 without one; the animation
+    // loops forever. The device must be random access: the file on it is
+    // complete after every write(), the next one rewrites the frame count
+    // and the previous frame's fcTL.
+    bool write(const QImage &image) override;
 
+    // ImageFormat: Format_ARGB32 (default) or Format_ARGB32_Premultiplied.
+    // Premultiplied canvases are composited with a cheaper blend and can
+    // be painted without a conversion. Can only be changed before the first
+    // frame is read; passing a premultiplied image to read() selects it too.
+    // Format_Indexed8 keeps palette animations as indices into the file's
+    // color table, a quarter of the memory, wherever compositing on them
+    // is exact: seekable files without ClipRect or ScaledSize whose OVER
+    // frames only meet opaque or fully transparent entries. Everything else
+    // decodes to Format_ARGB32; option(ImageFormat) tells which it is once
+    // the header is known. Indexed frames stay out of the disk cache.
+    // ClipRect and ScaledSize are applied while frames are stored: the
+    // clip first, then a box filter down (or up) to the scaled size, redone
+    // only where a frame changed. Cached frames take the output size, and
+    // frameDirtyRect() is in output coordinates. Both can only be changed
+    // before the first frame is read; Size stays the canvas size.
+    // Quality (writing): 0 to 100 as for Qt's PNG writer, higher compresses
+    // less and faster; -1 (the default) is zlib's default level.
+    // IncrementalReading (on by default for sequential devices): running
+    // out of data is not the end of the animation. read() returns false
+    // until the next frame's data has arrived and continues where it left
+    // off; canRead() tells whether anything new is there. The stream ends
+    // with IEND or when the device is closed. Set it for random-access
+    // devices that are still being written, e.g. a growing download file.
     bool supportsOption(ImageOption option) const override;
+    void setOption(ImageOption option, const QVariant &value) override;
     QVariant option(ImageOption option) const override;
 
     int currentImageNumber() const override;
@@ -27,14 +222,149 @@ public:
     bool jumpToImage(int imageNumber) override;
     int nextImageDelay() const override;
     int loopCount() const override;
+    // Dirty rectangle of the frame returned by the last read()
+    QRect currentImageRect() const override;
+
+    // Part of the canvas that changed between frame `index - 1` and frame
+    // `index`: the fcTL region of `index` plus the region the previous
+    // frame's dispose op cleared or restored. Frame 0, which follows the
+    // last one when looping, is the whole canvas. Only this area needs
+    // to be uploaded and repainted. Once decoded, a frame identical to the
+    // one before it has an empty rectangle.
+    QRect frameDirtyRect(int index) const;
+
+    // Unchanged frames always share the pixels of the frame before them.
+    // With merging on, read() also skips them and nextImageDelay() adds
+    // their delays to the frame it returned, so playback wakes up less
+    // often. currentImageNumber() then jumps over them, while imageCount()
+    // and jumpToImage() keep counting every fcTL frame. Off by default.
+    void setMergeUnchangedFrames(bool merge);
+
+    // Composited frames beyond `bytes` are evicted and rebuilt on demand by
+    // replaying from the nearest checkpoint. <= 0 means unlimited.
+    // Sequential devices can't be replayed and always keep every frame.
+    static void setDefaultCacheBudget(qint64 bytes);
+    void setCacheBudget(qint64 bytes);
+    // Save a checkpoint every `frames` frames, 16 by default
+    void setCheckpointInterval(int frames);
+    CacheStats cacheStats() const;
+    ReadStats readStats() const;
+
+    // DeltaFrames keeps a full frame every checkpoint interval and only the
+    // dirty rectangle (see frameDirtyRect()) of the frames in between; a
+    // frame is rebuilt from those when it is read. Nothing is evicted, so
+    // the cache budget does not apply. Can only be changed before the
+    // first frame is read.
+    static void setDefaultStorageMode(StorageMode mode);
+    void setStorageMode(StorageMode mode);
+
+    // Seekable, complete files are decoded with up to 2 * `threads` frames
+    // inflating on QThreadPool::globalInstance() while frames are
+    // composited in order on the calling thread. 1 keeps all work on the
+    // calling thread, <= 0 means QThread::idealThreadCount() (the
+    // default). Takes effect when decoding starts.
+    static void setDefaultDecodeThreads(int threads);
+    void setDecodeThreads(int threads);
+    // Threads compressing for writeAnimation() and write(), independent of
+    // the decode threads: 1 keeps it on the calling thread, <= 0 (the
+    // default) means QThread::idealThreadCount(). Takes effect for the
+    // next writeAnimation(), or the next device write() starts on.
+    static void setDefaultWriteThreads(int threads);
+
+    // Decode up to `frames` frames ahead of read() on a worker thread, so
+    // read() only hands over a finished frame. `bytes` > 0 additionally
+    // caps the ring at that many bytes of canvas; less than one canvas
+    // turns prefetching off. 0 frames (the default) decodes on the
+    // calling thread. Only seekable files are prefetched;
+    // the ring starts with the first read() and then wraps around like
+    // playback does. A jump restarts it at the new frame.
+    static void setDefaultPrefetch(int frames, qint64 bytes = 0);
+    void setPrefetch(int frames, qint64 bytes = 0);
+    PrefetchStats prefetchStats() const;
+
+    // Canvas size and frame count are checked against the limits before
+    // anything is allocated, with the chunk scan or the header; frames,
+    // bytes, time and cancellation before every frame and every few rows.
+    // A decode that runs into one stops through libpng's error path,
+    // frees what it had in progress and keeps failing from then on, with
+    // decodeError() telling why; frames decoded before it stay readable.
+    // The defaults apply to handlers created afterwards and to the static
+    // ensureParsed(); none are set initially.
+    static void setDefaultDecodeLimits(const DecodeLimits &limits);
+    void setDecodeLimits(const DecodeLimits &limits);
+    // Stops a decode running on another thread, or the next one; safe to
+    // call from any thread, the handler stays cancelled
+    void cancel();
+    DecodeError decodeError() const;
+
+    // Off by default. When on, each stage reads a monotonic clock twice,
+    // which is cheap next to the work it measures. A callback turns it on
+    // for handlers created after it is set. decodeStats() is all zero
+    // while off.
+    static void setDefaultDecodeStatsEnabled(bool enabled);
+    void setDecodeStatsEnabled(bool enabled);
+    DecodeStats decodeStats() const;
+    static void setDecodeStatsCallback(const DecodeStatsCallback &callback);
+
+    // Completely decoded animations are kept process-wide, so every later
+    // reader of the same file (path, size and mtime; a content hash for
+    // other seekable devices) and the same output options shares those
+    // frames instead of decoding them again. Least recently used ones go
+    // beyond `bytes`, 32 MiB by default; <= 0 disables the cache.
+    // Looked up on the first read(); sequential devices don't take part,
+    // neither do DeltaFrames handlers or budget-evicted frames when
+    // publishing.
+    static void setSharedCacheBudget(qint64 bytes);
+    // Also keep them as files in `path`, mapped instead of decoded by
+    // later processes. Each holds the raw frames with delays, dirty
+    // rectangles and loop count under a versioned, CRC-checked header;
+    // each frame is CRC-checked the first time it is read. Damaged or
+    // outdated files are decoded again and rewritten. Empty
+    // (the default) disables it. Works with a shared cache budget of 0.
+    // Files are written on QThreadPool::globalInstance(), after the read()
+    // that finished the decode has returned.
+    static void setDiskCacheDirectory(const QString &path);
+    // Blocks until the animations decoded so far are in the directory
+    static void waitForDiskCache();
+    static SharedCacheStats sharedCacheStats();
+    static void clearSharedCache();
+
+    // Canvases, frame rows and stored frames come from a process-wide pool
+    // of buffers that go back to it when their last image is gone, so
+    // frames, replays and later decodes of similar sizes reuse them. Up to
+    // `bytes` of idle buffers are kept, 64 MiB by default; <= 0 frees
+    // every buffer once it is released.
+    static void setBufferPoolBudget(qint64 bytes);
+    static BufferPoolStats bufferPoolStats();
 
 private:
+    // header only: size, frame count and loop count
     bool ensureParsed() const;
+    // header plus the first `frameCount` frames
+    bool ensureDecoded(int frameCount) const;
+    // Hand the device to the decoder without decoding anything
+    bool attachDevice() const;
+    void startPrefetch();
+    // Look the device up in ApngAnimationCache
+    void attachShared();
+    bool isIncremental() const;
+    // Frame `index` from the prefetch ring, or decoded here
+    QImage takeFrame(int index);
+    // Merged playback: skip what follows the frame read() returns
+    void skipUnchanged();
 
 private:
-    bool m_parsed;
-    QVector<QImage> m_frames;
-    QVector<int> m_delays;
-    int m_loopCount;
+    QScopedPointer<ApngContext> m_ctx;
+    QScopedPointer<ApngPrefetcher> m_prefetch;
+    QScopedPointer<ApngWriter> m_writer;
     int m_currentFrame;
+    int m_incremental;  // IncrementalReading, -1: sequential devices
+    int m_quality;      // Quality, for write()
+    int m_prefetchFrames;
+    qint64 m_prefetchBytes;
+    bool m_mergeUnchanged;
+    int m_readFrame;    // returned by the last merged read(), -1 otherwise
+    int m_mergedDelay;  // of m_readFrame and the frames skipped after it
+    QImage m_peeked;    // looked at by skipUnchanged(), read() returns it
+    int m_peekedIndex;
 };
@@ -0,0 +1,182 @@
+#include "apngparallel.h"
+
+#include <QDebug>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QWaitCondition>
+
+#include "apngcontext.h"
+
+// One frame's patch, inflated and unfiltered on a pool thread
+struct PatchJob : public QRunnable {
+    QByteArray png;  // buildPatch() output
+    FrameBuf f;
+
+    QMutex *mutex        = nullptr;
+    QWaitCondition *done = nullptr;
+    bool finished        = false;  // guarded by `mutex`
+    bool ok              = false;
+    bool timing          = false;
+    bool indexed         = false;
+    qint64 inflateNs     = 0;
+
+    void run() override
+    {
+        qint64 ns = 0;
+        bool result;
+        {
+            StageTimer timer(timing, &ns);
+            result = decodePng(png, f, indexed);
+        }
+        QMutexLocker lock(mutex);
+        ok        = result;
+        inflateNs = ns;
+        finished  = true;
+        done->wakeAll();
+    }
+};
+
+bool canDecodeParallel(const ApngContext *ctx)
+{
+    if (ctx->decodeThreads <= 1 || !ctx->scanned || !ctx->info.complete
+        || ctx->info.ihdr.size() != 13 || ctx->info.frames.isEmpty()) {
+        return false;
+    }
+    for (const ApngFrameInfo &fi : ctx->info.frames) {
+        if (fi.spans.isEmpty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Displayed frame `index` as frameEndCallback() would see it
+static FrameRecord recordFromInfo(const ApngContext *ctx, int index)
+{
+    const ApngFrameInfo &fi = ctx->info.frames.at(index);
+    FrameRecord r;
+    r.x          = fi.x;
+    r.y          = fi.y;
+    r.width      = fi.width;
+    r.height     = fi.height;
+    r.dispose_op = fi.disposeOp;
+    r.blend_op   = fi.blendOp;
+    r.spans      = fi.spans;
+    if (index == 0) {
+        // Same first frame fixups as the progressive reader
+        r.blend_op = PNG_BLEND_OP_SOURCE;
+        if (r.dispose_op == PNG_DISPOSE_OP_PREVIOUS) {
+            r.dispose_op = PNG_DISPOSE_OP_BACKGROUND;
+        }
+    }
+    return r;
+}
+
+static PatchJob *startJob(ApngContext *ctx, int index, QMutex *mutex,
+                          QWaitCondition *done)
+{
+    const FrameRecord r = recordFromInfo(ctx, index);
+    auto job            = new PatchJob;
+    job->setAutoDelete(false);
+    job->mutex   = mutex;
+    job->done    = done;
+    job->timing  = ctx->timing;
+    job->indexed = ctx->format == QImage::Format_Indexed8;
+    frameFromRecord(job->f, r);
+    job->f.delay_num = ctx->info.frames.at(index).delayNum;
+    job->f.delay_den = ctx->info.frames.at(index).delayDen;
+
+    // File access stays on this thread
+    bool built;
+    {
+        StageTimer timer(ctx->timing, &ctx->decodeStats.ioNs);
+        built = buildPatch(ctx, r, job->png);
+    }
+    if (built) {
+        QThreadPool::globalInstance()->start(job);
+    }
+    else {
+        job->finished = true;
+    }
+    return job;
+}
+
+// Wait for `job`, running it here if no pool thread picked it up yet
+static void finishJob(PatchJob *job, bool run)
+{
+    if (QThreadPool::globalInstance()->tryTake(job)) {
+        if (!run) {
+            return;
+        }
+        job->run();
+    }
+    QMutexLocker lock(job->mutex);
+    while (!job->finished) {
+        job->done->wait(job->mutex);
+    }
+}
+
+bool decodeFramesParallel(ApngContext *ctx, int frameCount)
+{
+    const int total = ctx->info.frames.size();
+    if (!ctx->started) {
+        ctx->started       = true;
+        ctx->hasHeader     = true;
+        ctx->isAnimated    = ctx->info.isAnimated;
+        ctx->skipFirst     = ctx->info.skipFirst;
+        ctx->frameCount    = quint32(total + (ctx->skipFirst ? 1 : 0));
+        ctx->loopCount     = ctx->info.loopCount();
+        ctx->ihdr          = ctx->info.ihdr;
+        ctx->paletteChunks = ctx->info.paletteChunks;
+        ctx->lastImage     = newCanvas(ctx, ctx->info.size);
+    }
+
+    const int window = 2 * ctx->decodeThreads;
+    const int target = qMin(total,
+                            qMax(frameCount, ctx->decodedFrames() + window));
+    QMutex mutex;
+    QWaitCondition done;
+    QVector<PatchJob *> jobs;  // in frame order
+    int next = ctx->decodedFrames();
+    bool ok  = true;
+    while (ctx->decodedFrames() < target) {
+        const APNGHandler::DecodeError error
+            = checkFrame(ctx, ctx->decodedFrames());
+        if (error != APNGHandler::NoError) {
+            stopDecode(ctx, error);
+            ok = false;
+            break;
+        }
+        while (next < target && jobs.size() < window) {
+            jobs.push_back(startJob(ctx, next++, &mutex, &done));
+        }
+        PatchJob *job = jobs.takeFirst();
+        finishJob(job, true);
+        ok = job->ok;
+        ctx->decodeStats.inflateNs += job->inflateNs;
+        if (ok) {
+            const int index = ctx->decodedFrames();
+            addFrame(ctx, job->f, ctx->info.frames.at(index).spans);
+        }
+        freeFrameBuf(job->f);
+        delete job;
+        if (!ok) {
+            qWarning() << "decodeFramesParallel: bad frame data";
+            ctx->error    = APNGHandler::InvalidData;
+            ctx->hasError = true;
+            break;
+        }
+    }
+    // Only left over after an error
+    for (PatchJob *job : jobs) {
+        finishJob(job, false);
+        freeFrameBuf(job->f);
+        delete job;
+    }
+
+    if (!ok || ctx->decodedFrames() >= total) {
+        finishDecode(ctx);
+    }
+    return ok;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+struct ApngContext;
+
+// Every frame has its own zlib stream. With the chunk layout known from
+// scanApng(), frames are inflated and unfiltered on pool threads; only
+// compositing runs in order, on the calling thread.
+
+// Scanned, complete files with more than one decode thread
+bool canDecodeParallel(const ApngContext *ctx);
+// decodeFrames() for canDecodeParallel() files. Decodes at least a few
+// frames per call so the pool stays busy, with a bounded number of frames
+// in flight.
+bool decodeFramesParallel(ApngContext *ctx, int frameCount);
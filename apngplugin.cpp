@@ -9,12 +9,13 @@ QImageIOPlugin::Capabilities APNGPlugin::capabilities(
     QIODevice *device, const QByteArray &format) const
 {
     if (format == "apng") {
-        return CanRead;
+        return CanRead | CanReadIncremental | CanWrite;
+    }
+    // Autodetection claims animated files only, plain PNGs are read much
+    // faster by Qt's own handler. Writing always names the format.
+    if (format.isEmpty() && APNGHandler::isApng(device)) {
+        return CanRead | CanReadIncremental;
     }
-    //  no detection for Seer
-    // if (format.isEmpty() && APNGHandler::canRead(device)) {
-    //     return CanRead;
-    // }
     return {};
 }
 
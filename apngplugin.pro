@@ -8,12 +8,33 @@ TARGET_EXT = .dll
 include(libapng_static/libapng_static.pri)
 
 HEADERS += \
+    apngbatch.h \
+    apngblend.h \
+    apngcache.h \
+    apngcontext.h \
+    apngframestore.h \
     apnghandler.h \
-    apngplugin.h
+    apngparallel.h \
+    apngpool.h \
+    apngplugin.h \
+    apngprefetch.h \
+    apngscale.h \
+    apngscanner.h \
+    apngwriter.h
 
 SOURCES += \
+    apngbatch.cpp \
+    apngblend.cpp \
+    apngcache.cpp \
+    apngframestore.cpp \
     apnghandler.cpp \
-    apngplugin.cpp
+    apngparallel.cpp \
+    apngpool.cpp \
+    apngplugin.cpp \
+    apngprefetch.cpp \
+    apngscale.cpp \
+    apngscanner.cpp \
+    apngwriter.cpp
 
 OTHER_FILES += apng.json
 
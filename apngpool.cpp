@@ -0,0 +1,155 @@
+#include "apngpool.h"
+
+#include <QMutexLocker>
+
+#include <cstring>
+
+// Bookkeeping in front of every buffer, keeps the pixels 64-byte aligned
+static const qint64 kHeader = 64;
+// Upper bound of idle buffers; the slot vector is allocated once
+static const int kMaxIdle = 64;
+
+static qint64 roundedCapacity(qint64 bytes)
+{
+    return (bytes + 4095) & ~qint64(4095);
+}
+
+static qint64 &capacityOf(uchar *buffer)
+{
+    return *reinterpret_cast<qint64 *>(buffer - kHeader);
+}
+
+static void releaseImage(void *buffer)
+{
+    ApngBufferPool::instance()->release(static_cast<uchar *>(buffer));
+}
+
+ApngBufferPool *ApngBufferPool::instance()
+{
+    // Never destroyed: pooled images may outlive static destructors
+    static ApngBufferPool *pool = new ApngBufferPool;
+    return pool;
+}
+
+ApngBufferPool::ApngBufferPool()
+{
+    m_idle.reserve(kMaxIdle);
+    m_stats.budget = m_budget;
+}
+
+uchar *ApngBufferPool::acquire(qint64 bytes)
+{
+    {
+        QMutexLocker lock(&m_mutex);
+        // Smallest idle buffer that fits without wasting more than half
+        int best = -1;
+        for (int i = 0; i < m_idle.size(); i++) {
+            const qint64 capacity = m_idle.at(i).capacity;
+            if (capacity >= bytes && capacity <= 2 * roundedCapacity(bytes)
+                && (best < 0 || capacity < m_idle.at(best).capacity)) {
+                best = i;
+            }
+        }
+        if (best >= 0) {
+            uchar *buffer = m_idle.at(best).buffer;
+            m_idleBytes -= m_idle.at(best).capacity;
+            m_idle.remove(best);
+            ++m_stats.reuses;
+            return buffer;
+        }
+        ++m_stats.allocations;
+    }
+
+    const qint64 capacity = roundedCapacity(bytes);
+    auto block            = static_cast<uchar *>(
+        qMallocAligned(size_t(capacity + kHeader), size_t(kHeader)));
+    if (!block) {
+        return nullptr;
+    }
+    uchar *buffer      = block + kHeader;
+    capacityOf(buffer) = capacity;
+    return buffer;
+}
+
+void ApngBufferPool::release(uchar *buffer)
+{
+    if (!buffer) {
+        return;
+    }
+    const qint64 capacity = capacityOf(buffer);
+    {
+        QMutexLocker lock(&m_mutex);
+        if (capacity <= m_budget) {
+            // Oldest idle buffers make room
+            while (!m_idle.isEmpty()
+                   && (m_idle.size() >= kMaxIdle
+                       || m_idleBytes + capacity > m_budget)) {
+                m_idleBytes -= m_idle.first().capacity;
+                qFreeAligned(m_idle.first().buffer - kHeader);
+                m_idle.remove(0);
+            }
+            Slot slot;
+            slot.buffer   = buffer;
+            slot.capacity = capacity;
+            m_idle.push_back(slot);
+            m_idleBytes += capacity;
+            return;
+        }
+    }
+    qFreeAligned(buffer - kHeader);
+}
+
+QImage ApngBufferPool::image(const QSize &size, QImage::Format format)
+{
+    if (size.isEmpty()) {
+        return QImage();
+    }
+    const int depth        = QImage::toPixelFormat(format).bitsPerPixel();
+    const int bytesPerLine = ((size.width() * depth + 31) / 32) * 4;
+    uchar *buffer          = acquire(qint64(bytesPerLine) * size.height());
+    if (!buffer) {
+        return QImage();
+    }
+    return QImage(buffer, size.width(), size.height(), bytesPerLine, format,
+                  releaseImage, buffer);
+}
+
+QImage ApngBufferPool::copy(const QImage &image, const QRect &rect)
+{
+    const QRect r = rect.isNull() ? image.rect() : rect & image.rect();
+    QImage out    = this->image(r.size(), image.format());
+    if (out.isNull()) {
+        return out;
+    }
+    if (image.format() == QImage::Format_Indexed8) {
+        out.setColorTable(image.colorTable());
+    }
+    const int offset = r.x() * image.depth() / 8;
+    const int bytes  = r.width() * image.depth() / 8;
+    for (int y = 0; y < r.height(); y++) {
+        memcpy(out.scanLine(y), image.constScanLine(r.y() + y) + offset,
+               size_t(bytes));
+    }
+    return out;
+}
+
+void ApngBufferPool::setBudget(qint64 bytes)
+{
+    QMutexLocker lock(&m_mutex);
+    m_budget       = qMax<qint64>(0, bytes);
+    m_stats.budget = m_budget;
+    while (!m_idle.isEmpty() && m_idleBytes > m_budget) {
+        m_idleBytes -= m_idle.first().capacity;
+        qFreeAligned(m_idle.first().buffer - kHeader);
+        m_idle.remove(0);
+    }
+}
+
+APNGHandler::BufferPoolStats ApngBufferPool::stats() const
+{
+    QMutexLocker lock(&m_mutex);
+    APNGHandler::BufferPoolStats stats = m_stats;
+    stats.idleBuffers                  = m_idle.size();
+    stats.idleBytes                    = m_idleBytes;
+    return stats;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <QImage>
+#include <QMutex>
+#include <QRect>
+#include <QVector>
+
+#include "apnghandler.h"
+
+// Process-wide pool of pixel buffers for canvases, frame rows and
+// patches. A buffer released by one frame or one decode is handed to the
+// next request of about the same size, so once an animation has warmed
+// the pool, decoding takes its buffers from here instead of the heap.
+// Idle buffers beyond the budget are freed.
+class ApngBufferPool {
+public:
+    static ApngBufferPool *instance();
+
+    // At least `bytes`, 64-byte aligned
+    uchar *acquire(qint64 bytes);
+    // Only what acquire() returned
+    void release(uchar *buffer);
+
+    // Uninitialized image on a pooled buffer; the buffer goes back when
+    // the last copy of the image is gone. Writing to a shared copy
+    // detaches onto the heap as usual, use copy() to stay in the pool.
+    QImage image(const QSize &size, QImage::Format format);
+    // `rect` of `image` (all of it if null) in a pooled image
+    QImage copy(const QImage &image, const QRect &rect = QRect());
+
+    // <= 0 keeps no idle buffers, every release frees
+    void setBudget(qint64 bytes);
+    APNGHandler::BufferPoolStats stats() const;
+
+private:
+    ApngBufferPool();
+
+    struct Slot {
+        uchar *buffer   = nullptr;
+        qint64 capacity = 0;
+    };
+
+private:
+    mutable QMutex m_mutex;  // guards everything below
+    QVector<Slot> m_idle;    // capacity reserved up front, never grows
+    qint64 m_idleBytes = 0;
+    qint64 m_budget    = 64 * 1024 * 1024;
+    APNGHandler::BufferPoolStats m_stats;
+};
@@ -0,0 +1,100 @@
+#include "apngprefetch.h"
+
+#include <QElapsedTimer>
+#include <QMutexLocker>
+
+#include "apngcontext.h"
+
+void ApngPrefetcher::run()
+{
+    QMutexLocker lock(&m_mutex);
+    while (!m_stop) {
+        if (m_next < 0 || m_ring.size() >= m_capacity) {
+            m_wake.wait(&m_mutex);
+            continue;
+        }
+        const int index          = m_next;
+        const quint64 generation = m_generation;
+        m_inFlight               = index;
+        lock.unlock();
+
+        QImage frame;
+        int count = 0;
+        {
+            QMutexLocker decodeLock(&m_ctx->mutex);
+            frame = frameAt(m_ctx, index);
+            count = m_ctx->imageCount();
+        }
+
+        lock.relock();
+        m_inFlight = -1;
+        if (generation != m_generation) {
+            // take() moved on while this one was decoding
+            continue;
+        }
+        if (frame.isNull()) {
+            // Past the end of a stream that announced more frames, wrap;
+            // a broken first frame stops the worker
+            m_next = index > 0 ? 0 : -1;
+            m_ready.wakeAll();
+            continue;
+        }
+        Slot slot;
+        slot.index = index;
+        slot.image = frame;
+        m_ring.push_back(slot);
+        m_next = index + 1 < count ? index + 1 : 0;
+        m_ready.wakeAll();
+    }
+}
+
+bool ApngPrefetcher::ringHas(int index) const
+{
+    for (const Slot &slot : m_ring) {
+        if (slot.index == index) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ApngPrefetcher::take(int index, QImage *frame)
+{
+    QMutexLocker lock(&m_mutex);
+    if (!ringHas(index)) {
+        m_ring.clear();
+    }
+    // Frames before `index` were skipped
+    while (!m_ring.isEmpty() && m_ring.first().index != index) {
+        m_ring.removeFirst();
+    }
+
+    if (m_ring.isEmpty()) {
+        m_stats.underruns++;
+        if (m_inFlight != index && m_next != index) {
+            // A jump, start over from `index`
+            m_generation++;
+            m_next = index;
+        }
+        m_wake.wakeAll();
+
+        QElapsedTimer timer;
+        timer.start();
+        while (m_ring.isEmpty() && !m_stop
+               && (m_next >= 0 || m_inFlight >= 0)) {
+            m_ready.wait(&m_mutex);
+        }
+        m_stats.waitUs += timer.nsecsElapsed() / 1000;
+        if (m_ring.isEmpty() || m_ring.first().index != index) {
+            return false;
+        }
+    }
+    else {
+        m_stats.hits++;
+    }
+
+    *frame = m_ring.takeFirst().image;
+    // Room for one more
+    m_wake.wakeAll();
+    return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <QImage>
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+#include "apnghandler.h"
+
+struct ApngContext;
+
+// Decodes ahead of read() on its own thread into a small ring of frames.
+// Only used for scanned files: the metadata queries then answer from the
+// ApngInfo, which no longer changes, and everything else that touches the
+// context takes ApngContext::mutex.
+class ApngPrefetcher : public QThread {
+public:
+    // `capacity` >= 1 frames
+    ApngPrefetcher(ApngContext *ctx, int capacity)
+        : m_ctx(ctx), m_capacity(capacity)
+    {
+        m_stats.capacity = m_capacity;
+    }
+
+    ~ApngPrefetcher() override
+    {
+        {
+            QMutexLocker lock(&m_mutex);
+            m_stop = true;
+            m_wake.wakeAll();
+        }
+        wait();
+    }
+
+    // Frame `index`, waiting for the worker if it is not ready yet.
+    // False if the worker could not produce it.
+    bool take(int index, QImage *frame);
+    APNGHandler::PrefetchStats stats() const
+    {
+        QMutexLocker lock(&m_mutex);
+        return m_stats;
+    }
+
+protected:
+    void run() override;
+
+private:
+    struct Slot {
+        int index = -1;
+        QImage image;
+    };
+    bool ringHas(int index) const;
+
+    ApngContext *m_ctx;
+    const int m_capacity;
+
+    mutable QMutex m_mutex;  // guards everything below
+    QWaitCondition m_wake;   // worker: room in the ring, or a new position
+    QWaitCondition m_ready;  // take(): a frame, or the worker gave up
+    QVector<Slot> m_ring;
+    int m_next            = 0;   // next frame to decode, -1 when idle
+    int m_inFlight        = -1;  // being decoded right now
+    quint64 m_generation  = 0;   // bumped when take() moves the position
+    bool m_stop           = false;
+    APNGHandler::PrefetchStats m_stats;
+};
@@ -0,0 +1,136 @@
+#include "apngscale.h"
+
+#include <QVector>
+
+#include "apngblend.h"
+
+// Source span [*begin, *end) of destination pixel `i`
+static inline void boxSpan(int i, int src, int dst, int *begin, int *end)
+{
+    *begin = int(qint64(i) * src / dst);
+    *end   = int(qint64(i + 1) * src / dst);
+    if (*end <= *begin) {
+        *end = *begin + 1;
+    }
+}
+
+void apngScale(const QImage &src, const QRect &from, QImage *dst,
+               const QRect &part)
+{
+    const QRect area = part & dst->rect();
+    if (area.isEmpty()) {
+        return;
+    }
+    if (from.isEmpty()) {
+        for (int y = area.top(); y <= area.bottom(); y++) {
+            apngClearRow(reinterpret_cast<quint32 *>(dst->scanLine(y))
+                             + area.left(),
+                         area.width());
+        }
+        return;
+    }
+
+    const bool straight = src.format() != QImage::Format_ARGB32_Premultiplied;
+    const int dw        = dst->width();
+    const int dh        = dst->height();
+
+    // Source columns under `area`
+    int colBegin, colEnd, unused;
+    boxSpan(area.left(), from.width(), dw, &colBegin, &unused);
+    boxSpan(area.right(), from.width(), dw, &unused, &colEnd);
+    const int cols = colEnd - colBegin;
+
+    // Per source column sums of the rows in the current box:
+    // alpha, then the three colours (times alpha when straight)
+    QVector<quint64> sums(cols * 4);
+    for (int y = area.top(); y <= area.bottom(); y++) {
+        int rowBegin, rowEnd;
+        boxSpan(y, from.height(), dh, &rowBegin, &rowEnd);
+
+        sums.fill(0);
+        quint64 *s = sums.data();
+        for (int sy = rowBegin; sy < rowEnd; sy++) {
+            const quint32 *line
+                = reinterpret_cast<const quint32 *>(
+                      src.constScanLine(from.top() + sy))
+                  + from.left() + colBegin;
+            for (int c = 0; c < cols; c++) {
+                const quint32 p = line[c];
+                const quint32 a = p >> 24;
+                const quint32 w = straight ? a : 1;
+                s[c * 4 + 0] += a;
+                s[c * 4 + 1] += ((p >> 16) & 0xff) * w;
+                s[c * 4 + 2] += ((p >> 8) & 0xff) * w;
+                s[c * 4 + 3] += (p & 0xff) * w;
+            }
+        }
+
+        quint32 *out = reinterpret_cast<quint32 *>(dst->scanLine(y));
+        for (int x = area.left(); x <= area.right(); x++) {
+            int b, e;
+            boxSpan(x, from.width(), dw, &b, &e);
+            quint64 t[4] = {0, 0, 0, 0};
+            for (int c = b - colBegin; c < e - colBegin; c++) {
+                t[0] += s[c * 4 + 0];
+                t[1] += s[c * 4 + 1];
+                t[2] += s[c * 4 + 2];
+                t[3] += s[c * 4 + 3];
+            }
+            // Rounded to nearest
+            const quint64 n   = quint64(e - b) * (rowEnd - rowBegin);
+            const quint64 a   = (2 * t[0] + n) / (2 * n);
+            const quint64 den = straight ? t[0] : n;
+            if (den == 0) {
+                out[x] = 0;
+                continue;
+            }
+            quint32 p = quint32(a) << 24;
+            p |= quint32((2 * t[1] + den) / (2 * den)) << 16;
+            p |= quint32((2 * t[2] + den) / (2 * den)) << 8;
+            p |= quint32((2 * t[3] + den) / (2 * den));
+            out[x] = p;
+        }
+    }
+}
+
+QRect apngScaledRect(const QRect &from, const QSize &to, const QRect &rect)
+{
+    const QRect r = (rect & from).translated(-from.topLeft());
+    if (r.isEmpty() || to.isEmpty()) {
+        return QRect();
+    }
+    // Spans grow with the index, so the first and last overlapping ones
+    // bound the result
+    int x0 = -1, x1 = -1;
+    for (int x = 0; x < to.width(); x++) {
+        int b, e;
+        boxSpan(x, from.width(), to.width(), &b, &e);
+        if (e > r.left() && b <= r.right()) {
+            if (x0 < 0) {
+                x0 = x;
+            }
+            x1 = x;
+        }
+        else if (x0 >= 0) {
+            break;
+        }
+    }
+    int y0 = -1, y1 = -1;
+    for (int y = 0; y < to.height(); y++) {
+        int b, e;
+        boxSpan(y, from.height(), to.height(), &b, &e);
+        if (e > r.top() && b <= r.bottom()) {
+            if (y0 < 0) {
+                y0 = y;
+            }
+            y1 = y;
+        }
+        else if (y0 >= 0) {
+            break;
+        }
+    }
+    if (x0 < 0 || y0 < 0) {
+        return QRect();
+    }
+    return QRect(QPoint(x0, y0), QPoint(x1, y1));
+}
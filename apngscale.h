@@ -0,0 +1,21 @@
+#pragma once
+
+#include <QImage>
+#include <QRect>
+
+// Box filter for ScaledSize/ClipRect output. Works on Format_ARGB32 and
+// Format_ARGB32_Premultiplied; straight alpha pixels are averaged weighted
+// by their alpha, so transparent pixels don't darken the edges.
+//
+// Destination pixel x covers the source columns from
+//   from.x + x * from.width / to.width
+// up to, but not including, the same for x + 1, and at least one column
+// when enlarging; rows likewise.
+
+// Scale area `from` of `src` to the size of `dst`, writing only the pixels
+// of `dst` inside `part`. `dst` has the format of `src`. An empty `from`
+// clears `part`.
+void apngScale(const QImage &src, const QRect &from, QImage *dst,
+               const QRect &part);
+// Pixels of a `to` sized destination of `from` whose box overlaps `rect`
+QRect apngScaledRect(const QRect &from, const QSize &to, const QRect &rect);
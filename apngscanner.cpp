@@ -0,0 +1,258 @@
+#include "apngscanner.h"
+
+#include <QIODevice>
+#include <QtEndian>
+
+#include <cstring>
+
+#include "png.h"
+
+qint64 apngDelayUs(quint16 num, quint16 den)
+{
+    if (den == 0) {
+        den = 100;
+    }
+    return qint64(num) * 1000000 / den;
+}
+
+// The file, either behind a random-access device or in memory
+struct Source {
+    QIODevice *device = nullptr;
+    qint64 base       = 0;  // device position of the signature
+    const uchar *data = nullptr;
+    qint64 size       = 0;
+
+    bool read(qint64 offset, quint32 length, uchar *out) const
+    {
+        if (data) {
+            if (offset < 0 || offset + length > size) {
+                return false;
+            }
+            memcpy(out, data + offset, length);
+            return true;
+        }
+        return device->seek(base + offset)
+               && device->read(reinterpret_cast<char *>(out), length)
+                      == length;
+    }
+};
+
+static bool scanChunks(const Source &src, ApngInfo *info)
+{
+    *info = ApngInfo();
+
+    uchar sig[8];
+    if (!src.read(0, 8, sig) || png_sig_cmp(sig, 0, 8) != 0) {
+        return false;
+    }
+
+    qint64 offset    = 8;
+    bool seenIdat    = false;
+    bool idatHasFctl = false;
+    QVector<ApngChunkSpan> idatSpans;
+
+    for (;;) {
+        uchar head[8];
+        if (!src.read(offset, 8, head)) {
+            break;
+        }
+        const quint32 len = qFromBigEndian<quint32>(head);
+        const char *type  = reinterpret_cast<const char *>(head + 4);
+        if (len > 0x7fffffff) {
+            // PNG limit, anything bigger is garbage
+            return false;
+        }
+        const qint64 dataOffset = offset + 8;
+        const qint64 next       = dataOffset + len + 4;  // + CRC
+
+        if (memcmp(type, "IHDR", 4) == 0) {
+            uchar d[13];
+            if (len != 13 || !src.read(dataOffset, 13, d)) {
+                return false;
+            }
+            info->ihdr      = QByteArray(reinterpret_cast<char *>(d), 13);
+            info->size      = QSize(qFromBigEndian<quint32>(d),
+                                    qFromBigEndian<quint32>(d + 4));
+            info->bitDepth  = d[8];
+            info->colorType = d[9];
+            info->interlace = d[12];
+        }
+        else if (memcmp(type, "acTL", 4) == 0 && !seenIdat) {
+            // acTL after IDAT doesn't count, libpng ignores it too
+            uchar d[8];
+            if (len != 8 || !src.read(dataOffset, 8, d)) {
+                return false;
+            }
+            info->isAnimated = true;
+            info->numPlays   = qFromBigEndian<quint32>(d + 4);
+        }
+        else if (memcmp(type, "fcTL", 4) == 0) {
+            uchar d[26];
+            if (len != 26 || !src.read(dataOffset, 26, d)) {
+                return false;
+            }
+            ApngFrameInfo f;
+            f.width     = qFromBigEndian<quint32>(d + 4);
+            f.height    = qFromBigEndian<quint32>(d + 8);
+            f.x         = qFromBigEndian<quint32>(d + 12);
+            f.y         = qFromBigEndian<quint32>(d + 16);
+            f.delayNum  = qFromBigEndian<quint16>(d + 20);
+            f.delayDen  = qFromBigEndian<quint16>(d + 22);
+            f.delayUs   = apngDelayUs(f.delayNum, f.delayDen);
+            f.disposeOp = d[24];
+            f.blendOp   = d[25];
+            info->frames.push_back(f);
+        }
+        else if (memcmp(type, "IDAT", 4) == 0) {
+            if (!seenIdat) {
+                seenIdat    = true;
+                idatHasFctl = !info->frames.isEmpty();
+            }
+            ApngChunkSpan span;
+            span.offset = dataOffset;
+            span.length = len;
+            idatSpans.push_back(span);
+        }
+        else if (memcmp(type, "fdAT", 4) == 0) {
+            if (!info->frames.isEmpty() && len >= 4) {
+                ApngChunkSpan span;
+                span.offset = dataOffset + 4;
+                span.length = len - 4;
+                info->frames.last().spans.push_back(span);
+            }
+        }
+        else if ((memcmp(type, "PLTE", 4) == 0 || memcmp(type, "tRNS", 4) == 0)
+                 && !seenIdat) {
+            // Kept raw, frame replays put them in front of the data
+            QByteArray chunk(int(len) + 12, Qt::Uninitialized);
+            if (!src.read(offset, len + 12, reinterpret_cast<uchar *>(
+                                                chunk.data()))) {
+                return false;
+            }
+            info->paletteChunks += chunk;
+        }
+        else if (memcmp(type, "IEND", 4) == 0) {
+            info->complete = true;
+            break;
+        }
+
+        offset = next;
+    }
+
+    if (info->ihdr.isEmpty()) {
+        return false;
+    }
+
+    if (info->isAnimated && !info->frames.isEmpty()) {
+        info->skipFirst = !idatHasFctl;
+        if (idatHasFctl) {
+            info->frames.first().spans = idatSpans;
+        }
+    }
+    else {
+        // Plain PNG, or an acTL without any fcTL
+        ApngFrameInfo f;
+        f.width    = quint32(info->size.width());
+        f.height   = quint32(info->size.height());
+        f.delayNum = 0;
+        f.delayUs  = 0;
+        f.spans    = idatSpans;
+
+        info->isAnimated = false;
+        info->frames     = QVector<ApngFrameInfo>() << f;
+    }
+    return true;
+}
+
+bool scanApng(QIODevice *device, ApngInfo *info)
+{
+    if (!device || device->isSequential() || !device->isReadable()) {
+        return false;
+    }
+    Source src;
+    src.device = device;
+
+    const qint64 pos = device->pos();
+    const bool ok    = scanChunks(src, info);
+    device->seek(pos);
+    return ok;
+}
+
+bool scanApng(const uchar *data, qint64 size, ApngInfo *info)
+{
+    if (!data) {
+        return false;
+    }
+    Source src;
+    src.data = data;
+    src.size = size;
+    return scanChunks(src, info);
+}
+
+// Chunks before the first IDAT are few: IHDR, acTL, PLTE, tRNS and some
+// ancillary ones. Anything beyond this is not worth walking for a guess.
+static const int kSniffChunks = 64;
+// Room for those on a sequential device, text and ICC profiles included
+static const int kSniffPeekBytes = 64 * 1024;
+
+static ApngSniff sniffChunks(const Source &src)
+{
+    uchar sig[8];
+    if (!src.read(0, 8, sig) || png_sig_cmp(sig, 0, 8) != 0) {
+        return ApngSniff::NotPng;
+    }
+    qint64 offset = 8;
+    for (int i = 0; i < kSniffChunks; i++) {
+        uchar head[8];
+        if (!src.read(offset, 8, head)) {
+            return ApngSniff::Undecided;
+        }
+        const quint32 len = qFromBigEndian<quint32>(head);
+        const char *type  = reinterpret_cast<const char *>(head + 4);
+        if (len > 0x7fffffff) {
+            return ApngSniff::NotPng;
+        }
+        if (memcmp(type, "acTL", 4) == 0) {
+            return ApngSniff::Apng;
+        }
+        if (memcmp(type, "IDAT", 4) == 0 || memcmp(type, "IEND", 4) == 0) {
+            return ApngSniff::Png;
+        }
+        offset += 12 + qint64(len);
+    }
+    return ApngSniff::Undecided;
+}
+
+ApngSniff sniffApng(QIODevice *device)
+{
+    if (!device || !device->isReadable()) {
+        return ApngSniff::NotPng;
+    }
+    if (device->isSequential()) {
+        // Whatever there is, up to kSniffPeekBytes
+        const qint64 avail    = device->bytesAvailable();
+        const QByteArray head = device->peek(qMin<qint64>(avail,
+                                                          kSniffPeekBytes));
+        return sniffApng(reinterpret_cast<const uchar *>(head.constData()),
+                         head.size());
+    }
+    // From the top, where decoding starts too
+    Source src;
+    src.device = device;
+
+    const qint64 pos     = device->pos();
+    const ApngSniff kind = sniffChunks(src);
+    device->seek(pos);
+    return kind;
+}
+
+ApngSniff sniffApng(const uchar *data, qint64 size)
+{
+    if (!data) {
+        return ApngSniff::NotPng;
+    }
+    Source src;
+    src.data = data;
+    src.size = size;
+    return sniffChunks(src);
+}
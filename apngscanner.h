@@ -0,0 +1,86 @@
+#pragma once
+
+#include <QByteArray>
+#include <QSize>
+#include <QVector>
+
+class QIODevice;
+
+// Payload of one IDAT/fdAT chunk inside the device
+struct ApngChunkSpan {
+    qint64 offset  = 0;
+    quint32 length = 0;
+};
+
+// One fcTL, i.e. one displayed frame
+struct ApngFrameInfo {
+    quint32 x      = 0;
+    quint32 y      = 0;
+    quint32 width  = 0;
+    quint32 height = 0;
+
+    quint16 delayNum = 0;
+    quint16 delayDen = 100;
+    qint64 delayUs   = 0;
+
+    quint8 disposeOp = 0;  // PNG_DISPOSE_OP_*
+    quint8 blendOp   = 0;  // PNG_BLEND_OP_*
+
+    // IDAT/fdAT payloads, fdAT sequence numbers skipped
+    QVector<ApngChunkSpan> spans;
+};
+
+struct ApngInfo {
+    QSize size;
+    quint8 bitDepth  = 0;
+    quint8 colorType = 0;
+    quint8 interlace = 0;
+
+    bool isAnimated  = false;
+    bool skipFirst   = false;  // the IDAT image is not part of the animation
+    quint32 numPlays = 0;      // acTL, 0 means infinite
+
+    // Displayed frames; plain PNGs get a single full-size entry
+    QVector<ApngFrameInfo> frames;
+
+    QByteArray ihdr;           // IHDR payload
+    QByteArray paletteChunks;  // raw PLTE/tRNS chunks
+    bool complete = false;     // IEND was reached
+
+    // QMovie semantics: -1 loops forever
+    int loopCount() const
+    {
+        if (!isAnimated) {
+            return 0;
+        }
+        return numPlays == 0 ? -1 : int(numPlays) - 1;
+    }
+};
+
+// What the start of a file says about it
+enum class ApngSniff {
+    NotPng,     // no PNG signature, or not even 8 bytes yet
+    Png,        // IDAT (or IEND) before any acTL
+    Apng,       // acTL before the first IDAT
+    Undecided,  // PNG, but the data ran out before acTL or IDAT
+};
+
+// fcTL delay in microseconds; a zero denominator means 1/100 s
+qint64 apngDelayUs(quint16 num, quint16 den);
+
+// Walk the chunks of `device` from the start without decoding anything:
+// IHDR, acTL, fcTL and the palette are read, IDAT/fdAT payloads are
+// skipped with seeks. Needs a random-access device; its position is
+// restored.
+bool scanApng(QIODevice *device, ApngInfo *info);
+// Same over a file that is already in memory, e.g. mapped
+bool scanApng(const uchar *data, qint64 size, ApngInfo *info);
+
+// Check the signature and the chunk headers up to the first IDAT without
+// consuming anything. Random-access devices are looked at from the start,
+// as they are decoded, with only the 8-byte headers read and the position
+// restored. Sequential ones are looked at from the current position
+// through peek(), so only what is buffered or available counts, and at
+// most the first 64 KiB: chunks before acTL beyond that give Undecided.
+ApngSniff sniffApng(QIODevice *device);
+ApngSniff sniffApng(const uchar *data, qint64 size);
@@ -0,0 +1,620 @@
+#include "apngwriter.h"
+
+#include <QDebug>
+#include <QIODevice>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QtEndian>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "apngblend.h"
+#include "png.h"
+#include "zlib.h"
+
+// Filtered bytes per stripe when compressing on several threads; smaller
+// frames are a single stripe
+static const int kStripeBytes = 256 * 1024;
+// Bigger stripes would overflow the int and uInt sizes of QByteArray and
+// zlib, so even a single thread splits frames this big
+static const int kMaxStripeBytes = 1 << 30;
+// Signature, IHDR and acTL
+static const int kHeaderBytes = 8 + 25 + 20;
+
+static void appendU32(QByteArray &out, quint32 value)
+{
+    char buf[4];
+    qToBigEndian<quint32>(value, buf);
+    out.append(buf, 4);
+}
+
+static void appendU16(QByteArray &out, quint16 value)
+{
+    char buf[2];
+    qToBigEndian<quint16>(value, buf);
+    out.append(buf, 2);
+}
+
+static void appendChunk(QByteArray &png, const char *type,
+                        const QByteArray &data)
+{
+    appendU32(png, quint32(data.size()));
+    const int start = png.size();
+    png.append(type, 4);
+    png.append(data);
+    const uLong crc = crc32(
+        crc32(0L, Z_NULL, 0),
+        reinterpret_cast<const Bytef *>(png.constData() + start),
+        uInt(png.size() - start));
+    appendU32(png, quint32(crc));
+}
+
+static QByteArray iend()
+{
+    QByteArray png;
+    appendChunk(png, "IEND", QByteArray());
+    return png;
+}
+
+/// filtering
+// ARGB32 row `y` of `image` in PNG byte order
+static void toRgba(uchar *dst, const QImage &image, int y)
+{
+    auto src = reinterpret_cast<const QRgb *>(image.constScanLine(y));
+    for (int x = 0; x < image.width(); x++) {
+        dst[0] = uchar(qRed(src[x]));
+        dst[1] = uchar(qGreen(src[x]));
+        dst[2] = uchar(qBlue(src[x]));
+        dst[3] = uchar(qAlpha(src[x]));
+        dst += 4;
+    }
+}
+
+static inline int paeth(int a, int b, int c)
+{
+    const int p  = a + b - c;
+    const int pa = std::abs(p - a);
+    const int pb = std::abs(p - b);
+    const int pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+// PNG filter `type` of `row` with `prev` above it, 4 bytes per pixel
+static void filterRow(int type, uchar *out, const uchar *row,
+                      const uchar *prev, int bytes)
+{
+    switch (type) {
+    case 1:
+        for (int i = 0; i < bytes; i++) {
+            out[i] = uchar(row[i] - (i >= 4 ? row[i - 4] : 0));
+        }
+        break;
+    case 2:
+        for (int i = 0; i < bytes; i++) {
+            out[i] = uchar(row[i] - prev[i]);
+        }
+        break;
+    case 3:
+        for (int i = 0; i < bytes; i++) {
+            const int a = i >= 4 ? row[i - 4] : 0;
+            out[i]      = uchar(row[i] - ((a + prev[i]) >> 1));
+        }
+        break;
+    case 4:
+        for (int i = 0; i < bytes; i++) {
+            const int a = i >= 4 ? row[i - 4] : 0;
+            const int c = i >= 4 ? prev[i - 4] : 0;
+            out[i]      = uchar(row[i] - paeth(a, prev[i], c));
+        }
+        break;
+    default:
+        memcpy(out, row, size_t(bytes));
+        break;
+    }
+}
+
+/// stripes
+// A frame's zlib stream is cut into stripes of whole rows. Each is
+// deflated on its own and ends with a sync flush, the last one with the
+// end of the stream, so they concatenate into one valid stream; the
+// Adler-32 checksums are combined. Stripes don't use each other's data as
+// a dictionary, which costs a little ratio at the seams.
+struct ApngStripe : public QRunnable {
+    QImage pixels;  // the frame's rectangle, shared
+    int firstRow = 0;
+    int rows     = 0;
+    int level    = 6;
+    bool last    = false;
+
+    QMutex *mutex        = nullptr;
+    QWaitCondition *done = nullptr;
+    bool finished        = false;  // guarded by `mutex`
+    bool ok              = false;
+    QByteArray out;        // raw deflate data
+    uLong adler     = 1;   // of the filtered rows
+    qint64 rawBytes = 0;
+
+    void run() override
+    {
+        const bool result = compress();
+        QMutexLocker lock(mutex);
+        ok       = result;
+        finished = true;
+        done->wakeAll();
+    }
+
+    bool compress();
+};
+
+// Each row gets the filter whose output has the smallest sum of absolute
+// values, libpng's heuristic; level 0 only stores, so nothing is filtered
+bool ApngStripe::compress()
+{
+    const int bytes = pixels.width() * 4;
+    rawBytes        = qint64(rows) * (bytes + 1);
+    QByteArray raw(int(rawBytes), Qt::Uninitialized);
+    QByteArray scratch(4 * bytes, '\0');
+    uchar *prev  = reinterpret_cast<uchar *>(scratch.data());
+    uchar *cur   = prev + bytes;
+    uchar *trial = cur + bytes;
+    uchar *best  = trial + bytes;
+    if (firstRow > 0) {
+        toRgba(prev, pixels, firstRow - 1);
+    }
+
+    uchar *dst = reinterpret_cast<uchar *>(raw.data());
+    for (int y = firstRow; y < firstRow + rows; y++) {
+        toRgba(cur, pixels, y);
+        int bestType = 0;
+        if (level == 0) {
+            memcpy(best, cur, size_t(bytes));
+        }
+        else {
+            quint64 bestSum = ~quint64(0);
+            for (int type = 0; type < 5; type++) {
+                filterRow(type, trial, cur, prev, bytes);
+                quint64 sum = 0;
+                for (int i = 0; i < bytes; i++) {
+                    sum += quint64(std::abs(int(qint8(trial[i]))));
+                }
+                if (sum < bestSum) {
+                    bestSum  = sum;
+                    bestType = type;
+                    qSwap(trial, best);
+                }
+            }
+        }
+        dst[0] = uchar(bestType);
+        memcpy(dst + 1, best, size_t(bytes));
+        dst += bytes + 1;
+        qSwap(prev, cur);
+    }
+    adler = adler32(adler32(0L, Z_NULL, 0),
+                    reinterpret_cast<const Bytef *>(raw.constData()),
+                    uInt(rawBytes));
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8,
+                     level == 0 ? Z_DEFAULT_STRATEGY : Z_FILTERED)
+        != Z_OK) {
+        return false;
+    }
+    // deflateBound() assumes Z_FINISH, a sync flush adds an empty block
+    out.resize(int(deflateBound(&zs, uLong(rawBytes))) + 16);
+    zs.next_in   = reinterpret_cast<Bytef *>(raw.data());
+    zs.avail_in  = uInt(rawBytes);
+    zs.next_out  = reinterpret_cast<Bytef *>(out.data());
+    zs.avail_out = uInt(out.size());
+    const int ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    const bool ok = last ? ret == Z_STREAM_END
+                         : ret == Z_OK && zs.avail_in == 0 && zs.avail_out > 0;
+    out.resize(int(zs.total_out));
+    deflateEnd(&zs);
+    return ok;
+}
+
+// Wait for `stripe`, running it here if no pool thread picked it up yet
+static void waitStripe(ApngStripe *stripe)
+{
+    if (QThreadPool::globalInstance()->tryTake(stripe)) {
+        stripe->run();
+    }
+    QMutexLocker lock(stripe->mutex);
+    while (!stripe->finished) {
+        stripe->done->wait(stripe->mutex);
+    }
+}
+
+/// frame differencing
+// Bounding box of the pixels where `a` and `b` differ
+static QRect diffRect(const QImage &a, const QImage &b)
+{
+    const int width = a.width();
+    int top         = -1;
+    int bottom      = -1;
+    int left        = width;
+    int right       = -1;
+    for (int y = 0; y < a.height(); y++) {
+        auto pa = reinterpret_cast<const QRgb *>(a.constScanLine(y));
+        auto pb = reinterpret_cast<const QRgb *>(b.constScanLine(y));
+        if (memcmp(pa, pb, size_t(width) * sizeof(QRgb)) == 0) {
+            continue;
+        }
+        int x0 = 0;
+        while (pa[x0] == pb[x0]) {
+            x0++;
+        }
+        int x1 = width - 1;
+        while (pa[x1] == pb[x1]) {
+            x1--;
+        }
+        if (top < 0) {
+            top = y;
+        }
+        bottom = y;
+        left   = qMin(left, x0);
+        right  = qMax(right, x1);
+    }
+    if (top < 0) {
+        return QRect();
+    }
+    return QRect(QPoint(left, top), QPoint(right, bottom));
+}
+
+// Pixels of `rect` that differ, or -1 if OVER can't draw one of them. A
+// source pixel comes out unchanged where it is opaque or the canvas is
+// fully transparent (see apngblend.cpp); a transparent one keeps the
+// canvas.
+static qint64 overChanged(const QImage &canvas, const QImage &target,
+                          const QRect &rect)
+{
+    qint64 changed = 0;
+    for (int y = rect.top(); y <= rect.bottom(); y++) {
+        auto c = reinterpret_cast<const QRgb *>(canvas.constScanLine(y));
+        auto t = reinterpret_cast<const QRgb *>(target.constScanLine(y));
+        for (int x = rect.left(); x <= rect.right(); x++) {
+            if (c[x] == t[x]) {
+                continue;
+            }
+            if (qAlpha(t[x]) != 255
+                && (qAlpha(c[x]) != 0 || qAlpha(t[x]) == 0)) {
+                return -1;
+            }
+            changed++;
+        }
+    }
+    return changed;
+}
+
+// The canvas a frame leaves for the next one, disposed with `op`
+static QImage disposed(const QImage &shown, const QImage &before,
+                       const QRect &rect, int op)
+{
+    if (op == PNG_DISPOSE_OP_NONE) {
+        return shown;
+    }
+    QImage canvas = shown.copy();
+    for (int y = rect.top(); y <= rect.bottom(); y++) {
+        auto row = reinterpret_cast<quint32 *>(canvas.scanLine(y)) + rect.x();
+        if (op == PNG_DISPOSE_OP_BACKGROUND) {
+            apngClearRow(row, rect.width());
+        }
+        else {
+            apngCopyRow(row,
+                        reinterpret_cast<const quint32 *>(
+                            before.constScanLine(y))
+                            + rect.x(),
+                        rect.width());
+        }
+    }
+    return canvas;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// ApngWriter
+ApngWriter::ApngWriter(QIODevice *device,
+                       int frameCount,
+                       int loopCount,
+                       int level,
+                       int threads)
+    : m_device(device),
+      m_frameCount(frameCount),
+      m_loopCount(loopCount),
+      m_level(level < 0 || level > 9 ? 6 : level),
+      m_threads(qMax(1, threads))
+{
+    m_start = m_device->isSequential() ? 0 : m_device->pos();
+}
+
+ApngWriter::~ApngWriter()
+{
+    // Stripes still running use the mutex
+    for (Frame &frame : m_pending) {
+        finishFrame(frame);
+    }
+}
+
+bool ApngWriter::addFrame(const QImage &image, int delay)
+{
+    if (!m_ok) {
+        return false;
+    }
+    if (image.isNull() || (m_added > 0 && image.size() != m_shown.size())) {
+        qWarning() << "ApngWriter: frame size differs from the first frame"
+                   << image.size();
+        return false;
+    }
+    if (m_frameCount >= 0 && m_added >= m_frameCount) {
+        qWarning() << "ApngWriter: more than" << m_frameCount << "frames";
+        return false;
+    }
+    if (m_added == 0) {
+        m_shown = image;  // for the size
+        if (!writeHeader(m_frameCount >= 0 ? quint32(m_frameCount) : 1)) {
+            return false;
+        }
+        m_end = m_start + kHeaderBytes;
+    }
+
+    Frame frame;
+    frame.delay    = delay;
+    frame.sequence = m_sequence;
+    m_sequence += m_added == 0 ? 1 : 2;  // the first frame is IDAT
+    chooseOps(frame, image.convertToFormat(QImage::Format_ARGB32));
+    startFrame(frame);
+    m_pending.push_back(frame);
+    m_added++;
+
+    if (m_frameCount >= 0) {
+        // Up to two frames per thread compressing
+        return flush(2 * m_threads);
+    }
+
+    // Everything but the last frame is final; the file ends with it, its
+    // provisional dispose op and IEND for now
+    if (!flush(1) || !finishFrame(m_pending.last())) {
+        return false;
+    }
+    const QByteArray tail = frameChunks(m_pending.last()) + iend();
+    if (!writeAt(m_end, tail) || !writeHeader(quint32(m_added))) {
+        return false;
+    }
+    return m_device->seek(m_end + tail.size());
+}
+
+bool ApngWriter::finish()
+{
+    if (!m_ok || m_frameCount < 0) {
+        return m_ok;
+    }
+    if (m_added != m_frameCount) {
+        qWarning() << "ApngWriter: got" << m_added << "of" << m_frameCount
+                   << "frames";
+        m_ok = false;
+        return false;
+    }
+    return flush(0) && writeAt(m_end, iend());
+}
+
+// Tries each dispose op for the previous frame, NONE first: the candidate
+// canvas gives the rectangle this frame has to cover, stored with SOURCE
+// or, where every changed pixel allows it, with OVER and the unchanged
+// ones transparent. The cheapest estimate wins: a pixel per pixel,
+// transparent runs a quarter of that.
+void ApngWriter::chooseOps(Frame &frame, const QImage &target)
+{
+    if (m_added == 0) {
+        frame.rect  = target.rect();
+        frame.blend = PNG_BLEND_OP_SOURCE;
+        m_before    = QImage(target.size(), QImage::Format_ARGB32);
+        m_before.fill(0);
+        frame.pixels = target;
+        m_shown      = target;
+        return;
+    }
+
+    Frame &prev = m_pending.last();
+    // The reader treats PREVIOUS on the first frame as BACKGROUND
+    const int ops = m_added == 1 ? 2 : 3;
+    QImage canvas;
+    qint64 bestCost = -1;
+    for (int op = 0; op < ops; op++) {
+        const QImage candidate = disposed(m_shown, m_before, prev.rect, op);
+        QRect rect             = diffRect(candidate, target);
+        quint8 blend           = PNG_BLEND_OP_SOURCE;
+        qint64 cost            = 0;
+        if (rect.isEmpty()) {
+            // fcTL needs a pixel; the canvas already has it
+            rect = QRect(0, 0, 1, 1);
+        }
+        else {
+            const qint64 area    = qint64(rect.width()) * rect.height();
+            const qint64 changed = overChanged(candidate, target, rect);
+            cost                 = area;
+            if (changed >= 0 && changed + (area - changed) / 4 < cost) {
+                cost  = changed + (area - changed) / 4;
+                blend = PNG_BLEND_OP_OVER;
+            }
+        }
+        if (bestCost < 0 || cost < bestCost) {
+            bestCost     = cost;
+            prev.dispose = quint8(op);
+            frame.rect   = rect;
+            frame.blend  = blend;
+            canvas       = candidate;
+        }
+    }
+
+    frame.pixels = target.copy(frame.rect);
+    if (frame.blend == PNG_BLEND_OP_OVER) {
+        for (int y = 0; y < frame.rect.height(); y++) {
+            auto src = reinterpret_cast<const QRgb *>(
+                           canvas.constScanLine(frame.rect.y() + y))
+                       + frame.rect.x();
+            auto dst = reinterpret_cast<QRgb *>(frame.pixels.scanLine(y));
+            for (int x = 0; x < frame.rect.width(); x++) {
+                if (dst[x] == src[x]) {
+                    dst[x] = 0;
+                }
+            }
+        }
+    }
+    m_before = canvas;
+    m_shown  = target;
+}
+
+void ApngWriter::startFrame(Frame &frame)
+{
+    const int height   = frame.pixels.height();
+    const int rowBytes = frame.pixels.width() * 4 + 1;
+    // A single thread deflates the whole frame in one go, if it can
+    const int stripeBytes = m_threads > 1 ? kStripeBytes : kMaxStripeBytes;
+    const int rows        = qMin(height, qMax(1, stripeBytes / rowBytes));
+    for (int y = 0; y < height; y += rows) {
+        auto stripe = new ApngStripe;
+        stripe->setAutoDelete(false);
+        stripe->pixels   = frame.pixels;
+        stripe->firstRow = y;
+        stripe->rows     = qMin(rows, height - y);
+        stripe->level    = m_level;
+        stripe->last     = y + rows >= height;
+        stripe->mutex    = &m_mutex;
+        stripe->done     = &m_done;
+        frame.stripes.push_back(stripe);
+        if (m_threads > 1) {
+            QThreadPool::globalInstance()->start(stripe);
+        }
+        else {
+            stripe->run();
+        }
+    }
+}
+
+bool ApngWriter::finishFrame(Frame &frame)
+{
+    if (frame.stripes.isEmpty()) {
+        return !frame.data.isEmpty();
+    }
+    // CMF: deflate with a 32K window. FLEVEL as zlib sets it, FCHECK makes
+    // the pair a multiple of 31.
+    const int flevel = m_level < 2 ? 0 : m_level < 6 ? 1 : m_level == 6 ? 2 : 3;
+    int header       = (0x78 << 8) | (flevel << 6);
+    header += 31 - header % 31;
+    frame.data.clear();
+    frame.data.append(char(header >> 8));
+    frame.data.append(char(header & 0xff));
+
+    bool ok     = true;
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (ApngStripe *stripe : frame.stripes) {
+        waitStripe(stripe);
+        ok = ok && stripe->ok;
+        frame.data.append(stripe->out);
+        adler = adler32_combine(adler, stripe->adler,
+                                z_off_t(stripe->rawBytes));
+        delete stripe;
+    }
+    frame.stripes.clear();
+    frame.pixels = QImage();
+    appendU32(frame.data, quint32(adler));
+    if (!ok) {
+        qWarning() << "ApngWriter: deflate failed";
+        frame.data.clear();
+        m_ok = false;
+    }
+    return ok;
+}
+
+QByteArray ApngWriter::frameChunks(const Frame &frame) const
+{
+    // Delays in ms while they fit, in 1/100 s beyond about a minute
+    quint16 num = quint16(qBound(0, frame.delay, 65535));
+    quint16 den = 1000;
+    if (frame.delay > 65535) {
+        num = quint16(qMin(frame.delay / 10, 65535));
+        den = 100;
+    }
+
+    QByteArray fctl;
+    appendU32(fctl, frame.sequence);
+    appendU32(fctl, quint32(frame.rect.width()));
+    appendU32(fctl, quint32(frame.rect.height()));
+    appendU32(fctl, quint32(frame.rect.x()));
+    appendU32(fctl, quint32(frame.rect.y()));
+    appendU16(fctl, num);
+    appendU16(fctl, den);
+    fctl.append(char(frame.dispose));
+    fctl.append(char(frame.blend));
+
+    QByteArray png;
+    appendChunk(png, "fcTL", fctl);
+    if (frame.sequence == 0) {
+        appendChunk(png, "IDAT", frame.data);
+    }
+    else {
+        QByteArray fdat;
+        appendU32(fdat, frame.sequence + 1);
+        fdat.append(frame.data);
+        appendChunk(png, "fdAT", fdat);
+    }
+    return png;
+}
+
+bool ApngWriter::writeHeader(quint32 frameCount)
+{
+    QByteArray png("\x89PNG\r\n\x1a\n", 8);
+
+    QByteArray ihdr;
+    appendU32(ihdr, quint32(m_shown.width()));
+    appendU32(ihdr, quint32(m_shown.height()));
+    ihdr.append(char(8));
+    ihdr.append(char(PNG_COLOR_TYPE_RGB_ALPHA));
+    ihdr.append(QByteArray(3, '\0'));  // compression, filter, interlace
+    appendChunk(png, "IHDR", ihdr);
+
+    QByteArray actl;
+    appendU32(actl, frameCount);
+    appendU32(actl, m_loopCount < 0 ? 0 : quint32(m_loopCount) + 1);
+    appendChunk(png, "acTL", actl);
+
+    Q_ASSERT(png.size() == kHeaderBytes);
+    return writeAt(m_start, png);
+}
+
+bool ApngWriter::writeAt(qint64 pos, const QByteArray &bytes)
+{
+    if (!m_device->isSequential() && m_device->pos() != pos
+        && !m_device->seek(pos)) {
+        m_ok = false;
+    }
+    else if (m_device->write(bytes) != bytes.size()) {
+        m_ok = false;
+    }
+    if (!m_ok) {
+        qWarning() << "ApngWriter: write failed" << m_device->errorString();
+    }
+    return m_ok;
+}
+
+bool ApngWriter::flush(int keep)
+{
+    while (m_ok && m_pending.size() > keep) {
+        Frame &frame = m_pending.first();
+        if (!finishFrame(frame)) {
+            break;
+        }
+        const QByteArray png = frameChunks(frame);
+        if (!writeAt(m_end, png)) {
+            break;
+        }
+        m_end += png.size();
+        m_pending.removeFirst();
+    }
+    return m_ok;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <QImage>
+#include <QMutex>
+#include <QRect>
+#include <QVector>
+#include <QWaitCondition>
+
+class QIODevice;
+struct ApngStripe;
+
+// Encodes frames into an APNG, RGBA 8 bits per channel. Each frame after
+// the first is stored as the bounding rectangle of what differs from the
+// canvas it is drawn on, with the dispose op of the frame before it and
+// its own blend op picked to make that rectangle cheapest (see
+// chooseOps()). Rows are filtered and deflated in stripes on
+// QThreadPool::globalInstance(), several frames at a time.
+//
+// With a known frame count the file is written front to back, so any
+// writable device works. Without one (frameCount < 0) the device must be
+// random access: the file is complete after every addFrame(), and the
+// next one rewrites the frame count and the fcTL before it. Nothing is
+// ever moved, as rewritten chunks keep their size.
+class ApngWriter {
+public:
+    // `loopCount` as QMovie counts, -1 loops forever. `level` is the zlib
+    // compression level.
+    ApngWriter(QIODevice *device,
+               int frameCount,
+               int loopCount,
+               int level,
+               int threads);
+    ~ApngWriter();
+
+    QIODevice *device() const { return m_device; }
+
+    // `delay` in ms. Every frame must have the size of the first one.
+    bool addFrame(const QImage &image, int delay);
+    // Only needed with a known frame count: writes the frames still
+    // pending and IEND
+    bool finish();
+
+private:
+    struct Frame {
+        QRect rect;            // fcTL region
+        quint8 dispose   = 0;  // decided by the frame after it
+        quint8 blend     = 0;
+        int delay        = 0;  // ms
+        quint32 sequence = 0;  // of the fcTL, fdAT follows
+        QImage pixels;         // `rect` as stored, ARGB32
+        QVector<ApngStripe *> stripes;  // compressing `pixels`
+        QByteArray data;                // zlib stream, once they are done
+    };
+
+    void chooseOps(Frame &frame, const QImage &target);
+    void startFrame(Frame &frame);
+    // Wait for the stripes of `frame` and put its data together
+    bool finishFrame(Frame &frame);
+    QByteArray frameChunks(const Frame &frame) const;
+    bool writeHeader(quint32 frameCount);
+    bool writeAt(qint64 pos, const QByteArray &bytes);
+    // Write pending frames, oldest first, until `keep` are left. Only the
+    // last one's fcTL may still change, so `keep` is 0 only at the end.
+    bool flush(int keep);
+
+private:
+    QIODevice *m_device;
+    int m_frameCount;  // -1: rewritten after every frame
+    int m_loopCount;
+    int m_level;
+    int m_threads;
+    bool m_ok = true;
+
+    qint64 m_start     = 0;  // device position of the signature
+    qint64 m_end       = 0;  // after the last frame written for good
+    int m_added        = 0;
+    quint32 m_sequence = 0;
+
+    QImage m_shown;   // canvas after the last frame
+    QImage m_before;  // canvas the last frame was drawn on
+    QVector<Frame> m_pending;
+
+    QMutex m_mutex;  // guards the stripes' `finished`
+    QWaitCondition m_done;
+};
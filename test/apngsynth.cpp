@@ -0,0 +1,170 @@
+#include "apngsynth.h"
+
+#include <QRect>
+#include <QtEndian>
+
+#include "zlib.h"
+
+static void appendU32(QByteArray &out, quint32 value)
+{
+    uchar b[4];
+    qToBigEndian(value, b);
+    out.append(reinterpret_cast<const char *>(b), 4);
+}
+
+static void appendU16(QByteArray &out, quint16 value)
+{
+    uchar b[2];
+    qToBigEndian(value, b);
+    out.append(reinterpret_cast<const char *>(b), 2);
+}
+
+static void appendChunk(QByteArray &out, const char *type,
+                        const QByteArray &data)
+{
+    appendU32(out, quint32(data.size()));
+    const int start = out.size();
+    out.append(type, 4);
+    out.append(data);
+    const quint32 crc
+        = quint32(crc32(0, reinterpret_cast<const Bytef *>(out.constData())
+                               + start,
+                        uInt(out.size() - start)));
+    appendU32(out, crc);
+}
+
+// Filter type 0 scanlines of `rect` in frame `frame`, deflated
+static QByteArray frameData(const ApngSynthSpec &spec, const QRect &rect,
+                            int frame)
+{
+    const int channels = spec.colorType == 6   ? 4
+                         : spec.colorType == 2 ? 3
+                         : spec.colorType == 4 ? 2
+                                               : 1;
+    const int depth = spec.colorType == 3 ? 8 : spec.bitDepth;
+    const int bpp   = channels * depth / 8;
+
+    QByteArray raw;
+    raw.reserve((1 + rect.width() * bpp) * rect.height());
+    for (int y = 0; y < rect.height(); y++) {
+        raw.append('\0');
+        for (int x = 0; x < rect.width(); x++) {
+            const int gx = rect.x() + x;
+            const int gy = rect.y() + y;
+            const uchar r = uchar(gx * 255 / qMax(1, spec.size.width() - 1));
+            const uchar g = uchar(gy * 255 / qMax(1, spec.size.height() - 1));
+            const uchar b = uchar(frame * 37);
+            const uchar a = uchar((gx + gy + frame * 16) & 0xff);
+
+            uchar px[4];
+            int n = 0;
+            switch (spec.colorType) {
+            case 2:
+                px[n++] = r;
+                px[n++] = g;
+                px[n++] = b;
+                break;
+            case 3:
+                px[n++] = uchar((gx + gy + frame) & 0xff);
+                break;
+            case 4:
+                px[n++] = r;
+                px[n++] = a;
+                break;
+            default:
+                px[n++] = r;
+                px[n++] = g;
+                px[n++] = b;
+                px[n++] = a;
+                break;
+            }
+            for (int i = 0; i < n; i++) {
+                raw.append(char(px[i]));
+                if (depth == 16) {
+                    raw.append(char(px[i] ^ 0x5a));
+                }
+            }
+        }
+    }
+
+    uLongf size = compressBound(uLong(raw.size()));
+    QByteArray out(int(size), Qt::Uninitialized);
+    compress2(reinterpret_cast<Bytef *>(out.data()), &size,
+              reinterpret_cast<const Bytef *>(raw.constData()),
+              uLong(raw.size()), 6);
+    out.resize(int(size));
+    return out;
+}
+
+QByteArray apngSynthesize(const ApngSynthSpec &spec)
+{
+    const int w = spec.size.width();
+    const int h = spec.size.height();
+    QByteArray out("\x89PNG\r\n\x1a\n", 8);
+
+    QByteArray ihdr;
+    appendU32(ihdr, quint32(w));
+    appendU32(ihdr, quint32(h));
+    ihdr.append(char(spec.colorType == 3 ? 8 : spec.bitDepth));
+    ihdr.append(char(spec.colorType));
+    ihdr.append(QByteArray(3, '\0'));  // compression, filter, interlace
+    appendChunk(out, "IHDR", ihdr);
+
+    if (spec.colorType == 3) {
+        QByteArray plte, trns;
+        for (int i = 0; i < 256; i++) {
+            plte.append(char(i));
+            plte.append(char(255 - i));
+            plte.append(char(i * 7));
+            trns.append(char(i));
+        }
+        appendChunk(out, "PLTE", plte);
+        appendChunk(out, "tRNS", trns);
+    }
+
+    QByteArray actl;
+    appendU32(actl, quint32(spec.frames));
+    appendU32(actl, spec.plays);
+    appendChunk(out, "acTL", actl);
+
+    quint32 seq = 0;
+    if (spec.hiddenFirst) {
+        appendChunk(out, "IDAT", frameData(spec, QRect(0, 0, w, h), 0));
+    }
+    for (int i = 0; i < spec.frames; i++) {
+        const int picture = i / qMax(1, spec.hold);
+        // A moving quarter after the first picture
+        QRect rect(0, 0, w, h);
+        if (picture > 0) {
+            const int pw = qMax(1, w / 2);
+            const int ph = qMax(1, h / 2);
+            rect = QRect((picture * 7) % (w - pw + 1),
+                         (picture * 5) % (h - ph + 1), pw, ph);
+        }
+
+        QByteArray fctl;
+        appendU32(fctl, seq++);
+        appendU32(fctl, quint32(rect.width()));
+        appendU32(fctl, quint32(rect.height()));
+        appendU32(fctl, quint32(rect.x()));
+        appendU32(fctl, quint32(rect.y()));
+        appendU16(fctl, spec.delayNums.at(i % spec.delayNums.size()));
+        appendU16(fctl, spec.delayDens.at(i % spec.delayDens.size()));
+        fctl.append(char(spec.disposeOps.at(i % spec.disposeOps.size())));
+        fctl.append(char(spec.blendOps.at(i % spec.blendOps.size())));
+        appendChunk(out, "fcTL", fctl);
+
+        const QByteArray data = frameData(spec, rect, picture);
+        if (i == 0 && !spec.hiddenFirst) {
+            appendChunk(out, "IDAT", data);
+        }
+        else {
+            QByteArray fdat;
+            appendU32(fdat, seq++);
+            fdat.append(data);
+            appendChunk(out, "fdAT", fdat);
+        }
+    }
+    appendChunk(out, "IEND", QByteArray());
+    return out;
+}
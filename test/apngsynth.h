@@ -0,0 +1,25 @@
+#pragma once
+
+#include <QByteArray>
+#include <QSize>
+#include <QVector>
+
+// Synthetic APNG files for tests and benchmarks, generated in memory so
+// the suites need no corpus on disk. Frames after the first cover a
+// moving quarter of the canvas; pixels are gradients with varying alpha.
+struct ApngSynthSpec {
+    QSize size       = QSize(64, 64);
+    int frames       = 8;
+    int bitDepth     = 8;  // 8 or 16; palette images are always 8
+    int colorType    = 6;  // PNG_COLOR_TYPE_*: 2, 3, 4 or 6
+    bool hiddenFirst = false;  // IDAT image outside the animation
+    quint32 plays    = 0;
+    int hold         = 1;  // frames in a row with the same fcTL and data
+    // fcTL ops and delays, used round robin
+    QVector<quint8> disposeOps = {0};
+    QVector<quint8> blendOps   = {0};
+    QVector<quint16> delayNums = {4};
+    QVector<quint16> delayDens = {100};
+};
+
+QByteArray apngSynthesize(const ApngSynthSpec &spec);
@@ -0,0 +1,11 @@
+QT += core gui testlib
+CONFIG += testcase
+TARGET = tst_bench
+TEMPLATE = app
+
+# Machine readable results, e.g.
+#   ./tst_bench -o results.xml,xml
+#   ./tst_bench -o results.csv,csv
+SOURCES += tst_bench.cpp
+
+include(../common.pri)
@@ -0,0 +1,364 @@
+#include <QBuffer>
+#include <QtTest>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "../../apngblend.h"
+#include "../../apnghandler.h"
+#include "../apngsynth.h"
+
+// Peak resident set size of the process so far, in bytes
+static qint64 peakRss()
+{
+#ifdef Q_OS_WIN
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+        return qint64(pmc.PeakWorkingSetSize);
+    }
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef Q_OS_MACOS
+    return qint64(usage.ru_maxrss);
+#else
+    return qint64(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+class TestBench : public QObject {
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+
+    void parse_data();
+    void parse();
+    void readFrame_data();
+    void readFrame();
+    void metadata_data();
+    void metadata();
+    void peakMemory_data();
+    void peakMemory();
+    void inputAllocations_data();
+    void inputAllocations();
+    void poolAllocations_data();
+    void poolAllocations();
+    void write_data();
+    void write();
+    void writeSingleThread_data();
+    void writeSingleThread();
+    void firstFrames_data();
+    void firstFrames();
+    void firstFramesSingleThread_data();
+    void firstFramesSingleThread();
+    void blendKernel_data();
+    void blendKernel();
+
+private:
+    void corpus();
+    void benchWrite();
+    void benchFirstFrames(int threads);
+};
+
+void TestBench::initTestCase()
+{
+    // Every iteration has to decode for real
+    APNGHandler::setSharedCacheBudget(0);
+    APNGHandler::setDiskCacheDirectory(QString());
+}
+
+// Sizes, frame counts, op mixes and pixel formats
+void TestBench::corpus()
+{
+    QTest::addColumn<QByteArray>("file");
+
+    struct Row {
+        const char *name;
+        int width, height, frames, bitDepth, colorType;
+        QVector<quint8> dispose, blend;
+    };
+    const Row rows[] = {
+        {"icon-rgba8", 64, 64, 16, 8, 6, {0}, {0}},
+        {"icon-palette", 64, 64, 16, 8, 3, {0}, {1}},
+        {"sticker-rgba8-over", 256, 256, 48, 8, 6, {0}, {1}},
+        {"sticker-rgba8-mixed", 256, 256, 48, 8, 6, {0, 1, 2}, {0, 1}},
+        {"sticker-graya8", 256, 256, 48, 8, 4, {1}, {1}},
+        {"sticker-rgba16", 256, 256, 24, 16, 6, {0}, {1}},
+        {"banner-rgb8", 960, 240, 24, 8, 2, {0}, {0}},
+        {"hd-rgba8-previous", 1280, 720, 12, 8, 6, {2, 0}, {1}},
+    };
+    for (const Row &r : rows) {
+        ApngSynthSpec spec;
+        spec.size       = QSize(r.width, r.height);
+        spec.frames     = r.frames;
+        spec.bitDepth   = r.bitDepth;
+        spec.colorType  = r.colorType;
+        spec.disposeOps = r.dispose;
+        spec.blendOps   = r.blend;
+        QTest::newRow(r.name) << apngSynthesize(spec);
+    }
+}
+
+void TestBench::parse_data()
+{
+    corpus();
+}
+
+// All frames through the static ensureParsed()
+void TestBench::parse()
+{
+    QFETCH(QByteArray, file);
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+
+    QBENCHMARK {
+        buffer.seek(0);
+        int loopCount = 0;
+        QVector<QImage> frames;
+        QVector<int> delays;
+        QVERIFY(APNGHandler::ensureParsed(&buffer, loopCount, frames, delays));
+    }
+}
+
+void TestBench::readFrame_data()
+{
+    corpus();
+}
+
+// One read() per iteration, looping over the animation like playback
+void TestBench::readFrame()
+{
+    QFETCH(QByteArray, file);
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDevice(&buffer);
+
+    QImage frame;
+    QBENCHMARK {
+        QVERIFY(handler.read(&frame));
+    }
+}
+
+void TestBench::metadata_data()
+{
+    corpus();
+}
+
+// What QImageReader asks a fresh handler before the first frame
+void TestBench::metadata()
+{
+    QFETCH(QByteArray, file);
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+
+    QBENCHMARK {
+        buffer.seek(0);
+        APNGHandler handler;
+        handler.setDevice(&buffer);
+        QVERIFY(handler.imageCount() > 0);
+        QVERIFY(handler.option(QImageIOHandler::Size).toSize().isValid());
+    }
+}
+
+void TestBench::peakMemory_data()
+{
+    corpus();
+}
+
+// Decodes every frame once and reports the peak RSS of the process. It
+// never goes down, so a row shows the maximum of itself and the rows
+// before it; run a single row (tst_bench peakMemory:<row>) to isolate it.
+void TestBench::peakMemory()
+{
+    QFETCH(QByteArray, file);
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDevice(&buffer);
+
+    QImage frame;
+    const int count = handler.imageCount();
+    for (int i = 0; i < count; i++) {
+        QVERIFY(handler.read(&frame));
+    }
+    QTest::setBenchmarkResult(peakRss(), QTest::BytesAllocated);
+}
+
+void TestBench::inputAllocations_data()
+{
+    corpus();
+}
+
+// Input buffer (re)allocations of one decode, see ReadStats
+void TestBench::inputAllocations()
+{
+    QFETCH(QByteArray, file);
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDevice(&buffer);
+
+    QImage frame;
+    const int count = handler.imageCount();
+    for (int i = 0; i < count; i++) {
+        QVERIFY(handler.read(&frame));
+    }
+    QTest::setBenchmarkResult(handler.readStats().allocations,
+                              QTest::Events);
+}
+
+void TestBench::poolAllocations_data()
+{
+    corpus();
+}
+
+// Heap allocations of the buffer pool for a second decode of the same
+// file; the first one fills the pool
+void TestBench::poolAllocations()
+{
+    QFETCH(QByteArray, file);
+    quint64 allocations = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        allocations = APNGHandler::bufferPoolStats().allocations;
+        QBuffer buffer(&file);
+        buffer.open(QIODevice::ReadOnly);
+        APNGHandler handler;
+        handler.setDevice(&buffer);
+
+        QImage frame;
+        const int count = handler.imageCount();
+        for (int i = 0; i < count; i++) {
+            QVERIFY(handler.read(&frame));
+        }
+    }
+    QTest::setBenchmarkResult(
+        APNGHandler::bufferPoolStats().allocations - allocations,
+        QTest::Events);
+}
+
+void TestBench::write_data()
+{
+    corpus();
+}
+
+// The decoded corpus encoded again through writeAnimation(), on all cores
+void TestBench::write()
+{
+    benchWrite();
+}
+
+void TestBench::writeSingleThread_data()
+{
+    corpus();
+}
+
+// Same on one thread; the ratio to write() is the parallel speedup
+void TestBench::writeSingleThread()
+{
+    APNGHandler::setDefaultWriteThreads(1);
+    benchWrite();
+    APNGHandler::setDefaultWriteThreads(0);
+}
+
+void TestBench::benchWrite()
+{
+    QFETCH(QByteArray, file);
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    int loopCount = 0;
+    QVector<QImage> frames;
+    QVector<int> delays;
+    QVERIFY(APNGHandler::ensureParsed(&buffer, loopCount, frames, delays));
+
+    QByteArray out;
+    QBENCHMARK {
+        out.clear();
+        QBuffer output(&out);
+        output.open(QIODevice::WriteOnly);
+        QVERIFY(APNGHandler::writeAnimation(&output, frames, delays,
+                                            loopCount));
+    }
+}
+
+void TestBench::firstFrames_data()
+{
+    corpus();
+}
+
+// A batch of thumbnails, one file per thread
+void TestBench::firstFrames()
+{
+    benchFirstFrames(0);
+}
+
+void TestBench::firstFramesSingleThread_data()
+{
+    corpus();
+}
+
+void TestBench::firstFramesSingleThread()
+{
+    benchFirstFrames(1);
+}
+
+void TestBench::benchFirstFrames(int threads)
+{
+    QFETCH(QByteArray, file);
+    const int files = 32;
+    QVector<QByteArray> copies(files, file);
+    QVector<QBuffer *> buffers;
+    QVector<QIODevice *> devices;
+    for (QByteArray &copy : copies) {
+        buffers.push_back(new QBuffer(&copy));
+        buffers.last()->open(QIODevice::ReadOnly);
+        devices.push_back(buffers.last());
+    }
+
+    APNGHandler::BatchStats stats;
+    QBENCHMARK {
+        APNGHandler::firstFrames(devices, threads, &stats);
+    }
+    qDeleteAll(buffers);
+    QCOMPARE(stats.failures, 0);
+}
+
+void TestBench::blendKernel_data()
+{
+    QTest::addColumn<int>("kernel");
+    static const char *const names[] = {"scalar", "sse2", "avx2"};
+    for (int k = ApngKernelScalar; k <= apngBestKernel(); k++) {
+        QTest::newRow(names[k]) << k;
+    }
+}
+
+// OVER alone on a row of half transparent pixels, a sticker's edge or
+// shadow; no opaque or transparent runs to skip
+void TestBench::blendKernel()
+{
+    QFETCH(int, kernel);
+    const int width = 4096;
+    QVector<quint32> src(width), dst(width);
+    quint32 seed = 1;
+    for (int i = 0; i < width; i++) {
+        seed   = seed * 1664525u + 1013904223u;
+        src[i] = (seed & 0x00ffffff) | 0x80000000;
+        dst[i] = (seed >> 8) | 0xc0000000;
+    }
+    // Blended in place over and over; the destination soon turns opaque,
+    // which costs the same, as only the source alpha picks the path
+    QBENCHMARK {
+        apngBlendRowWith(ApngKernel(kernel), dst.data(), src.constData(),
+                         width);
+    }
+}
+
+QTEST_MAIN(TestBench)
+#include "tst_bench.moc"
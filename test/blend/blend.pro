@@ -0,0 +1,11 @@
+QT += core gui testlib
+CONFIG += testcase
+TARGET = tst_blend
+TEMPLATE = app
+SOURCES += tst_blend.cpp \
+    ../../apngblend.cpp \
+    ../../apngscale.cpp
+
+HEADERS += \
+    ../../apngblend.h \
+    ../../apngscale.h
@@ -0,0 +1,382 @@
+#include <cmath>
+#include <cstring>
+
+#include <QColor>
+#include <QImage>
+#include <QtTest>
+
+#include "../../apngblend.h"
+#include "../../apngscale.h"
+
+// The per-pixel QColor compositing the row kernels replaced
+static void referenceCopy(QImage &dest, const QImage &src)
+{
+    for (int y = 0; y < src.height(); y++) {
+        for (int x = 0; x < src.width(); x++) {
+            dest.setPixelColor(x, y, src.pixelColor(x, y));
+        }
+    }
+}
+
+// Straight alpha OVER in long double, before any rounding
+static void exactBlend(quint32 s, quint32 d, long double out[4])
+{
+    const long double sa = (s >> 24) / 255.0L;
+    const long double da = (d >> 24) / 255.0L;
+    const long double oa = sa + da * (1 - sa);
+    for (int i = 0; i < 3; i++) {
+        const long double sc = (s >> (8 * i)) & 0xff;
+        const long double dc = (d >> (8 * i)) & 0xff;
+        out[i]               = (sc * sa + dc * da * (1 - sa)) / oa;
+    }
+    out[3] = oa * 255;
+}
+
+// Deterministic pixels, so failures reproduce
+static quint32 nextRandom(quint32 &state)
+{
+    state = state * 1664525u + 1013904223u;
+    return state;
+}
+
+// Corpus: every (source alpha, destination alpha) pair once, random colors
+static void makeCorpus(QImage *src, QImage *dst, quint32 seed)
+{
+    *src = QImage(256, 256, QImage::Format_ARGB32);
+    *dst = QImage(256, 256, QImage::Format_ARGB32);
+    for (int y = 0; y < 256; y++) {
+        auto s = reinterpret_cast<quint32 *>(src->scanLine(y));
+        auto d = reinterpret_cast<quint32 *>(dst->scanLine(y));
+        for (int x = 0; x < 256; x++) {
+            s[x] = (nextRandom(seed) & 0x00ffffff) | (quint32(x) << 24);
+            d[x] = (nextRandom(seed) & 0x00ffffff) | (quint32(y) << 24);
+        }
+    }
+}
+
+static void copyRows(QImage &dest, const QImage &src)
+{
+    for (int y = 0; y < src.height(); y++) {
+        apngCopyRow(reinterpret_cast<quint32 *>(dest.scanLine(y)),
+                    reinterpret_cast<const quint32 *>(src.constScanLine(y)),
+                    src.width());
+    }
+}
+
+static void blendRows(QImage &dest, const QImage &src, ApngKernel kernel)
+{
+    for (int y = 0; y < src.height(); y++) {
+        apngBlendRowWith(kernel,
+                         reinterpret_cast<quint32 *>(dest.scanLine(y)),
+                         reinterpret_cast<const quint32 *>(src.constScanLine(y)),
+                         src.width());
+    }
+}
+
+class TestBlend : public QObject {
+    Q_OBJECT
+
+private slots:
+    void copy_data();
+    void copy();
+    void blend_data();
+    void blend();
+    void blendDispatch();
+    void blendTails();
+    void premultiply();
+    void blendPremultiplied_data();
+    void blendPremultiplied();
+    void clear();
+    void blendIndexed();
+    void scale();
+    void scalePartial();
+};
+
+void TestBlend::copy_data()
+{
+    QTest::addColumn<quint32>("seed");
+    QTest::newRow("seed 1") << 1u;
+    QTest::newRow("seed 2") << 2u;
+    QTest::newRow("seed 3") << 0xdeadbeefu;
+}
+
+void TestBlend::copy()
+{
+    QFETCH(quint32, seed);
+    QImage src, dst;
+    makeCorpus(&src, &dst, seed);
+
+    QImage expected = dst.copy();
+    referenceCopy(expected, src);
+    copyRows(dst, src);
+    QCOMPARE(dst, expected);
+}
+
+void TestBlend::blend_data()
+{
+    QTest::addColumn<quint32>("seed");
+    QTest::addColumn<int>("kernel");
+    static const char *const names[] = {"scalar", "sse2", "avx2"};
+    for (int k = ApngKernelScalar; k <= apngBestKernel(); k++) {
+        for (quint32 seed : {1u, 2u, 0xdeadbeefu}) {
+            QTest::newRow(qPrintable(
+                QString("%1 seed %2").arg(names[k]).arg(seed)))
+                << seed << k;
+        }
+    }
+}
+
+void TestBlend::blend()
+{
+    QFETCH(quint32, seed);
+    QFETCH(int, kernel);
+    QImage src, dst;
+    makeCorpus(&src, &dst, seed);
+
+    const QImage before = dst.copy();
+    blendRows(dst, src, ApngKernel(kernel));
+
+    QImage scalar = before.copy();
+    blendRows(scalar, src, ApngKernelScalar);
+    // SIMD kernels have to match the scalar one bit for bit
+    QCOMPARE(dst, scalar);
+
+    for (int y = 0; y < 256; y++) {
+        auto s   = reinterpret_cast<const quint32 *>(src.constScanLine(y));
+        auto d   = reinterpret_cast<const quint32 *>(before.constScanLine(y));
+        auto out = reinterpret_cast<const quint32 *>(dst.constScanLine(y));
+        for (int x = 0; x < 256; x++) {
+            const quint32 sa = s[x] >> 24;
+            if (sa == 0) {
+                QCOMPARE(out[x], d[x]);
+                continue;
+            }
+            if (sa == 0xff) {
+                QCOMPARE(out[x], s[x]);
+                continue;
+            }
+            long double exact[4];
+            exactBlend(s[x], d[x], exact);
+            for (int i = 0; i < 4; i++) {
+                const long double got = (out[x] >> (8 * i)) & 0xff;
+                // rounded to nearest
+                if (fabsl(got - exact[i]) > 0.5L + 1e-9L) {
+                    QFAIL(qPrintable(QString("src %1 dst %2 -> %3")
+                                         .arg(s[x], 8, 16, QChar('0'))
+                                         .arg(d[x], 8, 16, QChar('0'))
+                                         .arg(out[x], 8, 16, QChar('0'))));
+                }
+            }
+        }
+    }
+}
+
+void TestBlend::blendDispatch()
+{
+    QImage src, dst;
+    makeCorpus(&src, &dst, 7);
+
+    QImage expected = dst.copy();
+    blendRows(expected, src, apngBestKernel());
+    for (int y = 0; y < src.height(); y++) {
+        apngBlendRow(reinterpret_cast<quint32 *>(dst.scanLine(y)),
+                     reinterpret_cast<const quint32 *>(src.constScanLine(y)),
+                     src.width());
+    }
+    QCOMPARE(dst, expected);
+}
+
+// Unaligned starts, row lengths that aren't a multiple of the vector
+// width, and runs of opaque / transparent pixels
+void TestBlend::blendTails()
+{
+    quint32 seed = 3;
+    quint32 src[64], dst[64];
+    for (int i = 0; i < 64; i++) {
+        src[i] = nextRandom(seed);
+        if (i >= 8 && i < 24) {
+            src[i] |= 0xff000000;
+        }
+        else if (i >= 24 && i < 40) {
+            src[i] &= 0x00ffffff;
+        }
+        dst[i] = nextRandom(seed);
+    }
+
+    for (int k = ApngKernelSse2; k <= apngBestKernel(); k++) {
+        for (int offset = 0; offset < 8; offset++) {
+            for (int count = 0; count <= 64 - offset - 1; count += 3) {
+                quint32 a[64], b[64];
+                memcpy(a, dst, sizeof(dst));
+                memcpy(b, dst, sizeof(dst));
+                apngBlendRowWith(ApngKernelScalar, a + offset, src + offset,
+                                 count);
+                apngBlendRowWith(ApngKernel(k), b + offset, src + offset,
+                                 count);
+                QVERIFY(memcmp(a, b, sizeof(a)) == 0);
+            }
+        }
+    }
+}
+
+void TestBlend::premultiply()
+{
+    QImage src, dst;
+    makeCorpus(&src, &dst, 5);
+
+    for (int y = 0; y < 256; y++) {
+        quint32 row[256];
+        memcpy(row, src.constScanLine(y), sizeof(row));
+        apngPremultiplyRow(row, 256);
+        auto s = reinterpret_cast<const quint32 *>(src.constScanLine(y));
+        for (int x = 0; x < 256; x++) {
+            const quint32 a = s[x] >> 24;
+            QCOMPARE(row[x] >> 24, a);
+            for (int i = 0; i < 3; i++) {
+                const long double exact = ((s[x] >> (8 * i)) & 0xff) * a
+                                          / 255.0L;
+                const long double got = (row[x] >> (8 * i)) & 0xff;
+                QVERIFY(fabsl(got - exact) <= 0.5L + 1e-9L);
+            }
+        }
+    }
+}
+
+void TestBlend::blendPremultiplied_data()
+{
+    QTest::addColumn<int>("kernel");
+    QTest::newRow("scalar") << int(ApngKernelScalar);
+    if (apngBestKernel() != ApngKernelScalar) {
+        QTest::newRow("simd") << int(apngBestKernel());
+    }
+}
+
+void TestBlend::blendPremultiplied()
+{
+    QFETCH(int, kernel);
+    QImage src, dst;
+    makeCorpus(&src, &dst, 9);
+    src = src.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    dst = dst.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+    const QImage before = dst.copy();
+    QImage scalar       = dst.copy();
+    for (int y = 0; y < 256; y++) {
+        auto s = reinterpret_cast<const quint32 *>(src.constScanLine(y));
+        apngBlendRowPremultipliedWith(
+            ApngKernel(kernel), reinterpret_cast<quint32 *>(dst.scanLine(y)),
+            s, 256);
+        apngBlendRowPremultipliedWith(
+            ApngKernelScalar, reinterpret_cast<quint32 *>(scalar.scanLine(y)),
+            s, 256);
+    }
+    QCOMPARE(dst, scalar);
+
+    for (int y = 0; y < 256; y++) {
+        auto s   = reinterpret_cast<const quint32 *>(src.constScanLine(y));
+        auto d   = reinterpret_cast<const quint32 *>(before.constScanLine(y));
+        auto out = reinterpret_cast<const quint32 *>(dst.constScanLine(y));
+        for (int x = 0; x < 256; x++) {
+            const quint32 inv = 255 - (s[x] >> 24);
+            for (int i = 0; i < 4; i++) {
+                const long double exact = ((s[x] >> (8 * i)) & 0xff)
+                                          + ((d[x] >> (8 * i)) & 0xff) * inv
+                                                / 255.0L;
+                const long double got = (out[x] >> (8 * i)) & 0xff;
+                QVERIFY(fabsl(got - exact) <= 0.5L + 1e-9L);
+            }
+        }
+    }
+}
+
+void TestBlend::clear()
+{
+    QImage src, dst;
+    makeCorpus(&src, &dst, 1);
+
+    auto row = reinterpret_cast<quint32 *>(dst.scanLine(7));
+    apngClearRow(row + 3, 100);
+    QVERIFY(row[2] != 0);
+    for (int x = 3; x < 103; x++) {
+        QCOMPARE(row[x], 0u);
+    }
+    QVERIFY(row[103] != 0);
+}
+
+// Transparent entries keep the destination, everything else replaces it
+void TestBlend::blendIndexed()
+{
+    uchar alpha[256];
+    for (int i = 0; i < 256; i++) {
+        alpha[i] = i % 3 == 0 ? 0 : 255;
+    }
+    uchar src[256], dst[256];
+    for (int i = 0; i < 256; i++) {
+        src[i] = uchar(i);
+        dst[i] = uchar(255 - i);
+    }
+    apngBlendIndexedRow(dst, src, 256, alpha);
+    for (int i = 0; i < 256; i++) {
+        QCOMPARE(int(dst[i]), i % 3 == 0 ? 255 - i : i);
+    }
+}
+
+void TestBlend::scale()
+{
+    QImage src, unused;
+    makeCorpus(&src, &unused, 5);
+
+    // 3x3 boxes, straight alpha averages weighted by alpha
+    const QRect from(10, 20, 90, 60);
+    QImage dst(30, 20, QImage::Format_ARGB32);
+    apngScale(src, from, &dst, dst.rect());
+    for (int y = 0; y < dst.height(); y++) {
+        for (int x = 0; x < dst.width(); x++) {
+            long double a = 0, c[3] = {0, 0, 0};
+            for (int sy = 0; sy < 3; sy++) {
+                for (int sx = 0; sx < 3; sx++) {
+                    const quint32 p = src.pixel(from.x() + x * 3 + sx,
+                                                from.y() + y * 3 + sy);
+                    a += p >> 24;
+                    for (int i = 0; i < 3; i++) {
+                        c[i] += ((p >> (8 * i)) & 0xff) * (p >> 24);
+                    }
+                }
+            }
+            const quint32 got = dst.pixel(x, y);
+            QVERIFY(fabsl((got >> 24) - a / 9) <= 0.5L);
+            for (int i = 0; a > 0 && i < 3; i++) {
+                QVERIFY(fabsl(((got >> (8 * i)) & 0xff) - c[i] / a) <= 0.5L);
+            }
+        }
+    }
+}
+
+void TestBlend::scalePartial()
+{
+    QImage src, unused;
+    makeCorpus(&src, &unused, 6);
+    src = src.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+    const QRect from(0, 0, 256, 256);
+    QImage full(100, 70, QImage::Format_ARGB32_Premultiplied);
+    apngScale(src, from, &full, full.rect());
+
+    // Change a patch, rescale only what it touches
+    const QRect patch(37, 101, 20, 9);
+    for (int y = patch.top(); y <= patch.bottom(); y++) {
+        apngClearRow(reinterpret_cast<quint32 *>(src.scanLine(y))
+                         + patch.left(),
+                     patch.width());
+    }
+    QImage partial = full.copy();
+    const QRect part = apngScaledRect(from, full.size(), patch);
+    QVERIFY(!part.isEmpty());
+    apngScale(src, from, &partial, part);
+
+    apngScale(src, from, &full, full.rect());
+    QCOMPARE(partial, full);
+}
+
+QTEST_MAIN(TestBlend)
+#include "tst_blend.moc"
@@ -0,0 +1,32 @@
+# Production sources and libapng for every test that goes through the
+# handler, plus the synthetic APNG generator
+SOURCES += \
+    $$PWD/apngsynth.cpp \
+    $$PWD/../apngbatch.cpp \
+    $$PWD/../apngblend.cpp \
+    $$PWD/../apngcache.cpp \
+    $$PWD/../apngframestore.cpp \
+    $$PWD/../apnghandler.cpp \
+    $$PWD/../apngparallel.cpp \
+    $$PWD/../apngpool.cpp \
+    $$PWD/../apngprefetch.cpp \
+    $$PWD/../apngscale.cpp \
+    $$PWD/../apngscanner.cpp \
+    $$PWD/../apngwriter.cpp
+
+HEADERS += \
+    $$PWD/apngsynth.h \
+    $$PWD/../apngbatch.h \
+    $$PWD/../apngblend.h \
+    $$PWD/../apngcache.h \
+    $$PWD/../apngcontext.h \
+    $$PWD/../apngframestore.h \
+    $$PWD/../apnghandler.h \
+    $$PWD/../apngparallel.h \
+    $$PWD/../apngpool.h \
+    $$PWD/../apngprefetch.h \
+    $$PWD/../apngscale.h \
+    $$PWD/../apngscanner.h \
+    $$PWD/../apngwriter.h
+
+include($$PWD/../libapng_static/libapng_static.pri)
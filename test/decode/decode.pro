@@ -0,0 +1,7 @@
+QT += core gui testlib
+CONFIG += testcase
+TARGET = tst_decode
+TEMPLATE = app
+SOURCES += tst_decode.cpp
+
+include(../common.pri)
@@ -0,0 +1,1386 @@
+#include <QBuffer>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QtTest>
+
+#include <atomic>
+
+#include "../../apngcache.h"
+#include "../../apngframestore.h"
+#include "../../apnghandler.h"
+#include "../../apngscale.h"
+#include "../../apngscanner.h"
+#include "../apngsynth.h"
+
+// Every other frame is disposed to PREVIOUS
+static QByteArray makeFile()
+{
+    ApngSynthSpec spec;
+    spec.size       = QSize(48, 40);
+    spec.frames     = 12;
+    spec.disposeOps = {0, 2, 1, 2};
+    spec.blendOps   = {0, 1};
+    return apngSynthesize(spec);
+}
+
+// All frames of the file at `path`, through the shared and disk caches
+static QVector<QImage> decodeFile(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QVector<QImage>();
+    }
+    APNGHandler handler;
+    handler.setDevice(&file);
+    const int count = handler.imageCount();
+    QVector<QImage> frames;
+    QImage frame;
+    while (frames.size() < count && handler.read(&frame)) {
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+// The one file in a disk cache directory
+static QString diskCacheFile(const QString &directory)
+{
+    const QDir dir(directory);
+    const QStringList names = dir.entryList({"*.apngcache"}, QDir::Files);
+    return names.size() == 1 ? dir.filePath(names.first()) : QString();
+}
+
+// All frames, decoded on the calling thread. With a cache budget they are
+// read a second time, from replays of the evicted ones.
+static QVector<QImage> decode(const QByteArray &file, qint64 budget = 0)
+{
+    QByteArray copy = file;
+    QBuffer buffer(&copy);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDecodeThreads(1);
+    handler.setCacheBudget(budget);
+    handler.setDevice(&buffer);
+
+    const int count = handler.imageCount();
+    QVector<QImage> frames;
+    QImage frame;
+    while (frames.size() < count && handler.read(&frame)) {
+        frames.push_back(frame);
+    }
+    if (budget > 0) {
+        frames.clear();
+        for (int i = 0; i < count && handler.jumpToImage(i); i++) {
+            if (!handler.read(&frame)) {
+                break;
+            }
+            frames.push_back(frame);
+        }
+        if (handler.cacheStats().replayedFrames == 0) {
+            return QVector<QImage>();
+        }
+    }
+    return frames;
+}
+
+// The first read after stall() sleeps, so a test can catch the prefetch
+// worker in the middle of a frame
+class StallingBuffer : public QBuffer {
+public:
+    explicit StallingBuffer(QByteArray *data) : QBuffer(data) {}
+
+    void stall() { m_stall = true; }
+    bool isStalled() const { return m_stalled; }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override
+    {
+        if (m_stall.exchange(false)) {
+            m_stalled = true;
+            QThread::msleep(500);
+        }
+        return QBuffer::readData(data, maxSize);
+    }
+
+private:
+    std::atomic<bool> m_stall{false};
+    std::atomic<bool> m_stalled{false};
+};
+
+class TestDecode : public QObject {
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void previousRestoresRect_data();
+    void previousRestoresRect();
+    void pooledSteadyState();
+    void sniff_data();
+    void sniff();
+    void unchangedFrames();
+    void mergedPlayback();
+    void indexed_data();
+    void indexed();
+    void limits_data();
+    void limits();
+    void cancel();
+    void timeout();
+    void firstFrames();
+    void deltaFrames_data();
+    void deltaFrames();
+    void patchesOverBudget();
+    void parallel_data();
+    void parallel();
+    void diskCache_data();
+    void diskCache();
+    void diskMappingOutlivesHandler();
+    void sharedCache();
+    void sharedCacheKey();
+    void sharedCacheEviction();
+    void prefetchWraparound();
+    void prefetchJump();
+    void prefetchCapacity();
+    void decodeStats();
+    void outputTransform_data();
+    void outputTransform();
+    void lazyDecode();
+    void scannedMetadata();
+    void dirtyRects();
+    void mappedFile();
+};
+
+void TestDecode::initTestCase()
+{
+    APNGHandler::setSharedCacheBudget(0);
+}
+
+void TestDecode::previousRestoresRect_data()
+{
+    QTest::addColumn<qint64>("budget");
+
+    QTest::newRow("decoded") << qint64(0);
+    // About two canvases, so nearly every frame is replayed
+    QTest::newRow("replayed") << qint64(2 * 48 * 40 * 4);
+}
+
+// A frame disposed to PREVIOUS leaves the canvas as it was before it, so
+// the next frame matches the one before it outside its own fcTL region
+void TestDecode::previousRestoresRect()
+{
+    QFETCH(qint64, budget);
+    const QByteArray file = makeFile();
+    ApngInfo info;
+    QVERIFY(scanApng(reinterpret_cast<const uchar *>(file.constData()),
+                     file.size(), &info));
+
+    const QVector<QImage> frames = decode(file, budget);
+    QCOMPARE(frames.size(), info.frames.size());
+    int checked = 0;
+    for (int j = 1; j + 1 < frames.size(); j++) {
+        if (info.frames.at(j).disposeOp != 2) {
+            continue;
+        }
+        const ApngFrameInfo &next = info.frames.at(j + 1);
+        const QRect covered(next.x, next.y, next.width, next.height);
+        const QImage &before = frames.at(j - 1);
+        const QImage &after  = frames.at(j + 1);
+        for (int y = 0; y < after.height(); y++) {
+            for (int x = 0; x < after.width(); x++) {
+                if (!covered.contains(x, y)
+                    && after.pixel(x, y) != before.pixel(x, y)) {
+                    QFAIL(qPrintable(QString("frame %1 differs at %2,%3")
+                                         .arg(j + 1)
+                                         .arg(x)
+                                         .arg(y)));
+                }
+            }
+        }
+        checked++;
+    }
+    QVERIFY(checked > 0);
+}
+
+// Once a decode has returned its buffers, decoding the same animation
+// again takes every buffer from the pool
+void TestDecode::pooledSteadyState()
+{
+    const QByteArray file = makeFile();
+    QCOMPARE(decode(file).size(), 12);
+
+    const APNGHandler::BufferPoolStats before = APNGHandler::bufferPoolStats();
+    QCOMPARE(decode(file).size(), 12);
+    const APNGHandler::BufferPoolStats after = APNGHandler::bufferPoolStats();
+    QCOMPARE(after.allocations, before.allocations);
+    QVERIFY(after.reuses > before.reuses);
+    QVERIFY(after.idleBytes <= after.budget);
+
+    // Nothing is kept without a budget
+    APNGHandler::setBufferPoolBudget(0);
+    QCOMPARE(APNGHandler::bufferPoolStats().idleBuffers, 0);
+    QCOMPARE(decode(file).size(), 12);
+    QCOMPARE(APNGHandler::bufferPoolStats().idleBuffers, 0);
+    APNGHandler::setBufferPoolBudget(64 * 1024 * 1024);
+
+    // Nor does playback that replays evicted frames, once warmed up: the
+    // input buffer is kept, canvases come back from the pool
+    QByteArray copy = file;
+    QBuffer buffer(&copy);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDecodeThreads(1);
+    handler.setCacheBudget(2 * 48 * 40 * 4);
+    handler.setDevice(&buffer);
+    QImage frame;
+    quint64 inputAllocations = 0;
+    quint64 poolAllocations  = 0;
+    for (int lap = 0; lap < 3; lap++) {
+        inputAllocations = handler.readStats().allocations;
+        poolAllocations  = APNGHandler::bufferPoolStats().allocations;
+        for (int i = 0; i < 12; i++) {
+            QVERIFY(handler.read(&frame));
+        }
+    }
+    QVERIFY(handler.cacheStats().replayedFrames > 0);
+    QVERIFY(handler.readStats().allocations > 0);
+    QCOMPARE(handler.readStats().allocations, inputAllocations);
+    QCOMPARE(APNGHandler::bufferPoolStats().allocations, poolAllocations);
+}
+
+void TestDecode::sniff_data()
+{
+    QTest::addColumn<QByteArray>("file");
+    QTest::addColumn<int>("kind");
+
+    const QByteArray apng = makeFile();
+    QByteArray png;
+    QBuffer buffer(&png);
+    buffer.open(QIODevice::WriteOnly);
+    QImage(16, 16, QImage::Format_ARGB32).save(&buffer, "PNG");
+
+    QTest::newRow("apng") << apng << int(ApngSniff::Apng);
+    QTest::newRow("png") << png << int(ApngSniff::Png);
+    // IHDR only
+    QTest::newRow("truncated") << apng.left(8 + 25)
+                               << int(ApngSniff::Undecided);
+    QTest::newRow("short") << apng.left(5) << int(ApngSniff::NotPng);
+    QTest::newRow("garbage") << QByteArray(64, 'x') << int(ApngSniff::NotPng);
+}
+
+// Detection answers from the chunk headers and leaves the device as it was
+void TestDecode::sniff()
+{
+    QFETCH(QByteArray, file);
+    QFETCH(int, kind);
+
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    QCOMPARE(int(sniffApng(&buffer)), kind);
+    QCOMPARE(buffer.pos(), qint64(0));
+    QCOMPARE(APNGHandler::isApng(&buffer), kind == int(ApngSniff::Apng));
+    QCOMPARE(APNGHandler::canRead(&buffer), kind != int(ApngSniff::NotPng));
+    QCOMPARE(buffer.pos(), qint64(0));
+
+    // Judged from the top, where decoding starts, wherever the device is
+    const qint64 middle = file.size() / 2;
+    buffer.seek(middle);
+    QCOMPARE(int(sniffApng(&buffer)), kind);
+    QCOMPARE(APNGHandler::canRead(&buffer), kind != int(ApngSniff::NotPng));
+    QCOMPARE(buffer.pos(), middle);
+}
+
+// Pictures held for three frames; the repeats change nothing
+static QByteArray makeHeldFile()
+{
+    ApngSynthSpec spec;
+    spec.size   = QSize(48, 40);
+    spec.frames = 12;
+    spec.hold   = 3;
+    return apngSynthesize(spec);
+}
+
+// Repeats share the pixels of the frame before them
+void TestDecode::unchangedFrames()
+{
+    QByteArray file = makeHeldFile();
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDevice(&buffer);
+    QCOMPARE(handler.imageCount(), 12);
+
+    QVector<QImage> frames;
+    QImage frame;
+    while (frames.size() < 12 && handler.read(&frame)) {
+        frames.push_back(frame);
+    }
+    QCOMPARE(frames.size(), 12);
+    for (int i = 1; i < frames.size(); i++) {
+        const bool repeat = i % 3 != 0;
+        QCOMPARE(frames.at(i).cacheKey() == frames.at(i - 1).cacheKey(),
+                 repeat);
+        QCOMPARE(handler.frameDirtyRect(i).isEmpty(), repeat);
+    }
+    QCOMPARE(handler.cacheStats().sharedFrames, 8);
+}
+
+// Merging returns each picture once, for all of its frames' delays
+void TestDecode::mergedPlayback()
+{
+    QByteArray file = makeHeldFile();
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setMergeUnchangedFrames(true);
+    handler.setDevice(&buffer);
+
+    QImage frame;
+    for (int picture = 0; picture < 4; picture++) {
+        QVERIFY(handler.read(&frame));
+        QCOMPARE(handler.currentImageNumber(), 3 * picture + 3);
+        QCOMPARE(handler.nextImageDelay(), 3 * 40);
+        QVERIFY(!handler.currentImageRect().isEmpty());
+    }
+    // Wraps around like unmerged playback
+    QVERIFY(handler.read(&frame));
+    QCOMPARE(handler.currentImageNumber(), 3);
+}
+
+void TestDecode::indexed_data()
+{
+    QTest::addColumn<QVector<quint8>>("blendOps");
+    QTest::addColumn<qint64>("budget");
+    QTest::addColumn<int>("format");
+
+    // The synthetic palette has every alpha value, which only SOURCE
+    // composites exactly
+    const QVector<quint8> source = {0};
+    const QVector<quint8> over   = {0, 1};
+    QTest::newRow("source") << source << qint64(0)
+                            << int(QImage::Format_Indexed8);
+    QTest::newRow("source-replayed") << source << qint64(2 * 48 * 40)
+                                     << int(QImage::Format_Indexed8);
+    QTest::newRow("over") << over << qint64(0) << int(QImage::Format_ARGB32);
+}
+
+// Indexed frames show what the ARGB32 decode shows
+void TestDecode::indexed()
+{
+    QFETCH(QVector<quint8>, blendOps);
+    QFETCH(qint64, budget);
+    QFETCH(int, format);
+
+    ApngSynthSpec spec;
+    spec.size       = QSize(48, 40);
+    spec.frames     = 9;
+    spec.colorType  = 3;
+    spec.disposeOps = {0, 1, 2};
+    spec.blendOps   = blendOps;
+    QByteArray file = apngSynthesize(spec);
+    const QVector<QImage> expected = decode(file);
+    QCOMPARE(expected.size(), 9);
+
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setOption(QImageIOHandler::ImageFormat,
+                      int(QImage::Format_Indexed8));
+    handler.setCacheBudget(budget);
+    handler.setDevice(&buffer);
+    // Decided once the header is known
+    QCOMPARE(handler.imageCount(), 9);
+    QCOMPARE(handler.option(QImageIOHandler::ImageFormat).toInt(), format);
+
+    // Twice, the second time from replays if there is a budget
+    QImage frame;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < expected.size(); i++) {
+            QVERIFY(handler.jumpToImage(i));
+            QVERIFY(handler.read(&frame));
+            QCOMPARE(int(frame.format()), format);
+            QCOMPARE(frame.convertToFormat(QImage::Format_ARGB32),
+                     expected.at(i));
+        }
+    }
+}
+
+void TestDecode::limits_data()
+{
+    QTest::addColumn<bool>("scanned");
+    QTest::addColumn<qint64>("maxPixels");
+    QTest::addColumn<int>("maxFrames");
+    QTest::addColumn<qint64>("maxBytes");
+    QTest::addColumn<int>("frames");  // read before the error
+    QTest::addColumn<int>("error");
+
+    const qint64 pixels = 48 * 40;
+    // Scanned files are checked before decoding, others by libpng's
+    // callbacks, from the header on
+    for (bool scanned : {true, false}) {
+        const QByteArray path = scanned ? "scanned-" : "libpng-";
+        QTest::newRow(path + "pixels")
+            << scanned << pixels - 1 << 0 << qint64(0) << 0
+            << int(APNGHandler::PixelLimit);
+        QTest::newRow(path + "frames")
+            << scanned << qint64(0) << 5 << qint64(0) << 0
+            << int(APNGHandler::FrameLimit);
+        QTest::newRow(path + "bytes")
+            << scanned << qint64(0) << 0 << 3 * pixels * 4 << 3
+            << int(APNGHandler::ByteLimit);
+        QTest::newRow(path + "within")
+            << scanned << pixels << 12 << 12 * pixels * 4 << 12
+            << int(APNGHandler::NoError);
+    }
+}
+
+// Decoding stops at the first limit with its reason; what was decoded
+// before it stays readable
+void TestDecode::limits()
+{
+    QFETCH(bool, scanned);
+    QFETCH(qint64, maxPixels);
+    QFETCH(int, maxFrames);
+    QFETCH(qint64, maxBytes);
+    QFETCH(int, frames);
+    QFETCH(int, error);
+
+    APNGHandler::DecodeLimits limits;
+    limits.maxPixels = maxPixels;
+    limits.maxFrames = maxFrames;
+    limits.maxBytes  = maxBytes;
+
+    QByteArray file = makeFile();
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDecodeThreads(1);
+    handler.setDecodeLimits(limits);
+    // A device that may still grow is never scanned
+    handler.setOption(QImageIOHandler::IncrementalReading, !scanned);
+    handler.setDevice(&buffer);
+
+    QImage frame;
+    int read = 0;
+    while (read < 12 && handler.read(&frame)) {
+        read++;
+    }
+    QCOMPARE(read, frames);
+    QCOMPARE(int(handler.decodeError()), error);
+
+    // The static decoder fails outright
+    buffer.seek(0);
+    int loopCount = 0;
+    QVector<QImage> all;
+    QVector<int> delays;
+    APNGHandler::DecodeError reason = APNGHandler::NoError;
+    QCOMPARE(APNGHandler::ensureParsed(&buffer, loopCount, all, delays,
+                                       limits, &reason),
+             error == APNGHandler::NoError);
+    QCOMPARE(int(reason), error);
+}
+
+// A cancelled handler keeps what it has and decodes nothing more
+void TestDecode::cancel()
+{
+    QByteArray file = makeFile();
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDecodeThreads(1);
+    handler.setDevice(&buffer);
+
+    QImage frame;
+    QVERIFY(handler.read(&frame));
+    QVERIFY(handler.read(&frame));
+    handler.cancel();
+    QVERIFY(!handler.read(&frame));
+    QCOMPARE(handler.decodeError(), APNGHandler::Cancelled);
+    QVERIFY(handler.jumpToImage(1));
+    QVERIFY(handler.read(&frame));
+
+    // The flag of the static decoder, here set before it starts
+    std::atomic<bool> cancelled{true};
+    APNGHandler::DecodeLimits limits;
+    limits.cancel = &cancelled;
+    buffer.seek(0);
+    int loopCount = 0;
+    QVector<QImage> frames;
+    QVector<int> delays;
+    APNGHandler::DecodeError reason = APNGHandler::NoError;
+    QVERIFY(!APNGHandler::ensureParsed(&buffer, loopCount, frames, delays,
+                                       limits, &reason));
+    QCOMPARE(reason, APNGHandler::Cancelled);
+}
+
+// Far more work than a millisecond allows, stopped in the middle of a
+// frame on the libpng path
+void TestDecode::timeout()
+{
+    ApngSynthSpec spec;
+    spec.size   = QSize(1280, 720);
+    spec.frames = 24;
+    QByteArray file = apngSynthesize(spec);
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+
+    APNGHandler::DecodeLimits limits;
+    limits.timeoutMs = 1;
+    int loopCount    = 0;
+    QVector<QImage> frames;
+    QVector<int> delays;
+    APNGHandler::DecodeError reason = APNGHandler::NoError;
+    APNGHandler::setDefaultDecodeThreads(1);
+    QVERIFY(!APNGHandler::ensureParsed(&buffer, loopCount, frames, delays,
+                                       limits, &reason));
+    APNGHandler::setDefaultDecodeThreads(0);
+    QCOMPARE(reason, APNGHandler::Timeout);
+}
+
+// The first displayed frame of every file in a batch, read no further
+void TestDecode::firstFrames()
+{
+    ApngSynthSpec hidden;
+    hidden.size        = QSize(48, 40);
+    hidden.hiddenFirst = true;
+    ApngSynthSpec palette;
+    palette.size      = QSize(32, 32);
+    palette.colorType = 3;
+    ApngSynthSpec large;
+    large.size = QSize(200, 200);
+    const QVector<QByteArray> files = {
+        makeFile(), apngSynthesize(hidden), apngSynthesize(palette),
+        QByteArray("not a png"), apngSynthesize(large)};
+
+    APNGHandler::DecodeLimits limits;
+    limits.maxPixels = 100 * 100;
+    APNGHandler::setDefaultDecodeLimits(limits);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QStringList paths;
+    QVector<QByteArray> copies = files;
+    QVector<QBuffer *> buffers;
+    QVector<QIODevice *> devices;
+    for (int i = 0; i < files.size(); i++) {
+        paths.push_back(dir.filePath(QString::number(i) + ".png"));
+        QFile file(paths.last());
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        file.write(files.at(i));
+
+        buffers.push_back(new QBuffer(&copies[i]));
+        buffers.last()->open(QIODevice::ReadOnly);
+        devices.push_back(buffers.last());
+    }
+
+    APNGHandler::BatchStats stats;
+    const QVector<APNGHandler::FirstFrame> fromDevices
+        = APNGHandler::firstFrames(devices, 2, &stats);
+    const QVector<APNGHandler::FirstFrame> fromPaths
+        = APNGHandler::firstFrames(paths);
+    APNGHandler::setDefaultDecodeLimits(APNGHandler::DecodeLimits());
+
+    QCOMPARE(stats.files, files.size());
+    QCOMPARE(stats.failures, 2);
+    QCOMPARE(stats.threads, 2);
+    QVERIFY(stats.filesPerSecond > 0);
+    // libpng paused after the first frame of each
+    QVERIFY(stats.bytesRead < files.at(0).size() + files.at(1).size()
+                                  + files.at(2).size());
+    qDeleteAll(buffers);
+
+    QCOMPARE(fromDevices.size(), files.size());
+    QCOMPARE(fromPaths.size(), files.size());
+    for (int i = 0; i < 3; i++) {
+        const QImage expected = decode(files.at(i)).first();
+        QCOMPARE(fromDevices.at(i).error, APNGHandler::NoError);
+        QCOMPARE(fromDevices.at(i).image, expected);
+        QCOMPARE(fromPaths.at(i).image, expected);
+    }
+    QCOMPARE(fromDevices.at(3).error, APNGHandler::InvalidData);
+    QCOMPARE(fromDevices.at(4).error, APNGHandler::PixelLimit);
+    QVERIFY(fromPaths.at(4).image.isNull());
+}
+
+void TestDecode::deltaFrames_data()
+{
+    QTest::addColumn<QByteArray>("file");
+    QTest::addColumn<qint64>("budget");
+
+    ApngSynthSpec palette;
+    palette.size       = QSize(40, 32);
+    palette.frames     = 20;
+    palette.colorType  = 3;
+    palette.disposeOps = {0, 1, 2};
+    palette.blendOps   = {1, 0};
+    for (const QByteArray &name : {QByteArray("ops"), QByteArray("held"),
+                                   QByteArray("palette")}) {
+        const QByteArray file = name == "ops"    ? makeFile()
+                                : name == "held" ? makeHeldFile()
+                                                 : apngSynthesize(palette);
+        QTest::newRow(name + "-unlimited") << file << qint64(0);
+        // The handler turns the budget off in delta mode, whatever it is
+        QTest::newRow(name + "-tight") << file << qint64(16 * 16 * 4);
+    }
+}
+
+// DeltaFrames hands out the frames FullFrames does, in any order and
+// whatever the budget
+void TestDecode::deltaFrames()
+{
+    QFETCH(QByteArray, file);
+    QFETCH(qint64, budget);
+    const QVector<QImage> expected = decode(file);
+    QVERIFY(!expected.isEmpty());
+
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDecodeThreads(1);
+    handler.setStorageMode(APNGHandler::DeltaFrames);
+    handler.setCheckpointInterval(4);
+    handler.setCacheBudget(budget);
+    handler.setDevice(&buffer);
+    QCOMPARE(handler.imageCount(), expected.size());
+
+    QImage frame;
+    for (int i = 0; i < expected.size(); i++) {
+        QVERIFY(handler.read(&frame));
+        QCOMPARE(frame, expected.at(i));
+    }
+    QVERIFY(handler.cacheStats().patches > 0);
+
+    // Backwards, every rebuild starts from an earlier full frame
+    for (int i = expected.size() - 1; i >= 0; i--) {
+        QVERIFY(handler.jumpToImage(i));
+        QVERIFY(handler.read(&frame));
+        QCOMPARE(frame, expected.at(i));
+    }
+    // Nothing was decoded twice
+    QCOMPARE(handler.cacheStats().replayedFrames, quint64(0));
+}
+
+// Frames 0 and 3 are full, the others patches on the frame before them.
+// A budget smaller than any of them must still leave every frame buildable.
+void TestDecode::patchesOverBudget()
+{
+    QVector<QImage> expected;
+    QImage canvas(16, 16, QImage::Format_ARGB32);
+    canvas.fill(Qt::transparent);
+    for (int i = 0; i < 6; i++) {
+        canvas = canvas.copy();
+        const QRect dirty(i * 2, i, 4, 4);
+        for (int y = dirty.top(); y <= dirty.bottom(); y++) {
+            for (int x = dirty.left(); x <= dirty.right(); x++) {
+                canvas.setPixel(x, y, qRgba(i * 40, 255 - i * 40, i, 255));
+            }
+        }
+        expected.push_back(canvas);
+    }
+
+    ApngFrameStore store;
+    store.setBudget(1);
+    store.addCheckpoint(0, QImage(16, 16, QImage::Format_ARGB32));
+    for (int i = 0; i < expected.size(); i++) {
+        if (i % 3 == 0) {
+            store.insert(i, expected.at(i));
+        } else {
+            store.insertPatch(i, expected.at(i), QRect(i * 2, i, 4, 4));
+        }
+    }
+    QVERIFY(store.stats().evictions > 0);
+    QCOMPARE(store.stats().patches, 4);
+
+    for (int i : {5, 1, 4, 2, 0, 3}) {
+        QImage frame;
+        QVERIFY2(store.find(i, &frame), QByteArray::number(i));
+        QCOMPARE(frame, expected.at(i));
+    }
+}
+
+void TestDecode::parallel_data()
+{
+    QTest::addColumn<QByteArray>("file");
+
+    struct Row {
+        const char *name;
+        int frames, bitDepth, colorType, hold;
+        bool hiddenFirst;
+        QVector<quint8> dispose, blend;
+    };
+    const Row rows[] = {
+        {"rgba8-ops", 24, 8, 6, 1, false, {0, 2, 1, 2}, {0, 1}},
+        {"rgba8-hidden", 9, 8, 6, 1, true, {1}, {1}},
+        {"rgba16-over", 10, 16, 6, 1, false, {0}, {1}},
+        {"rgb8-previous", 12, 8, 2, 1, false, {2, 0}, {0}},
+        {"graya8-background", 12, 8, 4, 1, false, {1}, {1}},
+        {"palette-held", 18, 8, 3, 3, false, {0, 1}, {1, 0}},
+        {"single", 1, 8, 6, 1, false, {0}, {0}},
+    };
+    for (const Row &r : rows) {
+        ApngSynthSpec spec;
+        spec.size        = QSize(56, 36);
+        spec.frames      = r.frames;
+        spec.bitDepth    = r.bitDepth;
+        spec.colorType   = r.colorType;
+        spec.hold        = r.hold;
+        spec.hiddenFirst = r.hiddenFirst;
+        spec.disposeOps  = r.dispose;
+        spec.blendOps    = r.blend;
+        QTest::newRow(r.name) << apngSynthesize(spec);
+    }
+}
+
+// Decoding frames on worker threads changes nothing about them
+void TestDecode::parallel()
+{
+    QFETCH(QByteArray, file);
+
+    QVector<QImage> frames[2];
+    QVector<int> delays[2];
+    for (int pass = 0; pass < 2; pass++) {
+        QBuffer buffer(&file);
+        buffer.open(QIODevice::ReadOnly);
+        APNGHandler handler;
+        handler.setDecodeThreads(pass == 0 ? 1 : 4);
+        handler.setDevice(&buffer);
+        QImage frame;
+        for (int i = 0; i < handler.imageCount(); i++) {
+            QVERIFY(handler.read(&frame));
+            frames[pass].push_back(frame);
+            delays[pass].push_back(handler.nextImageDelay());
+        }
+        QCOMPARE(handler.decodeError(), APNGHandler::NoError);
+    }
+    QVERIFY(!frames[0].isEmpty());
+    QCOMPARE(frames[1].size(), frames[0].size());
+    for (int i = 0; i < frames[0].size(); i++) {
+        QCOMPARE(frames[1].at(i), frames[0].at(i));
+        QCOMPARE(delays[1].at(i), delays[0].at(i));
+    }
+}
+
+void TestDecode::diskCache_data()
+{
+    QTest::addColumn<QString>("damage");
+    QTest::addColumn<bool>("hit");
+
+    QTest::newRow("intact") << "" << true;
+    QTest::newRow("truncated") << "truncated" << false;
+    QTest::newRow("version") << "version" << false;
+    QTest::newRow("header") << "header" << false;
+    // Only found out when the frame is handed out
+    QTest::newRow("pixels") << "pixels" << true;
+}
+
+// A second reader maps what the first one decoded, unless the file is
+// damaged or from another version; then it decodes and writes it again
+void TestDecode::diskCache()
+{
+    QFETCH(QString, damage);
+    QFETCH(bool, hit);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path    = dir.filePath("anim.png");
+    const QString cache   = dir.filePath("cache");
+    const QByteArray data = makeFile();
+    {
+        QFile file(path);
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        file.write(data);
+    }
+    const QVector<QImage> expected = decode(data);
+
+    APNGHandler::setDiskCacheDirectory(cache);
+    QCOMPARE(decodeFile(path), expected);
+    APNGHandler::waitForDiskCache();
+    const QString cachePath = diskCacheFile(cache);
+    QVERIFY(!cachePath.isEmpty());
+
+    {
+        QFile file(cachePath);
+        QVERIFY(file.open(QIODevice::ReadWrite));
+        const qint64 size = file.size();
+        QByteArray bytes  = file.readAll();
+        if (damage == "truncated") {
+            bytes.truncate(size - 100);
+        }
+        else if (damage == "version") {
+            // Offset 8, as the version before this one wrote it
+            const quint32 version = 2;
+            memcpy(bytes.data() + 8, &version, sizeof(version));
+        }
+        else if (damage == "header") {
+            bytes[44] = char(bytes.at(44) ^ 0x10);  // the header CRC
+        }
+        else if (damage == "pixels") {
+            bytes[size - 100] = char(bytes.at(size - 100) ^ 0x10);
+        }
+        file.resize(0);
+        file.seek(0);
+        file.write(bytes);
+    }
+
+    const APNGHandler::SharedCacheStats before
+        = APNGHandler::sharedCacheStats();
+    QCOMPARE(decodeFile(path), expected);
+    APNGHandler::waitForDiskCache();
+    const APNGHandler::SharedCacheStats after
+        = APNGHandler::sharedCacheStats();
+    APNGHandler::setDiskCacheDirectory(QString());
+
+    QCOMPARE(after.diskHits - before.diskHits, quint64(hit ? 1 : 0));
+    QCOMPARE(after.diskWrites - before.diskWrites,
+             quint64(damage.isEmpty() ? 0 : 1));
+    if (!damage.isEmpty()) {
+        // Replaced by an intact file again
+        APNGHandler::setDiskCacheDirectory(cache);
+        QCOMPARE(decodeFile(path), expected);
+        APNGHandler::setDiskCacheDirectory(QString());
+        QCOMPARE(APNGHandler::sharedCacheStats().diskHits,
+                 after.diskHits + 1);
+    }
+}
+
+// Mapped frames keep the mapping, not the handler that made it
+void TestDecode::diskMappingOutlivesHandler()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path    = dir.filePath("anim.png");
+    const QByteArray data = makeFile();
+    {
+        QFile file(path);
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        file.write(data);
+    }
+    const QVector<QImage> expected = decode(data);
+
+    const QString cache = dir.filePath("cache");
+    APNGHandler::setDiskCacheDirectory(cache);
+    decodeFile(path);
+    APNGHandler::waitForDiskCache();
+    const quint64 diskHits = APNGHandler::sharedCacheStats().diskHits;
+    // The handler and its device are gone once this returns
+    const QVector<QImage> mapped = decodeFile(path);
+    APNGHandler::setDiskCacheDirectory(QString());
+    APNGHandler::clearSharedCache();
+    QCOMPARE(APNGHandler::sharedCacheStats().diskHits, diskHits + 1);
+    // So is the file name, where unlinking keeps the mapping
+#ifndef Q_OS_WIN
+    QVERIFY(QFile::remove(diskCacheFile(cache)));
+#endif
+
+    QCOMPARE(mapped, expected);
+}
+
+// A second reader of the same data gets the frames of the first one
+void TestDecode::sharedCache()
+{
+    APNGHandler::setSharedCacheBudget(8 * 1024 * 1024);
+    APNGHandler::clearSharedCache();
+    const QByteArray file = makeFile();
+    const APNGHandler::SharedCacheStats before
+        = APNGHandler::sharedCacheStats();
+    const QVector<QImage> first  = decode(file);
+    const QVector<QImage> second = decode(file);
+    const APNGHandler::SharedCacheStats after
+        = APNGHandler::sharedCacheStats();
+    APNGHandler::setSharedCacheBudget(0);
+
+    QCOMPARE(after.misses - before.misses, quint64(1));
+    QCOMPARE(after.hits - before.hits, quint64(1));
+    QCOMPARE(after.insertions - before.insertions, quint64(1));
+    QCOMPARE(second.size(), first.size());
+    for (int i = 0; i < first.size(); i++) {
+        QCOMPARE(second.at(i).cacheKey(), first.at(i).cacheKey());
+    }
+}
+
+// Frames made with other output settings are not the same frames
+void TestDecode::sharedCacheKey()
+{
+    QByteArray file = makeFile();
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    const QImage::Format argb = QImage::Format_ARGB32;
+    const QByteArray plain
+        = ApngAnimationCache::key(&buffer, argb, QRect(), QSize());
+    QVERIFY(!plain.isEmpty());
+    QCOMPARE(ApngAnimationCache::key(&buffer, argb, QRect(), QSize()), plain);
+    const QByteArray others[] = {
+        ApngAnimationCache::key(&buffer, QImage::Format_ARGB32_Premultiplied,
+                                QRect(), QSize()),
+        ApngAnimationCache::key(&buffer, argb, QRect(0, 0, 8, 8), QSize()),
+        ApngAnimationCache::key(&buffer, argb, QRect(), QSize(24, 20)),
+    };
+    for (const QByteArray &key : others) {
+        QVERIFY(key != plain);
+    }
+
+    // Through the handler options: a miss, then a hit
+    APNGHandler::setSharedCacheBudget(8 * 1024 * 1024);
+    APNGHandler::clearSharedCache();
+    decode(file);
+    for (int option = 0; option < 3; option++) {
+        for (int pass = 0; pass < 2; pass++) {
+            const APNGHandler::SharedCacheStats before
+                = APNGHandler::sharedCacheStats();
+            buffer.seek(0);
+            APNGHandler handler;
+            handler.setDevice(&buffer);
+            QImage frame;
+            if (option == 0) {
+                frame = QImage(1, 1, QImage::Format_ARGB32_Premultiplied);
+            }
+            else if (option == 1) {
+                handler.setOption(QImageIOHandler::ClipRect,
+                                  QRect(0, 0, 8, 8));
+            }
+            else {
+                handler.setOption(QImageIOHandler::ScaledSize, QSize(24, 20));
+            }
+            while (handler.read(&frame)
+                   && handler.currentImageNumber() < handler.imageCount()) {
+            }
+            const APNGHandler::SharedCacheStats after
+                = APNGHandler::sharedCacheStats();
+            QCOMPARE(after.misses - before.misses, quint64(pass == 0));
+            QCOMPARE(after.hits - before.hits, quint64(pass == 1));
+        }
+    }
+    APNGHandler::setSharedCacheBudget(0);
+}
+
+// Least recently used animations go first, the rest stays in the budget
+void TestDecode::sharedCacheEviction()
+{
+    QVector<QByteArray> files;
+    for (int i = 0; i < 4; i++) {
+        ApngSynthSpec spec;
+        spec.size   = QSize(32 + i, 32);
+        spec.frames = 4;
+        files.push_back(apngSynthesize(spec));
+    }
+    // Room for three of them, whose frames all differ
+    const qint64 budget = 3 * 4 * 35 * 32 * 4;
+    APNGHandler::setSharedCacheBudget(budget);
+    APNGHandler::clearSharedCache();
+    decode(files.at(0));
+    decode(files.at(1));
+    decode(files.at(2));
+    decode(files.at(0));  // most recent now, 1 is the oldest
+    const APNGHandler::SharedCacheStats full
+        = APNGHandler::sharedCacheStats();
+    decode(files.at(3));
+    const APNGHandler::SharedCacheStats evicted
+        = APNGHandler::sharedCacheStats();
+
+    QCOMPARE(full.entries, 3);
+    QCOMPARE(evicted.evictions - full.evictions, quint64(1));
+    QCOMPARE(evicted.entries, 3);
+    QVERIFY(evicted.bytes <= budget);
+    QCOMPARE(evicted.budget, budget);
+    for (int i : {0, 2, 3, 1}) {
+        const quint64 hits = APNGHandler::sharedCacheStats().hits;
+        decode(files.at(i));
+        QCOMPARE(APNGHandler::sharedCacheStats().hits - hits,
+                 quint64(i != 1));
+    }
+    APNGHandler::setSharedCacheBudget(0);
+}
+
+// The ring wraps around with playback and hands out the decoded frames
+void TestDecode::prefetchWraparound()
+{
+    QByteArray file = makeFile();
+    const QVector<QImage> expected = decode(file);
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDecodeThreads(1);
+    handler.setPrefetch(3);
+    handler.setDevice(&buffer);
+
+    QImage frame;
+    QVERIFY(handler.read(&frame));
+    QCOMPARE(frame, expected.at(0));
+    // Enough for the worker to fill the ring
+    QThread::msleep(200);
+    const int reads = 2 * expected.size() + 1;
+    for (int i = 1; i < reads; i++) {
+        QVERIFY(handler.read(&frame));
+        QCOMPARE(frame, expected.at(i % expected.size()));
+    }
+
+    const APNGHandler::PrefetchStats stats = handler.prefetchStats();
+    QCOMPARE(stats.capacity, 3);
+    QCOMPARE(stats.hits + stats.underruns, quint64(reads));
+    QVERIFY(stats.hits >= 3);
+    QVERIFY(stats.underruns >= 1);  // the first read
+    QVERIFY(stats.waitUs >= 0);
+}
+
+// A jump while the worker decodes a frame after it: that frame is dropped
+// and the worker starts over at the new position
+void TestDecode::prefetchJump()
+{
+    // Big enough frames for the decode to read the device again midway
+    ApngSynthSpec spec;
+    spec.size   = QSize(256, 256);
+    spec.frames = 24;
+    QByteArray file                = apngSynthesize(spec);
+    const QVector<QImage> expected = decode(file);
+    StallingBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDecodeThreads(1);
+    handler.setPrefetch(spec.frames);
+    handler.setDevice(&buffer);
+
+    QImage frame;
+    QVERIFY(handler.read(&frame));
+    QCOMPARE(frame, expected.at(0));
+    buffer.stall();
+    QTRY_VERIFY(buffer.isStalled());
+    const quint64 underruns = handler.prefetchStats().underruns;
+
+    // Frame 0 went out already, the ring only holds frames after it
+    QVERIFY(handler.jumpToImage(0));
+    for (int i = 0; i < expected.size(); i++) {
+        QVERIFY(handler.read(&frame));
+        QCOMPARE(frame, expected.at(i));
+    }
+    QVERIFY(handler.prefetchStats().underruns > underruns);
+}
+
+// The byte cap limits the ring; below one canvas nothing is prefetched
+void TestDecode::prefetchCapacity()
+{
+    const QByteArray file          = makeFile();
+    const QVector<QImage> expected = decode(file);
+    const qint64 canvasBytes       = 48 * 40 * 4;
+    for (qint64 bytes : {canvasBytes * 5 / 2, canvasBytes - 1}) {
+        QByteArray copy = file;
+        QBuffer buffer(&copy);
+        buffer.open(QIODevice::ReadOnly);
+        APNGHandler handler;
+        handler.setDecodeThreads(1);
+        handler.setPrefetch(8, bytes);
+        handler.setDevice(&buffer);
+
+        QImage frame;
+        for (int i = 0; i < expected.size(); i++) {
+            QVERIFY(handler.read(&frame));
+            QCOMPARE(frame, expected.at(i));
+        }
+        const APNGHandler::PrefetchStats stats = handler.prefetchStats();
+        if (bytes > canvasBytes) {
+            QCOMPARE(stats.capacity, 2);
+            QCOMPARE(stats.hits + stats.underruns, quint64(expected.size()));
+        }
+        else {
+            QCOMPARE(stats.capacity, 0);
+            QCOMPARE(stats.hits + stats.underruns, quint64(0));
+        }
+    }
+}
+
+// Nothing without stats enabled; with them, one report per decode that
+// adds up with the file
+void TestDecode::decodeStats()
+{
+    QByteArray file  = makeFile();
+    const int canvas = 48 * 40 * 4;
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    {
+        APNGHandler handler;
+        handler.setDecodeThreads(1);
+        handler.setDevice(&buffer);
+        QImage frame;
+        for (int i = 0; i < 12; i++) {
+            QVERIFY(handler.read(&frame));
+        }
+        const APNGHandler::DecodeStats stats = handler.decodeStats();
+        QCOMPARE(stats.bytesRead, qint64(0));
+        QCOMPARE(stats.frames, 0);
+        QCOMPARE(stats.peakFrameBytes, qint64(0));
+        QCOMPARE(stats.ioNs + stats.inflateNs + stats.rowNs
+                     + stats.compositeNs + stats.disposeNs + stats.copyNs,
+                 qint64(0));
+    }
+
+    int reports = 0;
+    APNGHandler::DecodeStats reported;
+    APNGHandler::setDecodeStatsCallback(
+        [&](QIODevice *device, const APNGHandler::DecodeStats &stats) {
+            QCOMPARE(device, static_cast<QIODevice *>(&buffer));
+            reported = stats;
+            reports++;
+        });
+    buffer.seek(0);
+    APNGHandler handler;
+    handler.setDecodeThreads(1);
+    handler.setDevice(&buffer);
+    QImage frame;
+    // Twice around; the second time comes from the frame store
+    for (int i = 0; i < 24; i++) {
+        QVERIFY(handler.read(&frame));
+    }
+    APNGHandler::setDecodeStatsCallback(APNGHandler::DecodeStatsCallback());
+
+    QCOMPARE(reports, 1);
+    const APNGHandler::DecodeStats stats = handler.decodeStats();
+    QCOMPARE(stats.frames, 12);
+    QCOMPARE(stats.bytesRead, qint64(file.size()));
+    QVERIFY(stats.peakFrameBytes >= canvas);
+    QVERIFY(stats.peakFrameBytes <= 12 * canvas);
+    QVERIFY(stats.inflateNs > 0);
+    QVERIFY(stats.compositeNs > 0);
+    QCOMPARE(reported.frames, stats.frames);
+    QCOMPARE(reported.bytesRead, stats.bytesRead);
+    QCOMPARE(reported.peakFrameBytes, stats.peakFrameBytes);
+}
+
+void TestDecode::outputTransform_data()
+{
+    QTest::addColumn<QRect>("clip");
+    QTest::addColumn<QSize>("scaled");
+
+    QTest::newRow("clip") << QRect(5, 3, 30, 25) << QSize();
+    QTest::newRow("down") << QRect() << QSize(24, 20);
+    QTest::newRow("up") << QRect() << QSize(96, 80);
+    QTest::newRow("odd") << QRect() << QSize(31, 17);
+    QTest::newRow("clip-scaled") << QRect(8, 4, 32, 32) << QSize(20, 20);
+}
+
+// Frames read through ClipRect and ScaledSize are the full frames scaled
+// as a whole, and frameDirtyRect() tells where consecutive ones differ
+void TestDecode::outputTransform()
+{
+    QFETCH(QRect, clip);
+    QFETCH(QSize, scaled);
+
+    QByteArray file = makeFile();
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler full;
+    full.setDecodeThreads(1);
+    full.setDevice(&buffer);
+    QVector<QImage> canvases;
+    QVector<QRect> canvasDirty;
+    QImage frame;
+    for (int i = 0; i < 12; i++) {
+        QVERIFY(full.read(&frame));
+        canvases.push_back(frame);
+        canvasDirty.push_back(full.frameDirtyRect(i));
+    }
+
+    QByteArray copy = file;
+    QBuffer output(&copy);
+    output.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDecodeThreads(1);
+    if (!clip.isNull()) {
+        handler.setOption(QImageIOHandler::ClipRect, clip);
+    }
+    if (scaled.isValid()) {
+        handler.setOption(QImageIOHandler::ScaledSize, scaled);
+    }
+    handler.setDevice(&output);
+
+    const QRect source = clip.isNull() ? QRect(0, 0, 48, 40) : clip;
+    const QSize size   = scaled.isValid() ? scaled : clip.size();
+    const QRect bounds(QPoint(0, 0), size);
+    QImage previous;
+    for (int i = 0; i < 12; i++) {
+        QVERIFY(handler.read(&frame));
+        QImage expected(size, canvases.at(i).format());
+        apngScale(canvases.at(i), source, &expected, bounds);
+        QCOMPARE(frame.size(), size);
+        QCOMPARE(frame, expected);
+
+        const QRect dirty = handler.frameDirtyRect(i);
+        QCOMPARE(dirty, apngScaledRect(source, size, canvasDirty.at(i)));
+        QVERIFY(bounds.contains(dirty) || dirty.isEmpty());
+        if (i == 0) {
+            QCOMPARE(dirty, bounds);
+        }
+        else {
+            for (int y = 0; y < size.height(); y++) {
+                for (int x = 0; x < size.width(); x++) {
+                    if (!dirty.contains(x, y)) {
+                        QCOMPARE(frame.pixel(x, y), previous.pixel(x, y));
+                    }
+                }
+            }
+        }
+        previous = frame;
+    }
+}
+
+// read() decodes up to the frame it returns and no further
+void TestDecode::lazyDecode()
+{
+    QByteArray file                = makeFile();
+    const QVector<QImage> expected = decode(file);
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDecodeThreads(1);
+    handler.setDevice(&buffer);
+
+    QImage frame;
+    QVERIFY(handler.read(&frame));
+    QCOMPARE(frame, expected.at(0));
+    QCOMPARE(handler.cacheStats().cachedFrames, 1);
+    QVERIFY(handler.readStats().bytesFed < file.size());
+
+    // Later frames decode on from the canvas so far
+    QVERIFY(handler.jumpToImage(5));
+    QVERIFY(handler.read(&frame));
+    QCOMPARE(frame, expected.at(5));
+    QCOMPARE(handler.cacheStats().cachedFrames, 6);
+    QVERIFY(handler.readStats().bytesFed < file.size());
+    QCOMPARE(handler.cacheStats().replayedFrames, quint64(0));
+}
+
+// Delays and loop count come from the scan, before anything is decoded,
+// and agree with what decoding finds
+void TestDecode::scannedMetadata()
+{
+    ApngSynthSpec spec;
+    spec.size      = QSize(32, 24);
+    spec.frames    = 8;
+    spec.plays     = 3;
+    spec.delayNums = {4, 7, 1, 33};
+    spec.delayDens = {100, 0, 1000, 1000};  // 0 means 1/100 s
+    const QVector<int> delays = {40, 70, 1, 33, 40, 70, 1, 33};
+    QByteArray file           = apngSynthesize(spec);
+
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    ApngInfo info;
+    QVERIFY(scanApng(&buffer, &info));
+    QCOMPARE(info.frames.size(), spec.frames);
+    QCOMPARE(info.loopCount(), 2);
+    for (int i = 0; i < spec.frames; i++) {
+        QCOMPARE(info.frames.at(i).delayUs, qint64(delays.at(i)) * 1000);
+    }
+    QCOMPARE(info.frames.at(1).delayDen, quint16(0));
+
+    APNGHandler handler;
+    handler.setDecodeThreads(1);
+    handler.setDevice(&buffer);
+    QCOMPARE(handler.imageCount(), spec.frames);
+    QCOMPARE(handler.loopCount(), 2);
+    QCOMPARE(handler.nextImageDelay(), delays.at(0));
+    // jumpToImage(i + 1) makes frame i the one last read
+    for (int i = 0; i + 1 < spec.frames; i++) {
+        QVERIFY(handler.jumpToImage(i + 1));
+        QCOMPARE(handler.nextImageDelay(), delays.at(i));
+    }
+    QCOMPARE(handler.readStats().bytesFed, qint64(0));
+    QCOMPARE(handler.cacheStats().cachedFrames, 0);
+
+    QVERIFY(handler.jumpToImage(0));
+    QImage frame;
+    for (int i = 0; i < spec.frames; i++) {
+        QVERIFY(handler.read(&frame));
+        QCOMPARE(handler.nextImageDelay(), delays.at(i));
+    }
+    QCOMPARE(handler.loopCount(), 2);
+}
+
+// fcTL region of each frame plus what the previous frame's dispose op
+// touched, known from the scan already; outside it nothing changes
+void TestDecode::dirtyRects()
+{
+    // makeFile(): 48x40, disposeOps {0, 2, 1, 2}, a moving quarter
+    auto fctl = [](int i) {
+        return i == 0 ? QRect(0, 0, 48, 40)
+                      : QRect((i * 7) % 25, (i * 5) % 21, 24, 20);
+    };
+    QVector<QRect> expected = {QRect(0, 0, 48, 40)};
+    for (int i = 1; i < 12; i++) {
+        const int previousDispose = (i - 1) % 4 == 0 ? 0 : 1;
+        expected.push_back(previousDispose ? fctl(i) | fctl(i - 1)
+                                           : fctl(i));
+    }
+
+    QByteArray file = makeFile();
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDecodeThreads(1);
+    handler.setDevice(&buffer);
+    for (int i = 0; i < 12; i++) {
+        QCOMPARE(handler.frameDirtyRect(i), expected.at(i));
+    }
+    QCOMPARE(handler.cacheStats().cachedFrames, 0);
+
+    QImage previous;
+    QImage frame;
+    for (int i = 0; i < 12; i++) {
+        QVERIFY(handler.read(&frame));
+        QCOMPARE(handler.frameDirtyRect(i), expected.at(i));
+        if (i == 0) {
+            previous = frame;
+            continue;
+        }
+        for (int y = 0; y < 40; y++) {
+            for (int x = 0; x < 48; x++) {
+                if (!expected.at(i).contains(x, y)) {
+                    QCOMPARE(frame.pixel(x, y), previous.pixel(x, y));
+                }
+            }
+        }
+        previous = frame;
+    }
+    // Frame 0 follows the last one when looping
+    QCOMPARE(handler.frameDirtyRect(12), expected.at(0));
+}
+
+// A QFile is decoded straight from its mapping, a QBuffer through reads;
+// the frames are the same
+void TestDecode::mappedFile()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path = dir.filePath("anim.png");
+    QByteArray data    = makeFile();
+    {
+        QFile file(path);
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        file.write(data);
+    }
+
+    QVector<QImage> frames[2];
+    APNGHandler::ReadStats stats[2];
+    for (int pass = 0; pass < 2; pass++) {
+        QFile file(path);
+        QBuffer buffer(&data);
+        QIODevice *device = pass == 0 ? static_cast<QIODevice *>(&file)
+                                      : static_cast<QIODevice *>(&buffer);
+        QVERIFY(device->open(QIODevice::ReadOnly));
+        APNGHandler handler;
+        handler.setDecodeThreads(1);
+        handler.setDevice(device);
+        QImage frame;
+        for (int i = 0; i < 12; i++) {
+            QVERIFY(handler.read(&frame));
+            frames[pass].push_back(frame);
+        }
+        stats[pass] = handler.readStats();
+    }
+
+    QVERIFY(stats[0].mapped);
+    QCOMPARE(stats[0].reads, quint64(0));
+    QCOMPARE(stats[0].allocations, quint64(0));
+    QVERIFY(!stats[1].mapped);
+    QVERIFY(stats[1].reads > 0);
+    QCOMPARE(stats[0].bytesFed, stats[1].bytesFed);
+    QCOMPARE(frames[0], frames[1]);
+}
+
+QTEST_MAIN(TestDecode)
+#include "tst_decode.moc"
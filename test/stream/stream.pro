@@ -0,0 +1,7 @@
+QT += core gui testlib
+CONFIG += testcase
+TARGET = tst_stream
+TEMPLATE = app
+SOURCES += tst_stream.cpp
+
+include(../common.pri)
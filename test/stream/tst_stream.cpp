@@ -0,0 +1,244 @@
+#include <QBuffer>
+#include <QtEndian>
+#include <QtTest>
+
+#include "../../apnghandler.h"
+#include "../apngsynth.h"
+
+// Sequential device that only has what was fed so far, like a socket or
+// a network reply
+class Pipe : public QIODevice {
+public:
+    Pipe()
+    {
+        open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+    }
+
+    void feed(const QByteArray &bytes)
+    {
+        m_data += bytes;
+        emit readyRead();
+    }
+
+    bool isSequential() const override
+    {
+        return true;
+    }
+    qint64 bytesAvailable() const override
+    {
+        return m_data.size() + QIODevice::bytesAvailable();
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override
+    {
+        const int n = int(qMin<qint64>(maxSize, m_data.size()));
+        memcpy(data, m_data.constData(), size_t(n));
+        m_data.remove(0, n);
+        return n;
+    }
+    qint64 writeData(const char *, qint64) override
+    {
+        return -1;
+    }
+
+private:
+    QByteArray m_data;
+};
+
+static QByteArray makeFile(int colorType)
+{
+    ApngSynthSpec spec;
+    spec.size       = QSize(48, 40);
+    spec.frames     = 9;
+    spec.colorType  = colorType;
+    spec.disposeOps = {0, 1, 2};
+    spec.blendOps   = {0, 1};
+    return apngSynthesize(spec);
+}
+
+// All frames of a complete file
+static QVector<QImage> referenceFrames(const QByteArray &file)
+{
+    QByteArray copy = file;
+    QBuffer buffer(&copy);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDevice(&buffer);
+    QVector<QImage> frames;
+    QImage frame;
+    const int count = handler.imageCount();
+    while (frames.size() < count && handler.read(&frame)) {
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+// Offset just past chunk number `n` (the signature is not a chunk)
+static int chunkEnd(const QByteArray &file, int n)
+{
+    int offset = 8;
+    for (int i = 0; i <= n; i++) {
+        offset += 12
+                  + int(qFromBigEndian<quint32>(
+                      reinterpret_cast<const uchar *>(file.constData())
+                      + offset));
+    }
+    return offset;
+}
+
+// Chunk indices of the last data chunk of every frame
+static QVector<int> frameDataChunks(const QByteArray &file)
+{
+    QVector<int> chunks;
+    int offset = 8;
+    for (int i = 0; offset < file.size(); i++) {
+        const char *type = file.constData() + offset + 4;
+        if (memcmp(type, "IDAT", 4) == 0 || memcmp(type, "fdAT", 4) == 0) {
+            chunks.push_back(i);
+        }
+        offset = chunkEnd(file, i);
+    }
+    return chunks;
+}
+
+class TestStream : public QObject {
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void trickle_data();
+    void trickle();
+    void frameOnArrival();
+    void growingBuffer();
+    void closedEarly();
+};
+
+void TestStream::initTestCase()
+{
+    APNGHandler::setSharedCacheBudget(0);
+}
+
+void TestStream::trickle_data()
+{
+    QTest::addColumn<int>("colorType");
+    QTest::addColumn<int>("step");
+
+    for (int colorType : {6, 3}) {
+        for (int step : {1, 7, 100, 4096}) {
+            QTest::newRow(qPrintable(QString("type%1-step%2")
+                                         .arg(colorType)
+                                         .arg(step)))
+                << colorType << step;
+        }
+    }
+}
+
+// Bytes arrive `step` at a time; every frame comes out once, unchanged
+void TestStream::trickle()
+{
+    QFETCH(int, colorType);
+    QFETCH(int, step);
+    const QByteArray file         = makeFile(colorType);
+    const QVector<QImage> expected = referenceFrames(file);
+    QCOMPARE(expected.size(), 9);
+
+    Pipe pipe;
+    APNGHandler handler;
+    handler.setDevice(&pipe);
+
+    QVector<QImage> frames;
+    QImage frame;
+    for (int pos = 0; pos < file.size(); pos += step) {
+        pipe.feed(file.mid(pos, step));
+        while (frames.size() < expected.size() && handler.read(&frame)) {
+            frames.push_back(frame);
+        }
+    }
+    QCOMPARE(frames.size(), expected.size());
+    for (int i = 0; i < frames.size(); i++) {
+        QCOMPARE(frames.at(i), expected.at(i));
+    }
+    QCOMPARE(handler.imageCount(), expected.size());
+}
+
+// A frame can be read once its data chunk and the chunk header after it
+// are in, without waiting for the rest of the file
+void TestStream::frameOnArrival()
+{
+    const QByteArray file   = makeFile(6);
+    const QVector<int> data = frameDataChunks(file);
+    QCOMPARE(data.size(), 9);
+
+    Pipe pipe;
+    APNGHandler handler;
+    handler.setDevice(&pipe);
+    QImage frame;
+    int fed  = 0;
+    int read = 0;
+    for (int i = 0; i < data.size(); i++) {
+        const int end = qMin(file.size(), chunkEnd(file, data.at(i)) + 8);
+        pipe.feed(file.mid(fed, end - fed));
+        fed = end;
+        while (read <= i && handler.read(&frame)) {
+            read++;
+        }
+        QCOMPARE(read, i + 1);
+        // Nothing more than that
+        if (i + 1 < data.size()) {
+            QVERIFY(!handler.read(&frame));
+            QVERIFY(!handler.canRead());
+        }
+    }
+}
+
+// Random-access device that is still being written to
+void TestStream::growingBuffer()
+{
+    const QByteArray file         = makeFile(6);
+    const QVector<QImage> expected = referenceFrames(file);
+
+    QByteArray bytes;
+    QBuffer buffer(&bytes);
+    buffer.open(QIODevice::ReadOnly);
+    APNGHandler handler;
+    handler.setDevice(&buffer);
+    handler.setOption(QImageIOHandler::IncrementalReading, true);
+
+    QVector<QImage> frames;
+    QImage frame;
+    for (int pos = 0; pos < file.size(); pos += 333) {
+        bytes.append(file.mid(pos, 333));
+        while (frames.size() < expected.size() && handler.read(&frame)) {
+            frames.push_back(frame);
+        }
+    }
+    QCOMPARE(frames, expected);
+}
+
+// A stream that stops early ends when its device closes; what arrived
+// stays playable
+void TestStream::closedEarly()
+{
+    const QByteArray file   = makeFile(6);
+    const QVector<int> data = frameDataChunks(file);
+
+    Pipe pipe;
+    APNGHandler handler;
+    handler.setDevice(&pipe);
+    pipe.feed(file.left(chunkEnd(file, data.at(3)) + 8));
+    QImage frame;
+    int read = 0;
+    while (handler.read(&frame)) {
+        read++;
+    }
+    QCOMPARE(read, 4);
+
+    pipe.close();
+    QVERIFY(handler.read(&frame));  // frame 4 is missing, back to frame 0
+    QCOMPARE(handler.imageCount(), 4);
+    QCOMPARE(handler.currentImageNumber(), 1);
+}
+
+QTEST_MAIN(TestStream)
+#include "tst_stream.moc"
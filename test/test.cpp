@@ -9,7 +9,7 @@
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
-    QFile f("a.apng");
+    QFile f(argc > 1 ? QString::fromLocal8Bit(argv[1]) : "a.apng");
     if (!f.open(f.ReadOnly)) {
         qDebug() << f.errorString();
         return -1;
@@ -1,11 +1,6 @@
 QT += core gui widgets
 TARGET = test
 TEMPLATE = app 
-TARGET = test 
-SOURCES += test.cpp \
-    ../apnghandler.cpp
+SOURCES += test.cpp
 
-include(../libapng_static/libapng_static.pri)
-
-HEADERS += \
-    ../apnghandler.h
+include(common.pri)
@@ -0,0 +1,198 @@
+#include <QBuffer>
+#include <QtTest>
+
+#include "../../apnghandler.h"
+#include "../../apngscanner.h"
+#include "../apngsynth.h"
+
+struct Animation {
+    int loopCount = 0;
+    QVector<QImage> frames;
+    QVector<int> delays;
+};
+
+static Animation decode(QByteArray file)
+{
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::ReadOnly);
+    Animation a;
+    if (!APNGHandler::ensureParsed(&buffer, a.loopCount, a.frames,
+                                   a.delays)) {
+        a.frames.clear();
+    }
+    return a;
+}
+
+static QByteArray encode(const Animation &a, int quality = -1)
+{
+    QByteArray file;
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::WriteOnly);
+    if (!APNGHandler::writeAnimation(&buffer, a.frames, a.delays,
+                                     a.loopCount, quality)) {
+        return QByteArray();
+    }
+    return file;
+}
+
+// Transparent canvas with an opaque 8x8 square at `pos`
+static QImage sprite(const QPoint &pos)
+{
+    QImage image(64, 48, QImage::Format_ARGB32);
+    image.fill(0);
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            image.setPixel(pos.x() + x, pos.y() + y, 0xffcc2040);
+        }
+    }
+    return image;
+}
+
+class TestWrite : public QObject {
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void roundTrip_data();
+    void roundTrip();
+    void incremental();
+    void frameOps();
+};
+
+void TestWrite::initTestCase()
+{
+    APNGHandler::setSharedCacheBudget(0);
+}
+
+void TestWrite::cleanupTestCase()
+{
+    APNGHandler::setDefaultWriteThreads(0);
+}
+
+void TestWrite::roundTrip_data()
+{
+    QTest::addColumn<QByteArray>("file");
+    QTest::addColumn<int>("threads");
+    QTest::addColumn<int>("quality");
+
+    struct Row {
+        const char *name;
+        int width, height, frames, colorType, hold;
+        QVector<quint8> dispose, blend;
+    };
+    const Row rows[] = {
+        {"rgba8", 48, 40, 12, 6, 1, {0}, {0}},
+        {"rgba8-mixed", 48, 40, 12, 6, 1, {0, 1, 2}, {0, 1}},
+        {"rgb8-held", 48, 40, 12, 2, 3, {0}, {1}},
+        {"palette-over", 48, 40, 8, 3, 1, {1}, {1}},
+        // Several stripes per frame
+        {"rgba8-large", 640, 480, 4, 6, 1, {0, 2}, {1}},
+    };
+    for (const Row &r : rows) {
+        ApngSynthSpec spec;
+        spec.size       = QSize(r.width, r.height);
+        spec.frames     = r.frames;
+        spec.colorType  = r.colorType;
+        spec.hold       = r.hold;
+        spec.plays      = 3;
+        spec.disposeOps = r.dispose;
+        spec.blendOps   = r.blend;
+        const QByteArray file = apngSynthesize(spec);
+        const QByteArray name(r.name);
+        QTest::newRow(name + "-1") << file << 1 << -1;
+        QTest::newRow(name + "-threads") << file << 0 << -1;
+    }
+    ApngSynthSpec spec;
+    spec.size = QSize(48, 40);
+    QTest::newRow("stored") << apngSynthesize(spec) << 0 << 100;
+}
+
+// What the reader decodes from a written file is what was written
+void TestWrite::roundTrip()
+{
+    QFETCH(QByteArray, file);
+    QFETCH(int, threads);
+    QFETCH(int, quality);
+    APNGHandler::setDefaultWriteThreads(threads);
+
+    const Animation in = decode(file);
+    QVERIFY(!in.frames.isEmpty());
+    const QByteArray written = encode(in, quality);
+    QVERIFY(!written.isEmpty());
+
+    const Animation out = decode(written);
+    QCOMPARE(out.frames.size(), in.frames.size());
+    QCOMPARE(out.delays, in.delays);
+    QCOMPARE(out.loopCount, in.loopCount);
+    for (int i = 0; i < in.frames.size(); i++) {
+        QCOMPARE(out.frames.at(i).convertToFormat(QImage::Format_ARGB32),
+                 in.frames.at(i).convertToFormat(QImage::Format_ARGB32));
+    }
+}
+
+// write() leaves a complete animation after every frame
+void TestWrite::incremental()
+{
+    ApngSynthSpec spec;
+    spec.size       = QSize(48, 40);
+    spec.frames     = 6;
+    spec.disposeOps = {0, 1, 2};
+    spec.blendOps   = {0, 1};
+    const Animation in = decode(apngSynthesize(spec));
+    QCOMPARE(in.frames.size(), 6);
+
+    QByteArray file;
+    QBuffer buffer(&file);
+    buffer.open(QIODevice::WriteOnly);
+    APNGHandler handler;
+    handler.setDevice(&buffer);
+    for (int i = 0; i < in.frames.size(); i++) {
+        QImage frame = in.frames.at(i);
+        frame.setText(QStringLiteral("Delay"), QString::number(10 * i));
+        QVERIFY(handler.write(frame));
+
+        const Animation out = decode(file);
+        QCOMPARE(out.frames.size(), i + 1);
+        QCOMPARE(out.loopCount, -1);
+        for (int j = 0; j <= i; j++) {
+            QCOMPARE(out.frames.at(j), in.frames.at(j));
+            QCOMPARE(out.delays.at(j), 10 * j);
+        }
+    }
+}
+
+// A sprite moving over a transparent canvas: the first frame is disposed
+// to BACKGROUND so the second only covers the sprite, and a repeated
+// frame shrinks to a single pixel
+void TestWrite::frameOps()
+{
+    Animation in;
+    in.frames = {sprite(QPoint(0, 0)), sprite(QPoint(40, 30)),
+                 sprite(QPoint(40, 30))};
+    in.delays = {50, 50, 50};
+    const QByteArray written = encode(in);
+    QVERIFY(!written.isEmpty());
+
+    ApngInfo info;
+    QVERIFY(scanApng(reinterpret_cast<const uchar *>(written.constData()),
+                     written.size(), &info));
+    QCOMPARE(info.frames.size(), 3);
+    const ApngFrameInfo &first  = info.frames.at(0);
+    const ApngFrameInfo &second = info.frames.at(1);
+    const ApngFrameInfo &third  = info.frames.at(2);
+    QCOMPARE(first.disposeOp, quint8(1));
+    QCOMPARE(QRect(second.x, second.y, second.width, second.height),
+             QRect(40, 30, 8, 8));
+    QCOMPARE(second.disposeOp, quint8(0));
+    QCOMPARE(third.width * third.height, quint32(1));
+
+    const Animation out = decode(written);
+    QCOMPARE(out.frames.size(), 3);
+    for (int i = 0; i < 3; i++) {
+        QCOMPARE(out.frames.at(i), in.frames.at(i));
+    }
+}
+
+QTEST_MAIN(TestWrite)
+#include "tst_write.moc"
@@ -0,0 +1,7 @@
+QT += core gui testlib
+CONFIG += testcase
+TARGET = tst_write
+TEMPLATE = app
+SOURCES += tst_write.cpp
+
+include(../common.pri)